@@ -0,0 +1,301 @@
+#include "admin.h"
+#include "trace.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> /* close() */
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h> /* struct timeval */
+#include <netinet/in.h> /* sockaddr_in */
+#include <arpa/inet.h> /* htonl() */
+
+/** Largest request line the admin listener reads */
+#define ADMIN_REQ_SIZE  256
+
+/** Room for the full metrics page */
+#define ADMIN_RESP_SIZE 4096
+
+/**
+ * The admin listener struct
+ */
+struct admin {
+	pool_t *pool; /** The pool being administered */
+	int sfd; /** Listening socket, bound to 127.0.0.1 */
+	pthread_t thread; /** Thread running `admin_loop()` */
+	volatile int stop; /** Set by `admin_stop()` */
+};
+
+static void *admin_loop(void *arg);
+
+/**
+ * Starts an admin listener for a pool on 127.0.0.1. Requests are read one
+ * line per connection:
+ *   - `GET /metrics` (HTTP) or `stats` returns the pool counters in the
+ *     Prometheus text format
+ *   - `threads N` changes the number of worker threads
+ *   - `capacity N` changes the queue capacity
+ *   - `trace on` or `trace off` toggles task tracing
+ *   - `admission TARGET_US INTERVAL_US` sets admission control, 0 disables
+ *   - `watchdog MS` reports tasks running longer than MS and starts a
+ *     worker in place of each stuck one, 0 disables
+ * @param pool The pool to serve
+ * @param port The TCP port to listen on
+ * @return Returns an `admin_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+admin_t *admin_start(pool_t *pool, int port)
+{
+	int rc;
+	int on = 1;
+	admin_t *admin;
+	struct sockaddr_in sa;
+
+	if (pool == NULL || port <= 0 || port > 65535) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	admin = (admin_t *)calloc(1, sizeof(*admin));
+	if (admin == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	admin->pool = pool;
+
+	if ((admin->sfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		poolerrno = errno;
+		free(admin);
+		return NULL;
+	}
+
+	setsockopt(admin->sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	/* Never reachable from off the host */
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(admin->sfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(admin->sfd, 8) < 0) {
+		poolerrno = errno;
+		close(admin->sfd);
+		free(admin);
+		return NULL;
+	}
+
+	if ((rc = pthread_create(&admin->thread, NULL, admin_loop, admin)) != 0) {
+		poolerrno = rc;
+		close(admin->sfd);
+		free(admin);
+		return NULL;
+	}
+
+	return admin;
+}
+
+/**
+ * Stops the admin listener and waits for its thread to exit
+ * @param admin The listener to stop
+ */
+void admin_stop(admin_t *admin)
+{
+	if (admin == NULL)
+		return;
+
+	admin->stop = 1;
+
+	/* Wakes the thread out of accept() */
+	shutdown(admin->sfd, SHUT_RDWR);
+	pthread_join(admin->thread, NULL);
+	close(admin->sfd);
+
+	free(admin);
+}
+
+/**
+ * Writes the pool counters in the Prometheus text exposition format
+ * @param pool The pool to report on
+ * @param buf Output buffer
+ * @param size Size of `buf`
+ * @return Returns the number of bytes written, or -1 on error
+ */
+static int admin_metrics(pool_t *pool, char *buf, size_t size)
+{
+	pool_stats_t st;
+
+	if (pool_get_stats(pool, &st) < 0)
+		return -1;
+
+	return snprintf(buf, size,
+		"# HELP threadpool_threads Worker threads configured\n"
+		"# TYPE threadpool_threads gauge\n"
+		"threadpool_threads %zu\n"
+		"# HELP threadpool_threads_alive Worker threads running\n"
+		"# TYPE threadpool_threads_alive gauge\n"
+		"threadpool_threads_alive %zu\n"
+		"# HELP threadpool_threads_busy Worker threads running a task\n"
+		"# TYPE threadpool_threads_busy gauge\n"
+		"threadpool_threads_busy %zu\n"
+		"# HELP threadpool_queue_capacity Maximum queue depth\n"
+		"# TYPE threadpool_queue_capacity gauge\n"
+		"threadpool_queue_capacity %zu\n"
+		"# HELP threadpool_queue_depth Items waiting in the queue\n"
+		"# TYPE threadpool_queue_depth gauge\n"
+		"threadpool_queue_depth %zu\n"
+		"# HELP threadpool_queue_segments Queue segments allocated\n"
+		"# TYPE threadpool_queue_segments gauge\n"
+		"threadpool_queue_segments %zu\n"
+		"# HELP threadpool_threads_stalled Workers stuck in a task\n"
+		"# TYPE threadpool_threads_stalled gauge\n"
+		"threadpool_threads_stalled %zu\n"
+		"# HELP threadpool_enqueued_total Items accepted into the queue\n"
+		"# TYPE threadpool_enqueued_total counter\n"
+		"threadpool_enqueued_total %llu\n"
+		"# HELP threadpool_dequeued_total Items taken by a worker\n"
+		"# TYPE threadpool_dequeued_total counter\n"
+		"threadpool_dequeued_total %llu\n"
+		"# HELP threadpool_completed_total Tasks that returned\n"
+		"# TYPE threadpool_completed_total counter\n"
+		"threadpool_completed_total %llu\n"
+		"# HELP threadpool_cancelled_total Items skipped, cancelled or expired\n"
+		"# TYPE threadpool_cancelled_total counter\n"
+		"threadpool_cancelled_total %llu\n"
+		"# HELP threadpool_shed_total Items shed by admission control\n"
+		"# TYPE threadpool_shed_total counter\n"
+		"threadpool_shed_total %llu\n"
+		"# HELP threadpool_rejected_total Items refused, queue full\n"
+		"# TYPE threadpool_rejected_total counter\n"
+		"threadpool_rejected_total %llu\n"
+		"# HELP threadpool_stalls_total Tasks flagged by the watchdog\n"
+		"# TYPE threadpool_stalls_total counter\n"
+		"threadpool_stalls_total %llu\n"
+		"# HELP threadpool_hedged_total Duplicates of stalled hedged tasks\n"
+		"# TYPE threadpool_hedged_total counter\n"
+		"threadpool_hedged_total %llu\n"
+		"# HELP threadpool_tracing Whether task tracing is on\n"
+		"# TYPE threadpool_tracing gauge\n"
+		"threadpool_tracing %d\n"
+		"# HELP threadpool_log_dropped_total Log messages dropped, ring full\n"
+		"# TYPE threadpool_log_dropped_total counter\n"
+		"threadpool_log_dropped_total %llu\n",
+		st.nthreads, st.nalive, st.nbusy, st.capacity, st.count,
+		st.nsegments, st.nstalled,
+		(unsigned long long)st.nenqueued, (unsigned long long)st.ndequeued,
+		(unsigned long long)st.ncompleted, (unsigned long long)st.ncancelled,
+		(unsigned long long)st.nshed, (unsigned long long)st.nrejected,
+		(unsigned long long)st.nstalls, (unsigned long long)st.nhedged,
+		trace_is_enabled(), (unsigned long long)log_dropped());
+}
+
+/**
+ * Runs one admin command and writes the reply
+ * @param admin The admin listener
+ * @param req The request line, NUL terminated, without the newline
+ * @param buf Output buffer
+ * @param size Size of `buf`
+ * @return Returns the number of bytes written to `buf`
+ */
+static int admin_command(admin_t *admin, const char *req, char *buf,
+	size_t size)
+{
+	int n;
+	int rc = 0;
+	unsigned long val;
+	unsigned long val2;
+	char arg[16];
+
+	if (strncmp(req, "GET ", 4) == 0) {
+		char body[ADMIN_RESP_SIZE];
+
+		if (strncmp(req + 4, "/metrics", 8) != 0 ||
+		    (req[12] != ' ' && req[12] != '\0')) {
+			return snprintf(buf, size, "HTTP/1.0 404 Not Found\r\n"
+				"Content-Length: 0\r\n\r\n");
+		}
+		if ((n = admin_metrics(admin->pool, body, sizeof(body))) < 0)
+			return snprintf(buf, size, "HTTP/1.0 500 Error\r\n\r\n");
+		return snprintf(buf, size, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %d\r\n\r\n%s", n, body);
+	}
+
+	if (strcmp(req, "stats") == 0) {
+		if ((n = admin_metrics(admin->pool, buf, size)) >= 0)
+			return n;
+		rc = -1;
+	} else if (sscanf(req, "threads %lu", &val) == 1) {
+		rc = pool_set_threads(admin->pool, val);
+	} else if (sscanf(req, "capacity %lu", &val) == 1) {
+		rc = pool_set_queue_capacity(admin->pool, val);
+	} else if (sscanf(req, "admission %lu %lu", &val, &val2) == 2) {
+		rc = pool_set_admission(admin->pool, val, val2);
+	} else if (sscanf(req, "watchdog %lu", &val) == 1) {
+		rc = pool_set_watchdog(admin->pool, val, POOL_WATCHDOG_REPLACE);
+	} else if (sscanf(req, "trace %15s", arg) == 1 &&
+	           (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)) {
+		trace_set_enabled(strcmp(arg, "on") == 0);
+	} else {
+		return snprintf(buf, size, "error: unknown command\n");
+	}
+
+	if (rc < 0)
+		return snprintf(buf, size, "error: %s\n", poolerrno_str(poolerrno));
+
+	return snprintf(buf, size, "ok\n");
+}
+
+/**
+ * The admin thread. Serves one connection at a time, which is plenty for
+ * a scraper and an operator.
+ * @param arg This must be the `admin_t` object
+ * @return Always returns NULL
+ */
+static void *admin_loop(void *arg)
+{
+	admin_t *admin = (admin_t *)arg;
+	char req[ADMIN_REQ_SIZE];
+	char resp[ADMIN_RESP_SIZE + 256];
+	struct timeval tv = { 1, 0 };
+	ssize_t n;
+	size_t len;
+	int cfd;
+
+	while (!admin->stop) {
+		if ((cfd = accept(admin->sfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		/* A silent client must not wedge the admin thread */
+		setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		len = 0;
+		while (len < sizeof(req) - 1) {
+			if ((n = read(cfd, req + len, sizeof(req) - 1 - len)) <= 0)
+				break;
+			len += n;
+			if (memchr(req, '\n', len) != NULL)
+				break;
+		}
+		req[len] = '\0';
+		req[strcspn(req, "\r\n")] = '\0';
+
+		if ((n = admin_command(admin, req, resp, sizeof(resp))) > 0) {
+			if ((size_t)n >= sizeof(resp))
+				n = sizeof(resp) - 1;
+			if (write(cfd, resp, n) < 0) {
+				/* The client went away, nothing to do */
+			}
+		}
+
+		close(cfd);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef ADMIN_H_
+#define ADMIN_H_
+
+#include "pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Forward declaration of the admin listener. It serves a pool's counters
+ * and accepts reconfiguration commands on a localhost-only TCP port.
+ */
+typedef struct admin admin_t;
+
+/*-----------------*
+ * ADMIN API CALLS *
+ *-----------------*/
+
+admin_t *admin_start(pool_t *pool, int port);
+void admin_stop(admin_t *admin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADMIN_H_ */
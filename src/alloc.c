@@ -0,0 +1,404 @@
+#include "alloc.h"
+#include "pool.h"
+#include <stddef.h> /* offsetof() */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/** Number of small size classes; sizes are 16, 32, 64, ... 4096 bytes */
+#define ALLOC_NCLASSES     9
+#define ALLOC_MIN_SHIFT    4
+#define ALLOC_MAX_SIZE     (1u << (ALLOC_MIN_SHIFT + ALLOC_NCLASSES - 1))
+
+/** Size class stored in the header of blocks that came from malloc() */
+#define ALLOC_CLASS_LARGE  ALLOC_NCLASSES
+
+/** Size of each slab carved into small blocks */
+#define ALLOC_SLAB_SIZE    (64 * 1024)
+
+/** Size of each bump-pointer arena chunk */
+#define ALLOC_ARENA_SIZE   (64 * 1024)
+
+/** Remote frees are returned to their owner in batches of this many */
+#define ALLOC_BATCH        32
+
+/** Number of owners a cache can batch remote frees for at once */
+#define ALLOC_NPENDING     8
+
+/**
+ * Header in front of every block handed out by `pool_task_alloc()`. It is
+ * 16 bytes so the user pointer keeps malloc()'s alignment. While a block
+ * is free, the user area holds the `next` link.
+ */
+typedef struct block {
+	alloc_cache_t *owner; /** Cache the block belongs to, NULL if large */
+	uint32_t cls; /** Size class index, or ALLOC_CLASS_LARGE */
+	uint32_t pad; /** Unused, keeps the header at 16 bytes */
+	struct block *next; /** Free list link, overlaps the user area */
+} block_t;
+
+#define BLOCK_HDR_SIZE offsetof(block_t, next)
+
+/**
+ * A chain of blocks freed by this thread that belong to another cache.
+ * The chain is pushed to the owner with a single atomic operation.
+ */
+typedef struct {
+	alloc_cache_t *owner; /** Destination cache, NULL if slot is unused */
+	block_t *head; /** First block of the chain */
+	block_t *tail; /** Last block of the chain */
+	size_t n; /** Number of blocks in the chain */
+} pending_t;
+
+/** A chunk of memory owned by a cache, either a slab or an arena chunk */
+typedef struct chunk {
+	struct chunk *next; /** Next chunk in the list */
+	size_t size; /** Usable bytes following this header */
+} chunk_t;
+
+/**
+ * The per-worker allocation cache. Everything except `remote` is only
+ * touched by the owning worker thread.
+ */
+struct alloc_cache {
+	block_t *free[ALLOC_NCLASSES]; /** Local free lists per size class */
+	_Atomic(block_t *) remote; /** Blocks returned by other threads */
+	pending_t pending[ALLOC_NPENDING]; /** Outgoing remote-free batches */
+	chunk_t *slabs; /** All slabs, released with the cache */
+	unsigned char *slab_cur; /** Carve point in the newest slab */
+	unsigned char *slab_end; /** End of the newest slab */
+	chunk_t *arena; /** Arena chunks, newest first */
+	unsigned char *arena_cur; /** Bump pointer in the newest arena chunk */
+	unsigned char *arena_end; /** End of the newest arena chunk */
+};
+
+/** The cache of the worker running on this thread, NULL elsewhere */
+static __thread alloc_cache_t *self = NULL;
+
+/**
+ * Allocates a new, empty allocation cache
+ * @return Returns the cache on success. On error, NULL is returned and
+ *   `poolerrno` is set.
+ */
+alloc_cache_t *alloc_cache_new(void)
+{
+	alloc_cache_t *cache;
+
+	cache = (alloc_cache_t *)calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	atomic_init(&cache->remote, NULL);
+
+	return cache;
+}
+
+/**
+ * Releases a cache and every slab and arena chunk it owns. Blocks that
+ * were allocated from the cache become invalid, so all task memory must be
+ * freed before the pool that owns the cache is freed.
+ * @param cache The cache to free
+ */
+void alloc_cache_free(alloc_cache_t *cache)
+{
+	chunk_t *c;
+
+	if (cache == NULL)
+		return;
+
+	while ((c = cache->slabs) != NULL) {
+		cache->slabs = c->next;
+		free(c);
+	}
+
+	while ((c = cache->arena) != NULL) {
+		cache->arena = c->next;
+		free(c);
+	}
+
+	free(cache);
+}
+
+/**
+ * Makes `cache` the allocation cache of the calling thread. Called once by
+ * each worker thread before it starts running tasks.
+ * @param cache The cache owned by the calling worker
+ */
+void alloc_cache_bind(alloc_cache_t *cache)
+{
+	self = cache;
+}
+
+/**
+ * Maps an allocation size to its size class
+ * @param size Requested size in bytes, at most ALLOC_MAX_SIZE
+ * @return Returns the size class index
+ */
+static inline uint32_t size_class(size_t size)
+{
+	uint32_t cls = 0;
+
+	size = (size + (1u << ALLOC_MIN_SHIFT) - 1) >> ALLOC_MIN_SHIFT;
+	while ((1u << cls) < size)
+		cls++;
+
+	return cls;
+}
+
+/**
+ * Pushes a chain of blocks onto the remote-free stack of their owner
+ * @param owner The cache that owns every block in the chain
+ * @param head First block of the chain
+ * @param tail Last block of the chain
+ */
+static void remote_push(alloc_cache_t *owner, block_t *head, block_t *tail)
+{
+	block_t *old = atomic_load_explicit(&owner->remote, memory_order_relaxed);
+
+	do {
+		tail->next = old;
+	} while (!atomic_compare_exchange_weak_explicit(&owner->remote, &old,
+		head, memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * Sends one outgoing batch to its owner and clears the slot
+ * @param p The pending batch to flush
+ */
+static void pending_flush(pending_t *p)
+{
+	if (p->owner != NULL && p->head != NULL)
+		remote_push(p->owner, p->head, p->tail);
+
+	memset(p, 0, sizeof(*p));
+}
+
+/**
+ * Moves everything other threads have returned to this cache onto the
+ * local free lists. One atomic exchange takes the whole stack.
+ * @param cache The calling worker's cache
+ */
+static void remote_drain(alloc_cache_t *cache)
+{
+	block_t *b;
+	block_t *next;
+
+	b = atomic_exchange_explicit(&cache->remote, NULL, memory_order_acquire);
+	for (; b != NULL; b = next) {
+		next = b->next;
+		b->next = cache->free[b->cls];
+		cache->free[b->cls] = b;
+	}
+}
+
+/**
+ * Carves a new block of size class `cls` from the current slab, starting a
+ * new slab if the current one is used up
+ * @param cache The calling worker's cache
+ * @param cls The size class of the block
+ * @return Returns the new block, or NULL if out of memory
+ */
+static block_t *slab_carve(alloc_cache_t *cache, uint32_t cls)
+{
+	block_t *b;
+	size_t need = BLOCK_HDR_SIZE + ((size_t)1 << (cls + ALLOC_MIN_SHIFT));
+
+	if ((size_t)(cache->slab_end - cache->slab_cur) < need) {
+		chunk_t *c = (chunk_t *)malloc(ALLOC_SLAB_SIZE);
+		if (c == NULL)
+			return NULL;
+		c->next = cache->slabs;
+		c->size = ALLOC_SLAB_SIZE - sizeof(*c);
+		cache->slabs = c;
+		cache->slab_cur = (unsigned char *)(c + 1);
+		cache->slab_end = cache->slab_cur + c->size;
+	}
+
+	b = (block_t *)cache->slab_cur;
+	cache->slab_cur += need;
+	b->owner = cache;
+	b->cls = cls;
+
+	return b;
+}
+
+/**
+ * Allocates memory for use by a task. On a worker thread, requests up to
+ * 4 KiB are served from the worker's own size-class free lists without
+ * locking. Larger requests, and requests made outside a worker, fall back
+ * to malloc(). The memory may be freed from any thread with
+ * `pool_task_free()`, but must be freed before the pool is freed.
+ * @param size Number of bytes to allocate
+ * @return Returns a pointer aligned like malloc(). On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+void *pool_task_alloc(size_t size)
+{
+	alloc_cache_t *cache = self;
+	block_t *b;
+	uint32_t cls;
+
+	if (cache == NULL || size > ALLOC_MAX_SIZE) {
+		b = (block_t *)malloc(BLOCK_HDR_SIZE + size);
+		if (b == NULL) {
+			poolerrno = ENOMEM;
+			return NULL;
+		}
+		b->owner = NULL;
+		b->cls = ALLOC_CLASS_LARGE;
+		return &b->next;
+	}
+
+	cls = size_class(size);
+
+	if ((b = cache->free[cls]) == NULL) {
+		remote_drain(cache);
+		if ((b = cache->free[cls]) == NULL) {
+			if ((b = slab_carve(cache, cls)) == NULL) {
+				poolerrno = ENOMEM;
+				return NULL;
+			}
+			return &b->next;
+		}
+	}
+
+	cache->free[cls] = b->next;
+
+	return &b->next;
+}
+
+/**
+ * Frees memory returned by `pool_task_alloc()`. Blocks owned by the
+ * calling worker go straight back on its free list. Blocks owned by
+ * another worker are batched and returned to it in one atomic push.
+ * @param ptr The memory to free, may be NULL
+ */
+void pool_task_free(void *ptr)
+{
+	alloc_cache_t *cache = self;
+	block_t *b;
+	pending_t *p;
+
+	if (ptr == NULL)
+		return;
+
+	b = (block_t *)((unsigned char *)ptr - BLOCK_HDR_SIZE);
+
+	if (b->owner == NULL) {
+		free(b);
+		return;
+	}
+
+	if (b->owner == cache) {
+		b->next = cache->free[b->cls];
+		cache->free[b->cls] = b;
+		return;
+	}
+
+	/* Not a worker, so there is nowhere to batch. Return it directly */
+	if (cache == NULL) {
+		remote_push(b->owner, b, b);
+		return;
+	}
+
+	p = &cache->pending[((uintptr_t)b->owner >> 6) % ALLOC_NPENDING];
+	if (p->owner != b->owner) {
+		pending_flush(p);
+		p->owner = b->owner;
+	}
+
+	b->next = p->head;
+	p->head = b;
+	if (p->tail == NULL)
+		p->tail = b;
+
+	if (++p->n == ALLOC_BATCH)
+		pending_flush(p);
+}
+
+/**
+ * Allocates scratch memory from the calling worker's bump-pointer arena.
+ * The memory must not be freed; it is reclaimed all at once when the
+ * current task returns. Only valid on a worker thread.
+ * @param size Number of bytes to allocate
+ * @return Returns a pointer aligned to 16 bytes. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+void *pool_task_arena_alloc(size_t size)
+{
+	alloc_cache_t *cache = self;
+	void *ptr;
+
+	if (cache == NULL) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	size = (size + 15) & ~(size_t)15;
+
+	if ((size_t)(cache->arena_end - cache->arena_cur) < size) {
+		size_t csize = sizeof(chunk_t) + size;
+		chunk_t *c;
+
+		if (csize < ALLOC_ARENA_SIZE)
+			csize = ALLOC_ARENA_SIZE;
+		if ((c = (chunk_t *)malloc(csize)) == NULL) {
+			poolerrno = ENOMEM;
+			return NULL;
+		}
+		c->next = cache->arena;
+		c->size = csize - sizeof(*c);
+		cache->arena = c;
+		cache->arena_cur = (unsigned char *)(c + 1);
+		cache->arena_end = cache->arena_cur + c->size;
+	}
+
+	ptr = cache->arena_cur;
+	cache->arena_cur += size;
+
+	return ptr;
+}
+
+/**
+ * Called by a worker after each task. Resets the arena, keeping only its
+ * oldest chunk. Outgoing remote-free batches are left to fill up; see
+ * `alloc_cache_flush()`.
+ */
+void alloc_task_end(void)
+{
+	alloc_cache_t *cache = self;
+	chunk_t *c;
+
+	if (cache == NULL || cache->arena == NULL)
+		return;
+
+	while (cache->arena->next != NULL) {
+		c = cache->arena;
+		cache->arena = c->next;
+		free(c);
+	}
+
+	cache->arena_cur = (unsigned char *)(cache->arena + 1);
+	cache->arena_end = cache->arena_cur + cache->arena->size;
+}
+
+/**
+ * Called by a worker before it waits for work or exits. Sends every
+ * partly filled remote-free batch to its owner, so memory never sits on
+ * a worker that has stopped freeing. A busy worker only sends a batch
+ * once it is full, one atomic push per `ALLOC_BATCH` frees.
+ */
+void alloc_cache_flush(void)
+{
+	alloc_cache_t *cache = self;
+
+	if (cache == NULL)
+		return;
+
+	for (size_t i = 0; i < ALLOC_NPENDING; i++)
+		if (cache->pending[i].n != 0)
+			pending_flush(&cache->pending[i]);
+}
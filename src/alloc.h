@@ -0,0 +1,31 @@
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stdlib.h> /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Forward declaration of the per-worker allocation cache. Each worker
+ * thread owns one cache, which backs `pool_task_alloc()`,
+ * `pool_task_free()` and `pool_task_arena_alloc()` for tasks it runs.
+ */
+typedef struct alloc_cache alloc_cache_t;
+
+/*-----------------------------------*
+ * WORKER ALLOCATION CACHE (PRIVATE) *
+ *-----------------------------------*/
+
+alloc_cache_t *alloc_cache_new(void);
+void alloc_cache_free(alloc_cache_t *cache);
+void alloc_cache_bind(alloc_cache_t *cache);
+void alloc_task_end(void);
+void alloc_cache_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ALLOC_H_ */
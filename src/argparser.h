@@ -38,7 +38,7 @@ Options\n\
   -?, --help\n\
 \n\
 Report bugs to <rory.rudolph@outlook.com>\n",
-	MAX_QUEUE_CAPACITY, DEFAULT_PORT, MAX_WORKER_THREADS);
+	DEFAULT_QUEUE_CAPACITY, DEFAULT_PORT, MAX_WORKER_THREADS);
 }
 
 /**
@@ -0,0 +1,332 @@
+#include "batch.h"
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * A batch in flight. The handler and its context are copied in so the
+ * batcher may be freed while batches are still queued on the pool.
+ */
+typedef struct {
+	batch_fn_t fn; /** The handler */
+	void *ctx; /** Passed to `fn` */
+	size_t n; /** Number of items */
+	void *items[]; /** The items */
+} batch_task_t;
+
+/**
+ * The batcher struct
+ */
+struct batcher {
+	pool_t *pool; /** Pool the batches run on */
+	batch_fn_t fn; /** The handler */
+	void *ctx; /** Passed to `fn` */
+	size_t max; /** Largest batch */
+	uint64_t delay; /** Longest an item waits for its batch, in ns */
+	pthread_t timer; /** Sends batches whose oldest item timed out */
+	pthread_mutex_t mtx; /** Protects everything below */
+	pthread_cond_t cnd; /** Wakes the timer thread */
+	int stopping; /** Set by `batch_free()` */
+	void **items; /** Items waiting, `max` slots */
+	size_t count; /** Number of items waiting */
+	size_t target; /** Send a batch once this many items wait */
+	uint64_t deadline; /** `pool_now()` time the oldest item times out */
+	uint64_t last_sent; /** `pool_now()` time the last batch was sent */
+	batch_stats_t stats; /** Counters; `target` and `count` filled on read */
+};
+
+static int batch_send(batcher_t *b, int timed_out);
+static void *batch_loop(void *arg);
+static void batch_run(void *arg);
+static void batch_cancel(void *arg);
+
+/**
+ * Creates a batcher. Items are sent to `fn` as one task once enough of
+ * them are waiting, or once the oldest has waited `max_delay_us`. How many
+ * is enough adapts to the arrival rate: the target doubles when it is
+ * reached within one delay of the previous batch, and drops to what
+ * actually arrived when the delay runs out first. Light traffic therefore
+ * sends items one at a time with no added latency, and heavy traffic
+ * fills batches up to `max_items`.
+ * @param pool The pool to run batches on
+ * @param fn The handler
+ * @param ctx Passed to `fn`
+ * @param max_items Largest batch, at most `BATCH_MAX_ITEMS`
+ * @param max_delay_us Longest an item waits for its batch, in us
+ * @return Returns a `batcher_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+batcher_t *batch_new(pool_t *pool, batch_fn_t fn, void *ctx,
+	size_t max_items, unsigned long max_delay_us)
+{
+	int rc;
+	batcher_t *b;
+	pthread_condattr_t attr;
+
+	if (pool == NULL || fn == NULL || max_items == 0 ||
+	    max_items > BATCH_MAX_ITEMS || max_delay_us == 0) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	b = (batcher_t *)calloc(1, sizeof(*b));
+	if (b == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	b->items = (void **)malloc(max_items * sizeof(*b->items));
+	if (b->items == NULL) {
+		free(b);
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	b->pool = pool;
+	b->fn = fn;
+	b->ctx = ctx;
+	b->max = max_items;
+	b->delay = (uint64_t)max_delay_us * 1000;
+	b->target = 1;
+
+	/* Deadlines are pool_now() times, so wait on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&b->mtx, NULL);
+	pthread_cond_init(&b->cnd, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if ((rc = pthread_create(&b->timer, NULL, batch_loop, b)) != 0) {
+		pthread_cond_destroy(&b->cnd);
+		pthread_mutex_destroy(&b->mtx);
+		free(b->items);
+		free(b);
+		poolerrno = rc;
+		return NULL;
+	}
+
+	return b;
+}
+
+/**
+ * Sends the waiting items, stops the timer and frees the batcher. Batches
+ * already on the pool still run. If the last batch cannot be enqueued, the
+ * handler is called with it on this thread with `cancelled` set.
+ * @param b The batcher, or NULL
+ */
+void batch_free(batcher_t *b)
+{
+	if (b == NULL)
+		return;
+
+	pthread_mutex_lock(&b->mtx);
+	b->stopping = 1;
+	pthread_cond_signal(&b->cnd);
+	pthread_mutex_unlock(&b->mtx);
+
+	pthread_join(b->timer, NULL);
+
+	if (b->count > 0 && batch_send(b, 0) < 0)
+		(*b->fn)(b->items, b->count, 1, b->ctx);
+
+	pthread_cond_destroy(&b->cnd);
+	pthread_mutex_destroy(&b->mtx);
+	free(b->items);
+	free(b);
+}
+
+/**
+ * Adds an item to the next batch, sending the batch if it has reached the
+ * target size. If the pool refuses a batch, its items keep waiting and the
+ * timer retries; only once `max_items` are waiting is the new item refused.
+ * @param b The batcher
+ * @param item The item, handed to the handler as is
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int batch_add(batcher_t *b, void *item)
+{
+	if (b == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+
+	if (b->count >= b->max && batch_send(b, 0) < 0) {
+		pthread_mutex_unlock(&b->mtx);
+		return -1;
+	}
+
+	if (b->count == 0) {
+		b->deadline = pool_now() + b->delay;
+		pthread_cond_signal(&b->cnd);
+	}
+
+	b->items[b->count++] = item;
+	b->stats.nitems++;
+
+	if (b->count >= b->target)
+		(void)batch_send(b, 0);
+
+	pthread_mutex_unlock(&b->mtx);
+
+	return 0;
+}
+
+/**
+ * Sends the waiting items now, whatever their number
+ * @param b The batcher
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int batch_flush(batcher_t *b)
+{
+	int ret = 0;
+
+	if (b == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+	if (b->count > 0)
+		ret = batch_send(b, 0);
+	pthread_mutex_unlock(&b->mtx);
+
+	return ret;
+}
+
+/**
+ * Copies a batcher's counters
+ * @param b The batcher
+ * @param stats This variable is filled with the counters
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int batch_get_stats(batcher_t *b, batch_stats_t *stats)
+{
+	if (b == NULL || stats == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&b->mtx);
+	*stats = b->stats;
+	stats->target = b->target;
+	stats->count = b->count;
+	pthread_mutex_unlock(&b->mtx);
+
+	return 0;
+}
+
+/**
+ * Enqueues the waiting items as one task and adapts the target size. Must
+ * be called with the batcher mutex held, or after the timer has stopped.
+ * @param b The batcher
+ * @param timed_out Non-zero if the oldest item's delay ran out
+ * @return Returns 0 on success. On error, less than 0 is returned,
+ *   `poolerrno` is set, and the items keep waiting.
+ */
+static int batch_send(batcher_t *b, int timed_out)
+{
+	batch_task_t *t;
+	pool_task_opts_t opts = { 0 };
+	uint64_t now;
+
+	t = (batch_task_t *)pool_task_alloc(offsetof(batch_task_t, items) +
+		b->count * sizeof(*b->items));
+	if (t == NULL)
+		return -1;
+
+	t->fn = b->fn;
+	t->ctx = b->ctx;
+	t->n = b->count;
+	memcpy(t->items, b->items, b->count * sizeof(*b->items));
+
+	opts.cancel = batch_cancel;
+	if (pool_enqueue_opts(b->pool, batch_run, t, &opts) < 0) {
+		pool_task_free(t);
+		return -1;
+	}
+
+	now = pool_now();
+	if (timed_out) {
+		b->target = b->count;
+		b->stats.ntimer++;
+	} else if (b->count >= b->target) {
+		/* Only grow while batches fill faster than one per delay */
+		if (now - b->last_sent < b->delay)
+			b->target = b->target * 2 < b->max ? b->target * 2 : b->max;
+		b->stats.nfull++;
+	}
+	b->last_sent = now;
+
+	b->stats.nbatches++;
+	b->count = 0;
+
+	return 0;
+}
+
+/**
+ * The timer thread. Sleeps until the oldest waiting item times out, then
+ * sends whatever has arrived.
+ * @param arg The batcher
+ * @return Always returns NULL
+ */
+static void *batch_loop(void *arg)
+{
+	batcher_t *b = (batcher_t *)arg;
+	struct timespec ts;
+	uint64_t now;
+
+	pthread_mutex_lock(&b->mtx);
+
+	while (!b->stopping) {
+		if (b->count == 0) {
+			pthread_cond_wait(&b->cnd, &b->mtx);
+			continue;
+		}
+
+		if ((now = pool_now()) >= b->deadline) {
+			/* Pool full: try again after another delay */
+			if (batch_send(b, 1) < 0)
+				b->deadline = now + b->delay;
+			continue;
+		}
+
+		ts.tv_sec = b->deadline / 1000000000ULL;
+		ts.tv_nsec = b->deadline % 1000000000ULL;
+		pthread_cond_timedwait(&b->cnd, &b->mtx, &ts);
+	}
+
+	pthread_mutex_unlock(&b->mtx);
+
+	return NULL;
+}
+
+/**
+ * Pool task: hands a batch to its handler
+ * @param arg The `batch_task_t`
+ */
+static void batch_run(void *arg)
+{
+	batch_task_t *t = (batch_task_t *)arg;
+
+	(*t->fn)(t->items, t->n, 0, t->ctx);
+	pool_task_free(t);
+}
+
+/**
+ * Pool cancel callback: lets the handler release a skipped batch
+ * @param arg The `batch_task_t`
+ */
+static void batch_cancel(void *arg)
+{
+	batch_task_t *t = (batch_task_t *)arg;
+
+	(*t->fn)(t->items, t->n, 1, t->ctx);
+	pool_task_free(t);
+}
@@ -0,0 +1,60 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "pool.h"
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Largest batch a batcher will hand to its handler */
+#define BATCH_MAX_ITEMS 1024
+
+/**
+ * Handles a batch of items on a pool worker. `items` is only valid during
+ * the call. If the pool skipped the batch instead of running it, e.g.
+ * because it was freed, the handler is called with `cancelled` set so it
+ * can release the items.
+ * @param items The items, in the order they were added
+ * @param n Number of items
+ * @param cancelled Non-zero if the batch was skipped by the pool
+ * @param ctx The `ctx` passed to `batch_new()`
+ */
+typedef void (*batch_fn_t)(void **items, size_t n, int cancelled, void *ctx);
+
+/**
+ * Forward declaration of a batcher. It collects items for one handler and
+ * enqueues them on a pool as a single task.
+ */
+typedef struct batcher batcher_t;
+
+/**
+ * A snapshot of a batcher's counters, filled by `batch_get_stats()`
+ */
+typedef struct {
+	uint64_t nitems; /** Items added */
+	uint64_t nbatches; /** Batches enqueued on the pool */
+	uint64_t nfull; /** Batches sent because they reached the target size */
+	uint64_t ntimer; /** Batches sent because the oldest item timed out */
+	size_t target; /** Current target batch size */
+	size_t count; /** Items waiting for the next batch */
+} batch_stats_t;
+
+/*-----------------*
+ * BATCH API CALLS *
+ *-----------------*/
+
+batcher_t *batch_new(pool_t *pool, batch_fn_t fn, void *ctx,
+	size_t max_items, unsigned long max_delay_us);
+void batch_free(batcher_t *b);
+int batch_add(batcher_t *b, void *item);
+int batch_flush(batcher_t *b);
+int batch_get_stats(batcher_t *b, batch_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BATCH_H_ */
@@ -0,0 +1,565 @@
+#include "cache.h"
+#include "pool.h"
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/** End of a bucket chain */
+#define CACHE_NONE UINT32_MAX
+
+/**
+ * A caller waiting for an in-flight computation
+ */
+typedef struct cache_waiter {
+	cache_wait_t fn; /** Called with the value */
+	void *ctx; /** Passed to `fn` */
+	struct cache_waiter *next; /** Next waiter, most recent first */
+} cache_waiter_t;
+
+/**
+ * Lifecycle of a cache entry
+ */
+typedef enum {
+	ENTRY_FREE = 0, /** Unused */
+	ENTRY_PENDING, /** Key claimed by a caller that is computing the value */
+	ENTRY_READY, /** Key and value cached */
+} entry_state_t;
+
+/**
+ * A cache entry. The key and value share one allocation, value after key.
+ */
+typedef struct {
+	uint64_t hash; /** Hash of the key */
+	unsigned char *data; /** The key followed by the value */
+	size_t klen; /** Key length */
+	size_t vlen; /** Value length, 0 while pending */
+	uint64_t expires; /** pool_now() time the value goes stale */
+	entry_state_t state; /** Entry state */
+	int ref; /** CLOCK reference bit, set on every hit */
+	uint32_t next; /** Next entry in the same bucket, or CACHE_NONE */
+	cache_waiter_t *waiters; /** Callers waiting on a pending entry */
+} cache_entry_t;
+
+/**
+ * A cache shard. Keys are spread over the shards by hash so concurrent
+ * callers rarely contend on the same mutex.
+ */
+typedef struct {
+	pthread_mutex_t mtx; /** Protects everything below */
+	cache_entry_t *entries; /** Fixed entry array, swept by the CLOCK hand */
+	size_t nentries; /** Number of entries */
+	uint32_t *buckets; /** Hash index heads, CACHE_NONE if empty */
+	size_t mask; /** Number of buckets minus one */
+	size_t hand; /** CLOCK hand */
+	size_t bytes; /** Key and value bytes held */
+	size_t max_bytes; /** Bound on `bytes` */
+} cache_shard_t;
+
+/**
+ * The cache struct
+ */
+struct cache {
+	cache_shard_t shards[CACHE_SHARDS]; /** The shards */
+	uint64_t ttl; /** Time to live of a value in ns, 0 for forever */
+};
+
+static uint64_t cache_hash(const void *key, size_t len);
+static cache_entry_t *entry_find(cache_shard_t *shard, uint64_t hash,
+	const void *key, size_t klen);
+static void entry_evict(cache_shard_t *shard, cache_entry_t *e);
+static cache_entry_t *entry_claim(cache_shard_t *shard, uint64_t now);
+static void waiters_run(cache_waiter_t *w, const void *val, size_t len);
+
+/**
+ * Creates a cache
+ * @param nentries Most entries held, pending computations included
+ * @param nbytes Most key and value bytes held
+ * @param ttl_ns How long a value stays valid, in ns, or 0 for forever
+ * @return Returns a `cache_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+cache_t *cache_new(size_t nentries, size_t nbytes, uint64_t ttl_ns)
+{
+	int rc;
+	cache_t *cache;
+	size_t per;
+	size_t nb;
+
+	if (nentries == 0 || nbytes == 0 || nentries > UINT32_MAX / 2) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	cache = (cache_t *)calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	cache->ttl = ttl_ns;
+
+	per = (nentries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	for (nb = 1; nb < per * 2; nb <<= 1)
+		;
+
+	for (size_t i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_t *shard = &cache->shards[i];
+
+		shard->nentries = per;
+		shard->mask = nb - 1;
+		shard->max_bytes = nbytes / CACHE_SHARDS > 0 ?
+			nbytes / CACHE_SHARDS : 1;
+
+		shard->entries = (cache_entry_t *)calloc(per, sizeof(*shard->entries));
+		shard->buckets = (uint32_t *)malloc(nb * sizeof(*shard->buckets));
+		if (shard->entries == NULL || shard->buckets == NULL) {
+			free(shard->entries);
+			free(shard->buckets);
+			shard->entries = NULL;
+			cache_free(cache);
+			poolerrno = ENOMEM;
+			return NULL;
+		}
+
+		memset(shard->buckets, 0xff, nb * sizeof(*shard->buckets));
+
+		if ((rc = pthread_mutex_init(&shard->mtx, NULL)) != 0) {
+			free(shard->entries);
+			free(shard->buckets);
+			shard->entries = NULL;
+			cache_free(cache);
+			poolerrno = rc;
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+/**
+ * Frees a cache. Callers still waiting on a computation are called with a
+ * NULL value so they can clean up.
+ * @param cache The cache to free
+ */
+void cache_free(cache_t *cache)
+{
+	if (cache == NULL)
+		return;
+
+	for (size_t i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_t *shard = &cache->shards[i];
+
+		/* Shards after a failed cache_new() were never set up */
+		if (shard->entries == NULL)
+			break;
+
+		for (size_t j = 0; j < shard->nentries; j++) {
+			waiters_run(shard->entries[j].waiters, NULL, 0);
+			free(shard->entries[j].data);
+		}
+
+		free(shard->entries);
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->mtx);
+	}
+
+	free(cache);
+}
+
+/**
+ * Looks a key up. On a miss the key is marked as being computed, and the
+ * caller must then call `cache_put()` or `cache_abort()` for it. Callers
+ * that look the same key up in the meantime are not told to compute it
+ * again; their `fn` is queued instead and called once the first caller
+ * is done, so one computation serves the whole burst.
+ * @param cache The cache to use
+ * @param key The key
+ * @param klen Length of `key`
+ * @param out Buffer the value is copied to on a hit
+ * @param outlen Size of `out`
+ * @param vlen This variable is set to the value length on a hit
+ * @param fn Called with the value if the key is being computed, or NULL to
+ *   get `CACHE_MISS` and compute it again instead
+ * @param ctx Passed to `fn`
+ * @return Returns a `cache_result_t`. On error, less than 0 is returned
+ *   and `poolerrno` is set; E2BIG means the value does not fit `out` and
+ *   `vlen` is set to its length.
+ */
+int cache_get(cache_t *cache, const void *key, size_t klen, void *out,
+	size_t outlen, size_t *vlen, cache_wait_t fn, void *ctx)
+{
+	uint64_t h;
+	uint64_t now;
+	cache_shard_t *shard;
+	cache_entry_t *e;
+	cache_waiter_t *w;
+
+	if (cache == NULL || key == NULL || vlen == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	h = cache_hash(key, klen);
+	shard = &cache->shards[(h >> 32) % CACHE_SHARDS];
+	now = pool_now();
+
+	pthread_mutex_lock(&shard->mtx);
+
+	e = entry_find(shard, h, key, klen);
+
+	if (e != NULL && e->state == ENTRY_READY && e->expires <= now) {
+		entry_evict(shard, e);
+		e = NULL;
+	}
+
+	if (e != NULL && e->state == ENTRY_READY) {
+		e->ref = 1;
+		*vlen = e->vlen;
+		if (e->vlen > outlen) {
+			pthread_mutex_unlock(&shard->mtx);
+			poolerrno = E2BIG;
+			return -1;
+		}
+		memcpy(out, e->data + e->klen, e->vlen);
+		pthread_mutex_unlock(&shard->mtx);
+		return CACHE_HIT;
+	}
+
+	if (e != NULL) {
+		/* Being computed. Without a waiter, compute it again */
+		if (fn == NULL || (w = (cache_waiter_t *)malloc(sizeof(*w))) == NULL) {
+			pthread_mutex_unlock(&shard->mtx);
+			return CACHE_MISS;
+		}
+		w->fn = fn;
+		w->ctx = ctx;
+		w->next = e->waiters;
+		e->waiters = w;
+		pthread_mutex_unlock(&shard->mtx);
+		return CACHE_PENDING;
+	}
+
+	/* Claim the key. If every entry is pending the caller still computes
+	 * it, just without coalescing */
+	if ((e = entry_claim(shard, now)) != NULL &&
+	    (e->data = (unsigned char *)malloc(klen > 0 ? klen : 1)) != NULL) {
+		memcpy(e->data, key, klen);
+		e->hash = h;
+		e->klen = klen;
+		e->vlen = 0;
+		e->ref = 0;
+		e->state = ENTRY_PENDING;
+		e->next = shard->buckets[h & shard->mask];
+		shard->buckets[h & shard->mask] = (uint32_t)(e - shard->entries);
+		shard->bytes += klen;
+	}
+
+	pthread_mutex_unlock(&shard->mtx);
+
+	return CACHE_MISS;
+}
+
+/**
+ * Stores a value and hands it to every caller waiting on the key. Values
+ * too big for the cache are passed to the waiters but not kept.
+ * @param cache The cache to use
+ * @param key The key
+ * @param klen Length of `key`
+ * @param val The value
+ * @param vlen Length of `val`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int cache_put(cache_t *cache, const void *key, size_t klen, const void *val,
+	size_t vlen)
+{
+	uint64_t h;
+	uint64_t now;
+	size_t need;
+	cache_shard_t *shard;
+	cache_entry_t *e;
+	cache_waiter_t *waiters = NULL;
+	unsigned char *data;
+
+	if (cache == NULL || key == NULL || (val == NULL && vlen > 0)) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	h = cache_hash(key, klen);
+	shard = &cache->shards[(h >> 32) % CACHE_SHARDS];
+	now = pool_now();
+
+	pthread_mutex_lock(&shard->mtx);
+
+	e = entry_find(shard, h, key, klen);
+	if (e != NULL && e->state == ENTRY_PENDING) {
+		waiters = e->waiters;
+		e->waiters = NULL;
+	} else if (e != NULL) {
+		entry_evict(shard, e);
+		e = NULL;
+	}
+
+	if (klen + vlen > shard->max_bytes) {
+		if (e != NULL)
+			entry_evict(shard, e);
+		e = NULL;
+	} else if (e == NULL) {
+		e = entry_claim(shard, now);
+	}
+
+	if (e != NULL) {
+		need = e->state == ENTRY_PENDING ? vlen : klen + vlen;
+
+		/* Sweep other values out until this one fits the byte bound */
+		for (size_t n = 0; n < 2 * shard->nentries &&
+		     shard->bytes + need > shard->max_bytes; n++) {
+			cache_entry_t *v = &shard->entries[shard->hand];
+
+			shard->hand = (shard->hand + 1) % shard->nentries;
+			if (v == e || v->state != ENTRY_READY)
+				continue;
+			if (v->ref && v->expires > now) {
+				v->ref = 0;
+				continue;
+			}
+			entry_evict(shard, v);
+		}
+
+		data = (unsigned char *)realloc(e->data, klen + vlen + 1);
+		if (shard->bytes + need > shard->max_bytes || data == NULL) {
+			if (data != NULL)
+				e->data = data;
+			if (e->state == ENTRY_PENDING) {
+				entry_evict(shard, e);
+			} else {
+				free(e->data);
+				e->data = NULL;
+			}
+		} else {
+			if (e->state == ENTRY_FREE) {
+				memcpy(data, key, klen);
+				e->hash = h;
+				e->klen = klen;
+				e->next = shard->buckets[h & shard->mask];
+				shard->buckets[h & shard->mask] = (uint32_t)(e - shard->entries);
+			}
+			memcpy(data + klen, val, vlen);
+			e->data = data;
+			e->vlen = vlen;
+			e->ref = 1;
+			e->expires = cache->ttl ? now + cache->ttl : UINT64_MAX;
+			e->state = ENTRY_READY;
+			shard->bytes += need;
+		}
+	}
+
+	pthread_mutex_unlock(&shard->mtx);
+
+	waiters_run(waiters, val, vlen);
+
+	return 0;
+}
+
+/**
+ * Gives up computing a key claimed by `cache_get()`. The waiters are
+ * called with a NULL value.
+ * @param cache The cache to use
+ * @param key The key
+ * @param klen Length of `key`
+ */
+void cache_abort(cache_t *cache, const void *key, size_t klen)
+{
+	uint64_t h;
+	cache_shard_t *shard;
+	cache_entry_t *e;
+	cache_waiter_t *waiters = NULL;
+
+	if (cache == NULL || key == NULL)
+		return;
+
+	h = cache_hash(key, klen);
+	shard = &cache->shards[(h >> 32) % CACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->mtx);
+
+	e = entry_find(shard, h, key, klen);
+	if (e != NULL && e->state == ENTRY_PENDING) {
+		waiters = e->waiters;
+		e->waiters = NULL;
+		entry_evict(shard, e);
+	}
+
+	pthread_mutex_unlock(&shard->mtx);
+
+	waiters_run(waiters, NULL, 0);
+}
+
+/**
+ * Normalizes a JSON text into a cache key by dropping the whitespace
+ * between tokens, so requests that differ only in formatting share an
+ * entry. Strings are copied verbatim.
+ * @param js The JSON text
+ * @param len Length of `js`
+ * @param out Buffer for the key
+ * @param outlen Size of `out`
+ * @return Returns the key length, or 0 if it does not fit `out`
+ */
+size_t cache_key_json(const char *js, size_t len, char *out, size_t outlen)
+{
+	size_t n = 0;
+	int instr = 0;
+	int esc = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = js[i];
+
+		if (!instr && (c == ' ' || c == '\t' || c == '\r' || c == '\n'))
+			continue;
+
+		if (n >= outlen)
+			return 0;
+		out[n++] = c;
+
+		if (esc)
+			esc = 0;
+		else if (instr && c == '\\')
+			esc = 1;
+		else if (c == '"')
+			instr = !instr;
+	}
+
+	return n;
+}
+
+/**
+ * Hashes a key a word at a time
+ * @param key The key
+ * @param len Length of `key`
+ * @return Returns the hash
+ */
+static uint64_t cache_hash(const void *key, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+	uint64_t w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+	}
+
+	w = 0;
+	memcpy(&w, p, len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/**
+ * Finds a pending or ready entry. Caller must hold the shard mutex.
+ * @param shard The shard
+ * @param hash Hash of `key`
+ * @param key The key
+ * @param klen Length of `key`
+ * @return Returns the entry, or NULL if the key is not in the shard
+ */
+static cache_entry_t *entry_find(cache_shard_t *shard, uint64_t hash,
+	const void *key, size_t klen)
+{
+	uint32_t i = shard->buckets[hash & shard->mask];
+
+	while (i != CACHE_NONE) {
+		cache_entry_t *e = &shard->entries[i];
+
+		if (e->hash == hash && e->klen == klen &&
+		    memcmp(e->data, key, klen) == 0)
+			return e;
+		i = e->next;
+	}
+
+	return NULL;
+}
+
+/**
+ * Removes an entry from the index and frees its data. The entry must have
+ * no waiters. Caller must hold the shard mutex.
+ * @param shard The shard
+ * @param e The entry
+ */
+static void entry_evict(cache_shard_t *shard, cache_entry_t *e)
+{
+	uint32_t idx = (uint32_t)(e - shard->entries);
+	uint32_t *link = &shard->buckets[e->hash & shard->mask];
+
+	while (*link != idx)
+		link = &shard->entries[*link].next;
+	*link = e->next;
+
+	shard->bytes -= e->klen + e->vlen;
+	free(e->data);
+	e->data = NULL;
+	e->klen = 0;
+	e->vlen = 0;
+	e->next = CACHE_NONE;
+	e->state = ENTRY_FREE;
+}
+
+/**
+ * Finds an entry to reuse with the CLOCK algorithm: the hand clears the
+ * reference bit of recently hit values and evicts the first value whose
+ * bit is already clear, or that has expired. Pending entries are skipped.
+ * Caller must hold the shard mutex.
+ * @param shard The shard
+ * @param now The current pool_now() time
+ * @return Returns a free entry, or NULL if every entry is pending
+ */
+static cache_entry_t *entry_claim(cache_shard_t *shard, uint64_t now)
+{
+	for (size_t n = 0; n < 2 * shard->nentries; n++) {
+		cache_entry_t *e = &shard->entries[shard->hand];
+
+		shard->hand = (shard->hand + 1) % shard->nentries;
+
+		if (e->state == ENTRY_FREE)
+			return e;
+		if (e->state == ENTRY_PENDING)
+			continue;
+		if (e->ref && e->expires > now) {
+			e->ref = 0;
+			continue;
+		}
+
+		entry_evict(shard, e);
+		return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * Calls and frees a list of waiters, oldest first
+ * @param w The waiters, most recent first
+ * @param val The value, or NULL
+ * @param len Length of `val`
+ */
+static void waiters_run(cache_waiter_t *w, const void *val, size_t len)
+{
+	cache_waiter_t *fifo = NULL;
+	cache_waiter_t *next;
+
+	for (; w != NULL; w = next) {
+		next = w->next;
+		w->next = fifo;
+		fifo = w;
+	}
+
+	for (w = fifo; w != NULL; w = next) {
+		next = w->next;
+		w->fn(val, len, w->ctx);
+		free(w);
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of independently locked shards in a cache */
+#define CACHE_SHARDS 16
+
+/**
+ * Outcome of `cache_get()`
+ */
+typedef enum {
+	CACHE_MISS = 0, /** Not cached; the caller computes it and calls
+	                    `cache_put()` or `cache_abort()` */
+	CACHE_HIT, /** The cached value was copied out */
+	CACHE_PENDING, /** Another caller is computing it; the waiter will be
+	                   called with the value */
+} cache_result_t;
+
+/**
+ * Called with the value once an in-flight computation finishes. `val` is
+ * only valid during the call, and is NULL if the computation was aborted.
+ * Runs on the thread that calls `cache_put()` or `cache_abort()`.
+ * @param val The value, or NULL
+ * @param len Length of `val`
+ * @param ctx The `ctx` passed to `cache_get()`
+ */
+typedef void (*cache_wait_t)(const void *val, size_t len, void *ctx);
+
+/**
+ * Forward declaration of the cache. It maps byte-string keys to byte-string
+ * values, bounded both in entries and in bytes, evicting with the CLOCK
+ * algorithm, and expiring values after a fixed time to live.
+ */
+typedef struct cache cache_t;
+
+/*-----------------*
+ * CACHE API CALLS *
+ *-----------------*/
+
+cache_t *cache_new(size_t nentries, size_t nbytes, uint64_t ttl_ns);
+void cache_free(cache_t *cache);
+int cache_get(cache_t *cache, const void *key, size_t klen, void *out,
+	size_t outlen, size_t *vlen, cache_wait_t fn, void *ctx);
+int cache_put(cache_t *cache, const void *key, size_t klen, const void *val,
+	size_t vlen);
+void cache_abort(cache_t *cache, const void *key, size_t klen);
+size_t cache_key_json(const char *js, size_t len, char *out, size_t outlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CACHE_H_ */
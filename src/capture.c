@@ -0,0 +1,484 @@
+#include "capture.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h> /* close() */
+#include <sys/socket.h>
+#include <netinet/in.h> /* sockaddr_in */
+#include <arpa/inet.h> /* htonl() */
+
+/** Identifies a capture file written by `capture_start()` */
+#define CAPTURE_MAGIC      "TPCP"
+#define CAPTURE_VERSION    1
+
+/** Size of each of the two record buffers */
+#define CAPTURE_BUF_SIZE   (1 << 20)
+
+/** How often the writer flushes a partly filled buffer */
+#define CAPTURE_FLUSH_MS   50
+
+/** Header at the start of every capture file */
+typedef struct {
+	char magic[4]; /** Always CAPTURE_MAGIC */
+	uint32_t version; /** Always CAPTURE_VERSION */
+	uint64_t start; /** CLOCK_REALTIME at the start of the capture, in ns */
+} capture_header_t;
+
+/*
+ * Records are appended to the active buffer under `mtx`, which only
+ * covers a memcpy. The writer thread swaps the buffers and writes the full
+ * one out without holding the mutex, so receiving threads never wait for
+ * the disk.
+ */
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cnd = PTHREAD_COND_INITIALIZER;
+static char *bufs[2] = { NULL, NULL };
+static size_t fill = 0;
+static int active = 0;
+static int stopping = 0;
+static atomic_int running = 0;
+static uint64_t next_conn = 0;
+static uint64_t base_ns = 0;
+static atomic_uint_fast64_t ndropped = 0;
+static FILE *fp = NULL;
+static pthread_t thread;
+
+static void *capture_loop(void *arg);
+
+/**
+ * Starts capturing messages passed to `capture_record()` to a file
+ * @param path The file to create
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int capture_start(const char *path)
+{
+	int rc;
+	capture_header_t hdr;
+	struct timespec ts;
+
+	if (path == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (atomic_load(&running)) {
+		poolerrno = EBUSY;
+		return -1;
+	}
+
+	bufs[0] = (char *)malloc(CAPTURE_BUF_SIZE);
+	bufs[1] = (char *)malloc(CAPTURE_BUF_SIZE);
+	if (bufs[0] == NULL || bufs[1] == NULL) {
+		free(bufs[0]);
+		free(bufs[1]);
+		poolerrno = ENOMEM;
+		return -1;
+	}
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		poolerrno = errno;
+		free(bufs[0]);
+		free(bufs[1]);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAPTURE_VERSION;
+	hdr.start = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		poolerrno = errno;
+		fclose(fp);
+		free(bufs[0]);
+		free(bufs[1]);
+		return -1;
+	}
+
+	fill = 0;
+	active = 0;
+	stopping = 0;
+	next_conn = 0;
+	base_ns = pool_now();
+
+	if ((rc = pthread_create(&thread, NULL, capture_loop, NULL)) != 0) {
+		poolerrno = rc;
+		fclose(fp);
+		free(bufs[0]);
+		free(bufs[1]);
+		return -1;
+	}
+
+	atomic_store(&running, 1);
+
+	return 0;
+}
+
+/**
+ * Writes out the remaining records and closes the capture file
+ */
+void capture_stop(void)
+{
+	if (!atomic_exchange(&running, 0))
+		return;
+
+	pthread_mutex_lock(&mtx);
+	stopping = 1;
+	pthread_cond_signal(&cnd);
+	pthread_mutex_unlock(&mtx);
+
+	pthread_join(thread, NULL);
+
+	fclose(fp);
+	fp = NULL;
+	free(bufs[0]);
+	free(bufs[1]);
+	bufs[0] = NULL;
+	bufs[1] = NULL;
+}
+
+/**
+ * Reads the clock for a connection's arrival time, but only while a
+ * capture is running, so an idle capture costs nothing per connection
+ * @return Returns the `pool_now()` time, or 0 if no capture is running
+ */
+uint64_t capture_now(void)
+{
+	if (!atomic_load_explicit(&running, memory_order_relaxed))
+		return 0;
+
+	return pool_now();
+}
+
+/**
+ * Records a received message, if a capture is running. Each call is
+ * treated as a new connection. Never waits for the disk: if the writer
+ * has fallen a full buffer behind, the message is dropped and counted.
+ * @param msg The message
+ * @param len Length of `msg`
+ * @param arrived When the connection was accepted, from `capture_now()`,
+ *   or 0 for now. Time spent queued before the read must not count, or
+ *   the capture shows the dequeue order instead of the arrival pattern.
+ */
+void capture_record(const void *msg, size_t len, uint64_t arrived)
+{
+	capture_record_t rec;
+	uint64_t now;
+
+	if (!atomic_load_explicit(&running, memory_order_relaxed))
+		return;
+
+	now = arrived != 0 ? arrived : pool_now();
+
+	pthread_mutex_lock(&mtx);
+
+	if (stopping || len > UINT32_MAX ||
+	    fill + sizeof(rec) + len > CAPTURE_BUF_SIZE) {
+		pthread_mutex_unlock(&mtx);
+		atomic_fetch_add(&ndropped, 1);
+		return;
+	}
+
+	rec.ts = now > base_ns ? now - base_ns : 0;
+	rec.conn = next_conn++;
+	rec.len = (uint32_t)len;
+	rec.reserved = 0;
+	memcpy(bufs[active] + fill, &rec, sizeof(rec));
+	memcpy(bufs[active] + fill + sizeof(rec), msg, len);
+	fill += sizeof(rec) + len;
+
+	/* Wake the writer early rather than drop */
+	if (fill > CAPTURE_BUF_SIZE / 2)
+		pthread_cond_signal(&cnd);
+
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * @return Returns the number of messages left out of the capture
+ */
+uint64_t capture_dropped(void)
+{
+	return atomic_load(&ndropped);
+}
+
+/**
+ * The writer thread. Swaps the buffers every CAPTURE_FLUSH_MS, or sooner
+ * when the active one is half full, and writes out the full one.
+ * @param arg Unused
+ * @return Always returns NULL
+ */
+static void *capture_loop(void *arg)
+{
+	struct timespec ts;
+	char *buf;
+	size_t len;
+	int stop;
+
+	(void)arg;
+
+	do {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&mtx);
+		if (!stopping && fill <= CAPTURE_BUF_SIZE / 2)
+			pthread_cond_timedwait(&cnd, &mtx, &ts);
+		stop = stopping;
+		buf = bufs[active];
+		len = fill;
+		active = !active;
+		fill = 0;
+		pthread_mutex_unlock(&mtx);
+
+		if (len > 0 && fwrite(buf, 1, len, fp) != len)
+			atomic_fetch_add(&ndropped, 1);
+	} while (!stop);
+
+	fflush(fp);
+
+	return NULL;
+}
+
+/*------------------------------------------------------------------------*/
+
+/**
+ * A message to replay, passed inline to `replay_one()`
+ */
+typedef struct {
+	const char *msg; /** The message, inside the loaded capture */
+	uint32_t len; /** Message length */
+	size_t idx; /** Index into `replay_lat` */
+} replay_item_t;
+
+static int replay_port;
+static uint64_t *replay_lat;
+
+/**
+ * Sends one message on a new connection and waits for the reply.
+ * Runs on a pool worker.
+ * @param arg The inline `replay_item_t`
+ */
+static void replay_one(void *arg)
+{
+	replay_item_t item;
+	struct sockaddr_in sa;
+	char buf[4096];
+	uint64_t t0;
+	ssize_t n;
+	int fd;
+
+	memcpy(&item, arg, sizeof(item));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(replay_port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	t0 = pool_now();
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return;
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    write(fd, item.msg, item.len) != (ssize_t)item.len) {
+		close(fd);
+		return;
+	}
+
+	shutdown(fd, SHUT_WR);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+	close(fd);
+
+	if (n == 0)
+		replay_lat[item.idx] = pool_now() - t0;
+}
+
+/**
+ * Orders records by arrival time, then by connection id
+ */
+static int rec_cmp(const void *a, const void *b)
+{
+	const capture_record_t *ra = (const capture_record_t *)a;
+	const capture_record_t *rb = (const capture_record_t *)b;
+
+	if (ra->ts != rb->ts)
+		return (ra->ts > rb->ts) - (ra->ts < rb->ts);
+
+	return (ra->conn > rb->conn) - (ra->conn < rb->conn);
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *)a;
+	uint64_t lb = *(const uint64_t *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+/**
+ * Replays a capture file against a server on localhost. Each message is
+ * sent on its own connection from a pool of `nthreads` senders, at its
+ * recorded offset divided by `speed`. A summary with the request latency
+ * percentiles is written to `out`.
+ * @param path The capture file
+ * @param port The server's TCP port
+ * @param speed 1 for the original pace, 2 for twice as fast, and so on,
+ *   or 0 to send as fast as possible
+ * @param nthreads The number of connections in flight at most
+ * @param out Where to write the summary
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int capture_replay(const char *path, int port, double speed, size_t nthreads,
+	FILE *out)
+{
+	capture_header_t hdr;
+	capture_record_t rec;
+	replay_item_t item;
+	pool_t *pool;
+	FILE *in;
+	char *data = NULL;
+	char **msgs = NULL;
+	capture_record_t *recs = NULL;
+	size_t n = 0;
+	size_t cap = 0;
+	size_t nok = 0;
+	uint64_t start;
+	uint64_t elapsed;
+
+	if (path == NULL || port <= 0 || port > 65535 || speed < 0 ||
+	    nthreads == 0 || out == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((in = fopen(path, "rb")) == NULL) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CAPTURE_VERSION) {
+		fclose(in);
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, in) == 1) {
+		if (n == cap) {
+			capture_record_t *r;
+			char **m;
+
+			cap = cap ? cap * 2 : 1024;
+			if ((r = (capture_record_t *)realloc(recs, cap * sizeof(*r))) != NULL)
+				recs = r;
+			if ((m = (char **)realloc(msgs, cap * sizeof(*m))) != NULL)
+				msgs = m;
+			if (r == NULL || m == NULL)
+				break;
+		}
+		if ((data = (char *)malloc(rec.len + 1)) == NULL ||
+		    fread(data, 1, rec.len, in) != rec.len) {
+			free(data);
+			break;
+		}
+		recs[n] = rec;
+		msgs[n++] = data;
+	}
+
+	fclose(in);
+
+	/* Records are written in the order messages were read, which under
+	 * load differs from the order they arrived. `reserved` is free once
+	 * loaded, so it carries each record's message index through the sort */
+	for (size_t i = 0; i < n; i++)
+		recs[i].reserved = (uint32_t)i;
+	qsort(recs, n, sizeof(*recs), rec_cmp);
+
+	replay_lat = (uint64_t *)calloc(n + 1, sizeof(*replay_lat));
+	if (replay_lat == NULL ||
+	    (pool = pool_init(nthreads, MAX_QUEUE_CAPACITY)) == NULL) {
+		for (size_t i = 0; msgs != NULL && i < n; i++)
+			free(msgs[i]);
+		free(msgs);
+		free(recs);
+		free(replay_lat);
+		poolerrno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		replay_lat[i] = UINT64_MAX;
+
+	replay_port = port;
+	start = pool_now();
+
+	for (size_t i = 0; i < n; i++) {
+		if (speed > 0) {
+			uint64_t due = start + (uint64_t)((double)recs[i].ts / speed);
+			uint64_t now = pool_now();
+
+			if (due > now) {
+				struct timespec ts;
+				ts.tv_sec = (due - now) / 1000000000ull;
+				ts.tv_nsec = (due - now) % 1000000000ull;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		item.msg = msgs[recs[i].reserved];
+		item.len = recs[i].len;
+		item.idx = i;
+
+		/* Block rather than skip messages when the senders fall behind */
+		while (pool_enqueue_inline(pool, replay_one, &item, sizeof(item)) < 0) {
+			struct timespec ts = { 0, 100000 };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	/* pool_free() would drop whatever is still queued */
+	for (;;) {
+		pool_stats_t st;
+		struct timespec ts = { 0, 1000000 };
+
+		if (pool_get_stats(pool, &st) < 0 || st.ncompleted >= n)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	elapsed = pool_now() - start;
+	pool_free(pool);
+
+	qsort(replay_lat, n, sizeof(*replay_lat), lat_cmp);
+	while (nok < n && replay_lat[nok] != UINT64_MAX)
+		nok++;
+
+	fprintf(out, "Replayed %zu messages in %.3f s (%.0f msg/s), %zu failed\n",
+		n, elapsed / 1e9, elapsed ? n * 1e9 / elapsed : 0.0, n - nok);
+	if (nok > 0)
+		fprintf(out, "Latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+			replay_lat[nok / 2] / 1e3, replay_lat[nok * 9 / 10] / 1e3,
+			replay_lat[nok * 99 / 100] / 1e3, replay_lat[nok - 1] / 1e3);
+
+	for (size_t i = 0; i < n; i++)
+		free(msgs[i]);
+	free(msgs);
+	free(recs);
+	free(replay_lat);
+	replay_lat = NULL;
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h> /* FILE */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A record in a capture file. Each record is followed by `len` bytes of
+ * message. Timestamps count from the start of the capture and give the
+ * time the connection arrived, so records may be slightly out of order.
+ */
+typedef struct {
+	uint64_t ts; /** Arrival time in ns since `capture_start()` */
+	uint64_t conn; /** Connection id, in arrival order */
+	uint32_t len; /** Message length */
+	uint32_t reserved; /** Always 0 */
+} capture_record_t;
+
+/*-------------------*
+ * CAPTURE API CALLS *
+ *-------------------*/
+
+int capture_start(const char *path);
+void capture_stop(void);
+uint64_t capture_now(void);
+void capture_record(const void *msg, size_t len, uint64_t arrived);
+uint64_t capture_dropped(void);
+int capture_replay(const char *path, int port, double speed, size_t nthreads,
+	FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,191 @@
+#include "completion.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/**
+ * The completion queue struct. Completions are pushed onto a lock-free
+ * stack; the consumer takes the whole stack at once and reverses it.
+ */
+struct completion_queue {
+	_Atomic(pool_completion_t *) head; /** Most recent completion first */
+	int fd; /** eventfd signalled when `head` goes from empty to non-empty */
+};
+
+static void completion_run(void *arg);
+static void completion_cancel(void *arg);
+
+/**
+ * Creates a completion queue and its eventfd
+ * @return Returns a `completion_queue_t` object on success. On error, NULL
+ *   is returned and `poolerrno` is set.
+ */
+completion_queue_t *completion_new(void)
+{
+	completion_queue_t *cq;
+
+	if ((cq = (completion_queue_t *)malloc(sizeof(*cq))) == NULL) {
+		poolerrno = errno;
+		return NULL;
+	}
+
+	if ((cq->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		poolerrno = errno;
+		free(cq);
+		return NULL;
+	}
+
+	atomic_init(&cq->head, NULL);
+
+	return cq;
+}
+
+/**
+ * Closes a completion queue. Completions not yet drained are forgotten,
+ * and no task enqueued on it may still be running.
+ * @param cq The queue, or NULL
+ */
+void completion_free(completion_queue_t *cq)
+{
+	if (cq == NULL)
+		return;
+
+	close(cq->fd);
+	free(cq);
+}
+
+/**
+ * Returns the eventfd to watch for readability. Do not read it; call
+ * `completion_drain()` instead.
+ * @param cq The queue
+ * @return Returns the file descriptor
+ */
+int completion_fd(const completion_queue_t *cq)
+{
+	return cq->fd;
+}
+
+/**
+ * Enqueues `func(arg)` on a pool and reports `c` to the completion queue
+ * once it has run. If the pool skips the item (deadline, token, or
+ * `pool_free()`), `c` is reported with `cancelled` set instead.
+ * @param cq The queue to report to
+ * @param pool The pool to run the task on
+ * @param c Caller-owned completion, untouched by the caller until drained
+ * @param func The task
+ * @param arg Passed to `func`
+ * @param opts Deadline and token to apply, or NULL. `opts->cancel` is
+ *   ignored; a skipped task is reported through the queue.
+ * @return Returns 0 on success. On error, -1 is returned, `poolerrno` is
+ *   set, and `c` will not be reported.
+ */
+int completion_enqueue(completion_queue_t *cq, pool_t *pool,
+	pool_completion_t *c, void (*func)(void *), void *arg,
+	const pool_task_opts_t *opts)
+{
+	pool_task_opts_t o = { 0 };
+
+	if (cq == NULL || c == NULL || func == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (opts != NULL) {
+		o.deadline = opts->deadline;
+		o.token = opts->token;
+	}
+	o.cancel = completion_cancel;
+
+	c->next = NULL;
+	c->cq = cq;
+	c->func = func;
+	c->arg = arg;
+	c->cancelled = 0;
+
+	return pool_enqueue_opts(pool, completion_run, c, &o);
+}
+
+/**
+ * Pushes a completion onto the queue from any thread. Only the push that
+ * finds the queue empty writes the eventfd, so a burst of completions
+ * costs the consumer one wakeup.
+ * @param cq The queue
+ * @param c The completion
+ */
+void completion_post(completion_queue_t *cq, pool_completion_t *c)
+{
+	pool_completion_t *head = atomic_load_explicit(&cq->head,
+		memory_order_relaxed);
+	uint64_t one = 1;
+
+	do {
+		c->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&cq->head, &head, c,
+		memory_order_release, memory_order_relaxed));
+
+	if (head == NULL && write(cq->fd, &one, sizeof(one)) < 0) {
+		/* EAGAIN means the counter is saturated and already readable */
+	}
+}
+
+/**
+ * Takes every completion posted so far, in the order they were posted.
+ * Call this from the one thread that owns the queue, typically when
+ * `completion_fd()` polls readable.
+ * @param cq The queue
+ * @param list Set to the first completion, linked through `next`, or NULL
+ * @return Returns the number of completions taken
+ */
+size_t completion_drain(completion_queue_t *cq, pool_completion_t **list)
+{
+	pool_completion_t *c, *next, *prev = NULL;
+	uint64_t val;
+	size_t n = 0;
+
+	/*
+	 * Reset the eventfd before taking the list. A push that lands after
+	 * the exchange below finds the list empty and signals again, so no
+	 * completion is left behind without a wakeup.
+	 */
+	if (read(cq->fd, &val, sizeof(val)) < 0) {
+		/* EAGAIN: nothing was signalled, but check the list anyway */
+	}
+
+	c = atomic_exchange_explicit(&cq->head, NULL, memory_order_acquire);
+
+	for (; c != NULL; c = next, n++) {
+		next = c->next;
+		c->next = prev;
+		prev = c;
+	}
+
+	*list = prev;
+
+	return n;
+}
+
+/**
+ * Pool task wrapper: runs the task, then reports it
+ * @param arg The `pool_completion_t`
+ */
+static void completion_run(void *arg)
+{
+	pool_completion_t *c = (pool_completion_t *)arg;
+
+	c->func(c->arg);
+	completion_post(c->cq, c);
+}
+
+/**
+ * Pool cancel callback: reports the task as cancelled
+ * @param arg The `pool_completion_t`
+ */
+static void completion_cancel(void *arg)
+{
+	pool_completion_t *c = (pool_completion_t *)arg;
+
+	c->cancelled = 1;
+	completion_post(c->cq, c);
+}
@@ -0,0 +1,48 @@
+#ifndef COMPLETION_H_
+#define COMPLETION_H_
+
+#include "pool.h"
+#include <stdlib.h> /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Forward declaration of a completion queue. Workers push finished tasks
+ * onto it and signal an eventfd, which an external event loop polls for
+ * readability and then drains with `completion_drain()`.
+ */
+typedef struct completion_queue completion_queue_t;
+
+/**
+ * A task that reports to a completion queue when it is done. The caller
+ * owns the memory, usually by embedding it in its own request struct, and
+ * must keep it alive until it comes back out of `completion_drain()`.
+ */
+typedef struct pool_completion {
+	struct pool_completion *next; /** Next completion in a drained list */
+	completion_queue_t *cq; /** Queue to report to, set on enqueue */
+	void (*func)(void *arg); /** The task */
+	void *arg; /** Passed to `func` */
+	int cancelled; /** Set if the pool skipped the task instead of running it */
+} pool_completion_t;
+
+/*----------------------------*
+ * COMPLETION QUEUE API CALLS *
+ *----------------------------*/
+
+completion_queue_t *completion_new(void);
+void completion_free(completion_queue_t *cq);
+int completion_fd(const completion_queue_t *cq);
+int completion_enqueue(completion_queue_t *cq, pool_t *pool,
+	pool_completion_t *c, void (*func)(void *), void *arg,
+	const pool_task_opts_t *opts);
+void completion_post(completion_queue_t *cq, pool_completion_t *c);
+size_t completion_drain(completion_queue_t *cq, pool_completion_t **list);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPLETION_H_ */
@@ -0,0 +1,546 @@
+#ifndef CORO_HPP_
+#define CORO_HPP_
+
+/*
+ * Header-only C++20 coroutine front end for the pool in threadpool.hpp.
+ *
+ * `co_await p.schedule()` continues the coroutine on a worker of `p`. Only
+ * the address of the suspended coroutine goes into the queue slot, so a hop
+ * costs one enqueue and one dequeue, and no thread blocks. `task<T>` is a
+ * lazy coroutine that starts when awaited and, when it finishes, transfers
+ * control straight to its awaiter (symmetric transfer), so long chains of
+ * tasks neither bounce through the queue nor grow the stack. A `reactor`
+ * waits for socket readiness with epoll on its own thread and resumes the
+ * waiting coroutine on the pool.
+ *
+ * Coroutine frames are allocated with `pool_task_alloc()`, so frames
+ * created on a worker come from its cache without locking. Like all task
+ * memory, every frame must be gone before its pool is freed.
+ */
+
+#include "threadpool.hpp"
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <thread>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace threadpool {
+
+template <class T = void>
+class task;
+
+class reactor;
+
+namespace detail {
+
+/**
+ * Base of every promise type here. Coroutine frames come from the worker
+ * allocation caches instead of the global heap.
+ */
+struct frame_alloc {
+	static void *operator new(std::size_t size)
+	{
+		void *mem = pool_task_alloc(size);
+		if (mem == nullptr)
+			throw std::bad_alloc();
+		return mem;
+	}
+
+	static void operator delete(void *mem) noexcept { pool_task_free(mem); }
+};
+
+/**
+ * A suspended coroutine to be resumed by a worker. Lives in the awaiting
+ * coroutine's frame; only its address is queued.
+ */
+struct resumer {
+	std::coroutine_handle<> handle;
+	int code = 0; /** `poolerrno` or `errno` if it could not be queued */
+	bool dropped = false; /** Set if the pool dropped it instead */
+
+	/**
+	 * Queues the resumption. The cancel callback is the only option, so
+	 * the pool keeps it in the slot and the hop allocates nothing. Must
+	 * be the last use of `this` on success, since a worker may already
+	 * have resumed the coroutine on return.
+	 * @return Returns false and sets `code` if the pool refused it
+	 */
+	bool post(pool_t *p) noexcept
+	{
+		resumer *self = this;
+		pool_task_opts_t opts{};
+		opts.cancel = &on_cancel;
+
+		if (pool_enqueue_inline_opts(p, &on_run, &self, sizeof(self),
+		                             &opts) < 0) {
+			code = poolerrno;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Rethrows, in the resumed coroutine, why no worker resumed it. A
+	 * pool that is being freed counts as dropping it.
+	 */
+	void check() const
+	{
+		if (dropped || code == POOLERRNO_SHUTDOWN)
+			throw cancelled();
+		if (code != 0)
+			throw error(code);
+	}
+
+	static void on_run(void *arg)
+	{
+		resumer *self;
+
+		std::memcpy(&self, arg, sizeof(self));
+		self->handle.resume();
+	}
+
+	/** Resumes the coroutine anyway, so it unwinds and frees its frame */
+	static void on_cancel(void *arg)
+	{
+		resumer *self;
+
+		std::memcpy(&self, arg, sizeof(self));
+		self->dropped = true;
+		self->handle.resume();
+	}
+};
+
+/** Promise state shared by every `task<T>` */
+struct task_promise_base : frame_alloc {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+	std::exception_ptr error;
+
+	/** Transfers to the awaiter when the task finishes */
+	struct final_awaiter {
+		bool await_ready() const noexcept { return false; }
+
+		template <class P>
+		std::coroutine_handle<> await_suspend(
+			std::coroutine_handle<P> h) noexcept
+		{
+			return h.promise().continuation;
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <class T>
+struct task_promise : task_promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+
+	template <class U>
+	void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+
+	T take()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+	task<void> get_return_object() noexcept;
+
+	void return_void() noexcept {}
+
+	void take()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+/**
+ * A coroutine nobody awaits. It frees its own frame when it finishes, and
+ * an exception escaping it terminates the program, so the coroutine body
+ * must catch whatever it can live with.
+ */
+struct detached {
+	struct promise_type : frame_alloc {
+		detached get_return_object() noexcept
+		{
+			return detached{
+				std::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+
+		std::suspend_always initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/** Completion state of `sync_wait()` */
+template <class T>
+struct sync_state {
+	result<T> value;
+	std::exception_ptr error;
+	std::mutex mtx;
+	std::condition_variable cnd;
+	bool done = false;
+
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		done = true;
+		cnd.notify_all();
+	}
+};
+
+inline void resume_handle(void *arg)
+{
+	void *addr;
+
+	std::memcpy(&addr, arg, sizeof(addr));
+	std::coroutine_handle<>::from_address(addr).resume();
+}
+
+inline void destroy_handle(void *arg)
+{
+	void *addr;
+
+	std::memcpy(&addr, arg, sizeof(addr));
+	std::coroutine_handle<>::from_address(addr).destroy();
+}
+
+} /* namespace detail */
+
+/**
+ * Returned by `pool::schedule()`. Awaiting it suspends the coroutine and
+ * resumes it on a worker. Throws `threadpool::error` if the queue refused
+ * it, or `threadpool::cancelled` if the pool dropped it or is being freed.
+ */
+class schedule_awaitable {
+public:
+	explicit schedule_awaitable(pool_t *p) noexcept : pool_(p) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		r_.handle = h;
+		return r_.post(pool_);
+	}
+
+	void await_resume() const { r_.check(); }
+
+private:
+	pool_t *pool_;
+	detail::resumer r_;
+};
+
+inline schedule_awaitable pool::schedule() const noexcept
+{
+	return schedule_awaitable(pool_);
+}
+
+/**
+ * A lazily started coroutine returning `T`. It runs when awaited, on the
+ * awaiting thread, and the awaiter continues on whichever thread the task
+ * finishes on. Exceptions are rethrown to the awaiter. Await it once.
+ */
+template <class T>
+class [[nodiscard]] task {
+public:
+	using promise_type = detail::task_promise<T>;
+
+	task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+
+	task &operator=(task &&other) noexcept
+	{
+		if (this != &other) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(other.h_, {});
+		}
+		return *this;
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	auto operator co_await() const noexcept
+	{
+		struct awaiter {
+			std::coroutine_handle<promise_type> h;
+
+			bool await_ready() const noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(
+				std::coroutine_handle<> awaiting) noexcept
+			{
+				h.promise().continuation = awaiting;
+				return h;
+			}
+
+			T await_resume() { return h.promise().take(); }
+		};
+
+		return awaiter{h_};
+	}
+
+private:
+	friend promise_type;
+
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <class T>
+task<T> task_promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept
+{
+	return task<void>(
+		std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+template <class T>
+detached run_sync(task<T> t, sync_state<T> &st)
+{
+	try {
+		if constexpr (std::is_void_v<T>)
+			co_await std::move(t);
+		else
+			st.value.value.emplace(co_await std::move(t));
+	} catch (...) {
+		st.error = std::current_exception();
+	}
+	st.finish();
+}
+
+inline detached run_detached(task<void> t)
+{
+	/* The pool was freed while the task waited on it; `pool_free()`
+	 * resumed it on the freeing thread only so its frames unwind */
+	try {
+		co_await std::move(t);
+	} catch (const cancelled &) {
+	}
+}
+
+} /* namespace detail */
+
+/**
+ * Starts `t` on a worker of `p` and lets it run to completion on its own.
+ * If the pool is freed before the task starts, the task is destroyed
+ * without running. If it is freed while the task waits to be resumed on
+ * it, the wait throws `cancelled` on the freeing thread; that ends the
+ * task quietly once it has unwound. Any other exception escaping `t`
+ * terminates the program.
+ */
+inline void spawn(pool &p, task<void> t)
+{
+	void *addr = detail::run_detached(std::move(t)).handle.address();
+	pool_task_opts_t opts{};
+	opts.cancel = &detail::destroy_handle;
+
+	if (pool_enqueue_inline_opts(p.native(), &detail::resume_handle, &addr,
+	                             sizeof(addr), &opts) < 0) {
+		int code = poolerrno;
+		detail::destroy_handle(&addr);
+		throw error(code);
+	}
+}
+
+/**
+ * Runs `t` and blocks the calling thread until it finishes. Meant for
+ * `main()` and tests; calling it on a worker ties the worker up.
+ * @return Returns the task's result, or rethrows what it threw
+ */
+template <class T>
+T sync_wait(task<T> t)
+{
+	detail::sync_state<T> st;
+
+	detail::run_sync(std::move(t), st).handle.resume();
+
+	std::unique_lock<std::mutex> lock(st.mtx);
+	st.cnd.wait(lock, [&st] { return st.done; });
+
+	if (st.error)
+		std::rethrow_exception(st.error);
+	return st.value.take();
+}
+
+/**
+ * Returned by `reactor::readable()` and `reactor::writable()`. Awaiting it
+ * resumes the coroutine on a worker once the descriptor is ready, and
+ * yields the epoll events that fired, which may include EPOLLERR or
+ * EPOLLHUP.
+ */
+class io_awaitable {
+public:
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		epoll_event ev{};
+
+		r_.handle = h;
+		ev.events = events_ | EPOLLONESHOT;
+		ev.data.ptr = this;
+
+		/* Re-arm a descriptor waited on before, else add it */
+		if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd_, &ev) < 0 &&
+		    (errno != ENOENT ||
+		     epoll_ctl(epfd_, EPOLL_CTL_ADD, fd_, &ev) < 0)) {
+			r_.code = errno;
+			return false;
+		}
+		return true;
+	}
+
+	std::uint32_t await_resume() const
+	{
+		r_.check();
+		return revents_;
+	}
+
+private:
+	friend class reactor;
+
+	io_awaitable(int epfd, int fd, std::uint32_t events) noexcept
+		: epfd_(epfd), fd_(fd), events_(events) {}
+
+	int epfd_;
+	int fd_;
+	std::uint32_t events_;
+	std::uint32_t revents_ = 0;
+	detail::resumer r_;
+};
+
+/**
+ * Waits for socket readiness with epoll on its own thread and resumes the
+ * waiting coroutines on a pool. Waits are one-shot: a descriptor stays in
+ * the epoll set, disarmed, between waits, so a read loop costs one
+ * epoll_ctl() per wait. Closing a descriptor drops it from the set. Only
+ * one coroutine may wait on a descriptor at a time, and nothing may be
+ * waiting when the reactor is destroyed.
+ */
+class reactor {
+public:
+	explicit reactor(pool &p) : pool_(p.native())
+	{
+		epoll_event ev{};
+
+		if ((epfd_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			throw error(errno);
+
+		if ((wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			int code = errno;
+			close(epfd_);
+			throw error(code);
+		}
+
+		/* The wakeup descriptor is the only one without an awaiter */
+		ev.events = EPOLLIN;
+		ev.data.ptr = nullptr;
+		if (epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev) < 0) {
+			int code = errno;
+			close(wakefd_);
+			close(epfd_);
+			throw error(code);
+		}
+
+		thread_ = std::thread([this] { loop(); });
+	}
+
+	~reactor()
+	{
+		std::uint64_t one = 1;
+
+		stop_.store(true, std::memory_order_relaxed);
+		if (write(wakefd_, &one, sizeof(one)) < 0) {
+			/* The counter is already non-zero, which is as good */
+		}
+		thread_.join();
+		close(wakefd_);
+		close(epfd_);
+	}
+
+	reactor(const reactor &) = delete;
+	reactor &operator=(const reactor &) = delete;
+
+	/** @return Returns an awaitable that resumes once `fd` is readable */
+	io_awaitable readable(int fd) const noexcept
+	{
+		return io_awaitable(epfd_, fd, EPOLLIN | EPOLLRDHUP);
+	}
+
+	/** @return Returns an awaitable that resumes once `fd` is writable */
+	io_awaitable writable(int fd) const noexcept
+	{
+		return io_awaitable(epfd_, fd, EPOLLOUT);
+	}
+
+private:
+	void loop()
+	{
+		epoll_event evs[64];
+		int n;
+
+		while (!stop_.load(std::memory_order_relaxed)) {
+			if ((n = epoll_wait(epfd_, evs, 64, -1)) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			for (int i = 0; i < n; i++) {
+				auto *w = static_cast<io_awaitable *>(evs[i].data.ptr);
+
+				if (w == nullptr)
+					continue;
+
+				/* If the queue refuses the resumption, resume here so
+				 * the coroutine sees the error instead of hanging */
+				w->revents_ = evs[i].events;
+				if (!w->r_.post(pool_))
+					w->r_.handle.resume();
+			}
+		}
+	}
+
+	pool_t *pool_;
+	int epfd_;
+	int wakefd_;
+	std::atomic<bool> stop_{false};
+	std::thread thread_;
+};
+
+} /* namespace threadpool */
+
+#endif /* CORO_HPP_ */
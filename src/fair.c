@@ -0,0 +1,598 @@
+#include "fair.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * A queued task. The argument is copied inline when it is small enough,
+ * in which case `arg` points at `data`.
+ */
+typedef struct fair_item {
+	struct fair_item *next; /** Next task of the same flow */
+	void (*func)(void *); /** The task */
+	void *arg; /** Passed to `func` */
+	void (*cancel)(void *); /** Called with `arg` if the task is skipped */
+	pool_token_t *token; /** Skip the task once this token is cancelled */
+	uint64_t deadline; /** `pool_now()` time after which to skip the task */
+	unsigned char data[POOL_INLINE_ARG_SIZE]; /** Inline argument copy */
+} fair_item_t;
+
+/**
+ * A flow: the subqueue and scheduling state of one key. Flows are only
+ * kept while they have tasks queued or running, or a weight other than 1.
+ */
+typedef struct fair_flow {
+	struct fair_flow *hnext; /** Next flow in the bucket, or the free list */
+	struct fair_flow *anext; /** Next flow in the active list */
+	uint64_t key; /** The key */
+	unsigned weight; /** Share of the worker time relative to other flows */
+	int turn; /** Non-zero once topped up for its current turn */
+	int64_t deficit; /** Worker time, in ns, the flow may still use */
+	int64_t cost; /** Moving average of its tasks' run time, in ns */
+	fair_item_t *head; /** Oldest task queued */
+	fair_item_t *tail; /** Newest task queued */
+	size_t count; /** Tasks queued */
+	size_t running; /** Tasks running */
+} fair_flow_t;
+
+/**
+ * The fair queue struct. The pool holds one ticket per queued task; each
+ * ticket runs whichever task the scheduler picks when it reaches a worker,
+ * not the task it was enqueued with.
+ */
+struct fair {
+	pool_t *pool; /** Pool the tasks run on */
+	pthread_mutex_t mtx; /** Protects everything below */
+	fair_flow_t *flows; /** `max_flows` flow records */
+	fair_flow_t *free_flows; /** Unused flow records */
+	fair_flow_t **buckets; /** Flows by key hash, `nbuckets` chains */
+	size_t nbuckets; /** Power of two */
+	fair_flow_t *active; /** Flows with tasks queued; the first has its turn */
+	fair_flow_t *active_tail; /** Last flow in the active list */
+	size_t max_flows; /** Most flows tracked at once */
+	size_t flow_capacity; /** Most tasks queued per flow, or 0 */
+	int64_t quantum; /** Worker time per turn at weight 1, in ns */
+	fair_stats_t stats; /** Counters */
+};
+
+static fair_flow_t *fair_lookup(fair_t *f, uint64_t key, int create);
+static void fair_release(fair_t *f, fair_flow_t *flow);
+static void fair_deactivate(fair_t *f, fair_flow_t *flow, fair_flow_t *prev);
+static fair_item_t *fair_pick(fair_t *f, fair_flow_t **flowp);
+static void fair_run(void *arg);
+static void fair_drop(void *arg);
+static int fair_push(fair_t *f, uint64_t key, fair_item_t *item);
+
+/**
+ * Creates a fair queue in front of a pool. Each flow gets turns in round
+ * robin order, and on its turn the worker time it is credited, `quantum_us`
+ * times its weight, is spent on its tasks. Run time is measured, so a flow
+ * of slow tasks gets fewer of them through than a flow of fast ones, and a
+ * flow that overspends waits out the following turns until it is even.
+ * @param pool The pool to run tasks on
+ * @param max_flows Most flows tracked at once, at most `FAIR_MAX_FLOWS`
+ * @param flow_capacity Most tasks queued per flow, or 0 for no limit
+ * @param quantum_us Worker time per turn at weight 1, in us
+ * @return Returns a `fair_t` object on success. On error, NULL is returned
+ *   and `poolerrno` is set.
+ */
+fair_t *fair_new(pool_t *pool, size_t max_flows, size_t flow_capacity,
+	unsigned long quantum_us)
+{
+	fair_t *f;
+	size_t i;
+
+	if (pool == NULL || max_flows == 0 || max_flows > FAIR_MAX_FLOWS ||
+	    quantum_us == 0) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	f = (fair_t *)calloc(1, sizeof(*f));
+	if (f == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	for (f->nbuckets = 1; f->nbuckets < max_flows; f->nbuckets <<= 1)
+		;
+
+	f->flows = (fair_flow_t *)calloc(max_flows, sizeof(*f->flows));
+	f->buckets = (fair_flow_t **)calloc(f->nbuckets, sizeof(*f->buckets));
+	if (f->flows == NULL || f->buckets == NULL) {
+		free(f->flows);
+		free(f->buckets);
+		free(f);
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < max_flows; i++) {
+		f->flows[i].hnext = f->free_flows;
+		f->free_flows = &f->flows[i];
+	}
+
+	f->pool = pool;
+	f->max_flows = max_flows;
+	f->flow_capacity = flow_capacity;
+	f->quantum = (int64_t)quantum_us * 1000;
+
+	pthread_mutex_init(&f->mtx, NULL);
+
+	return f;
+}
+
+/**
+ * Frees a fair queue. Free the pool first: its queued tickets are what
+ * run or drop the tasks, so only then is the fair queue empty and idle.
+ * @param f The fair queue, or NULL
+ */
+void fair_free(fair_t *f)
+{
+	if (f == NULL)
+		return;
+
+	pthread_mutex_destroy(&f->mtx);
+	free(f->buckets);
+	free(f->flows);
+	free(f);
+}
+
+/**
+ * Sets the weight of a flow. A flow of weight 2 gets twice the worker time
+ * of a flow of weight 1 while both are busy. The flow is kept while its
+ * weight is other than 1, so it counts against `max_flows` even when idle.
+ * @param f The fair queue
+ * @param key The flow
+ * @param weight From 1 to `FAIR_MAX_WEIGHT`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int fair_set_weight(fair_t *f, uint64_t key, unsigned weight)
+{
+	fair_flow_t *flow;
+
+	if (f == NULL || weight == 0 || weight > FAIR_MAX_WEIGHT) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&f->mtx);
+
+	if ((flow = fair_lookup(f, key, weight != 1)) != NULL) {
+		flow->weight = weight;
+		fair_release(f, flow);
+	} else if (weight != 1) {
+		pthread_mutex_unlock(&f->mtx);
+		poolerrno = POOLERRNO_QUEUE_FULL;
+		return -1;
+	}
+
+	pthread_mutex_unlock(&f->mtx);
+
+	return 0;
+}
+
+/**
+ * Queues a task on the flow `key`. The task runs on the pool once the
+ * scheduler picks it. Tasks of one flow start in the order they were
+ * queued; tasks of different flows interleave by their share.
+ * @param f The fair queue
+ * @param key The flow, e.g. a client address or tenant id
+ * @param func The task
+ * @param arg Passed to `func`
+ * @param opts Deadline, token and cancel callback, as for
+ *   `pool_enqueue_opts()`. May be NULL. The cancel callback is also called
+ *   if the pool drops the task, e.g. under admission control.
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set: `POOLERRNO_QUEUE_FULL` if the flow has
+ *   `flow_capacity` tasks queued or `max_flows` flows are in use.
+ */
+int fair_enqueue(fair_t *f, uint64_t key, void (*func)(void *), void *arg,
+	const pool_task_opts_t *opts)
+{
+	fair_item_t *item;
+
+	if (f == NULL || func == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((item = (fair_item_t *)pool_task_alloc(sizeof(*item))) == NULL)
+		return -1;
+
+	memset(item, 0, offsetof(fair_item_t, data));
+	item->func = func;
+	item->arg = arg;
+	if (opts != NULL) {
+		item->cancel = opts->cancel;
+		item->token = opts->token;
+		item->deadline = opts->deadline;
+	}
+
+	return fair_push(f, key, item);
+}
+
+/**
+ * Like `fair_enqueue()`, but copies `len` bytes at `data` into the queue
+ * and passes the task a pointer to the copy
+ * @param f The fair queue
+ * @param key The flow
+ * @param func The task
+ * @param data The argument to copy
+ * @param len Size of the argument, at most `POOL_INLINE_ARG_SIZE`
+ * @param opts Deadline, token and cancel callback. May be NULL
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int fair_enqueue_inline(fair_t *f, uint64_t key, void (*func)(void *),
+	const void *data, size_t len, const pool_task_opts_t *opts)
+{
+	fair_item_t *item;
+
+	if (f == NULL || func == NULL || data == NULL ||
+	    len > POOL_INLINE_ARG_SIZE) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((item = (fair_item_t *)pool_task_alloc(sizeof(*item))) == NULL)
+		return -1;
+
+	memset(item, 0, offsetof(fair_item_t, data));
+	memcpy(item->data, data, len);
+	item->func = func;
+	item->arg = item->data;
+	if (opts != NULL) {
+		item->cancel = opts->cancel;
+		item->token = opts->token;
+		item->deadline = opts->deadline;
+	}
+
+	return fair_push(f, key, item);
+}
+
+/**
+ * Fills `stats` with a snapshot of the fair queue's counters
+ * @param f The fair queue
+ * @param stats Where to store the snapshot
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int fair_get_stats(fair_t *f, fair_stats_t *stats)
+{
+	if (f == NULL || stats == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&f->mtx);
+	*stats = f->stats;
+	pthread_mutex_unlock(&f->mtx);
+
+	return 0;
+}
+
+/**
+ * Finds the flow of a key. Call with the lock held.
+ * @param f The fair queue
+ * @param key The flow
+ * @param create Non-zero to start tracking the key if it is not yet
+ * @return Returns the flow, or NULL if it is not tracked and either
+ *   `create` is zero or every flow record is in use
+ */
+static fair_flow_t *fair_lookup(fair_t *f, uint64_t key, int create)
+{
+	fair_flow_t **bucket;
+	fair_flow_t *flow;
+
+	/* Fibonacci hashing spreads sequential keys, like addresses */
+	bucket = &f->buckets[(key * 0x9E3779B97F4A7C15ull) >> 32 &
+		(f->nbuckets - 1)];
+
+	for (flow = *bucket; flow != NULL; flow = flow->hnext)
+		if (flow->key == key)
+			return flow;
+
+	if (!create || (flow = f->free_flows) == NULL)
+		return NULL;
+
+	f->free_flows = flow->hnext;
+	memset(flow, 0, sizeof(*flow));
+	flow->key = key;
+	flow->weight = 1;
+	flow->cost = f->quantum;
+	flow->hnext = *bucket;
+	*bucket = flow;
+	f->stats.nflows++;
+
+	return flow;
+}
+
+/**
+ * Stops tracking a flow that has nothing queued or running and the
+ * default weight. Any debt it ran up is forgiven. Call with the lock held.
+ * @param f The fair queue
+ * @param flow The flow
+ */
+static void fair_release(fair_t *f, fair_flow_t *flow)
+{
+	fair_flow_t **link;
+
+	if (flow->count || flow->running || flow->weight != 1)
+		return;
+
+	link = &f->buckets[(flow->key * 0x9E3779B97F4A7C15ull) >> 32 &
+		(f->nbuckets - 1)];
+	while (*link != flow)
+		link = &(*link)->hnext;
+	*link = flow->hnext;
+
+	flow->hnext = f->free_flows;
+	f->free_flows = flow;
+	f->stats.nflows--;
+}
+
+/**
+ * Takes a flow whose last task was just removed out of the active list.
+ * Unused credit is dropped, so an idle flow cannot save up for a burst.
+ * Call with the lock held.
+ * @param f The fair queue
+ * @param flow The flow
+ * @param prev The flow before it in the active list, or NULL
+ */
+static void fair_deactivate(fair_t *f, fair_flow_t *flow, fair_flow_t *prev)
+{
+	if (prev == NULL)
+		f->active = flow->anext;
+	else
+		prev->anext = flow->anext;
+	if (f->active_tail == flow)
+		f->active_tail = prev;
+
+	flow->anext = NULL;
+	flow->turn = 0;
+	if (flow->deficit > 0)
+		flow->deficit = 0;
+
+	f->stats.nactive--;
+}
+
+/**
+ * Picks the next task by deficit round robin: the flow whose turn it is
+ * keeps it while it has credit left, then goes to the back of the list and
+ * is credited again when its next turn comes. Call with the lock held.
+ * @param f The fair queue
+ * @param flowp Where to store the flow of the task
+ * @return Returns the task, removed from its flow, or NULL if none is
+ *   queued
+ */
+static fair_item_t *fair_pick(fair_t *f, fair_flow_t **flowp)
+{
+	fair_flow_t *flow;
+	fair_item_t *item;
+	size_t visited = 0;
+	int64_t rounds;
+	int64_t credit;
+
+	while ((flow = f->active) != NULL) {
+		if (!flow->turn) {
+			flow->deficit += f->quantum * flow->weight;
+			flow->turn = 1;
+		}
+
+		if (flow->deficit > 0)
+			break;
+
+		flow->turn = 0;
+		if (flow->anext != NULL) {
+			f->active = flow->anext;
+			flow->anext = NULL;
+			f->active_tail->anext = flow;
+			f->active_tail = flow;
+		}
+
+		if (++visited < f->stats.nactive)
+			continue;
+
+		/* A whole round without a flow in credit: every flow is
+		 * paying off a long task. Skip ahead to the round in which
+		 * the first of them is even again, instead of going round
+		 * that many times. */
+		rounds = INT64_MAX;
+		for (flow = f->active; flow != NULL; flow = flow->anext) {
+			credit = f->quantum * flow->weight;
+			if (-flow->deficit / credit < rounds)
+				rounds = -flow->deficit / credit;
+		}
+		for (flow = f->active; flow != NULL; flow = flow->anext)
+			flow->deficit += rounds * f->quantum * flow->weight;
+		visited = 0;
+	}
+
+	if (flow == NULL)
+		return NULL;
+
+	item = flow->head;
+	if ((flow->head = item->next) == NULL)
+		flow->tail = NULL;
+
+	flow->count--;
+	f->stats.count--;
+	if (flow->count == 0)
+		fair_deactivate(f, flow, NULL);
+
+	*flowp = flow;
+
+	return item;
+}
+
+/**
+ * Runs one ticket: picks a task, runs it, and charges its flow for the run
+ * time. The flow is charged its average up front, so that other workers
+ * picking meanwhile already see the cost, and the difference afterwards.
+ * @param arg The fair queue
+ */
+static void fair_run(void *arg)
+{
+	fair_t *f = (fair_t *)arg;
+	fair_flow_t *flow;
+	fair_item_t *item;
+	uint64_t start;
+	int64_t elapsed;
+	int skip;
+
+	pthread_mutex_lock(&f->mtx);
+
+	if ((item = fair_pick(f, &flow)) == NULL) {
+		pthread_mutex_unlock(&f->mtx);
+		return;
+	}
+
+	start = pool_now();
+	skip = (item->deadline && start > item->deadline) ||
+		pool_token_is_cancelled(item->token);
+	if (skip) {
+		f->stats.ncancelled++;
+		fair_release(f, flow);
+	} else {
+		f->stats.ndispatched++;
+		flow->running++;
+		flow->deficit -= flow->cost;
+	}
+
+	pthread_mutex_unlock(&f->mtx);
+
+	if (skip) {
+		if (item->cancel != NULL)
+			(*item->cancel)(item->arg);
+		pool_task_free(item);
+		return;
+	}
+
+	(*item->func)(item->arg);
+
+	elapsed = (int64_t)(pool_now() - start);
+
+	pthread_mutex_lock(&f->mtx);
+	flow->running--;
+	flow->deficit += flow->cost - elapsed;
+	flow->cost += (elapsed - flow->cost) / 8;
+	if (flow->count == 0 && flow->deficit > 0)
+		flow->deficit = 0;
+	fair_release(f, flow);
+	pthread_mutex_unlock(&f->mtx);
+
+	pool_task_free(item);
+}
+
+/**
+ * Cancel callback of a ticket the pool skipped, e.g. shed by admission
+ * control or left over in `pool_free()`. Some task has to go with it; the
+ * oldest task of the longest flow goes, so shedding falls on the flow
+ * that is causing the backlog.
+ * @param arg The fair queue
+ */
+static void fair_drop(void *arg)
+{
+	fair_t *f = (fair_t *)arg;
+	fair_flow_t *flow;
+	fair_flow_t *prev;
+	fair_flow_t *longest = NULL;
+	fair_flow_t *longest_prev = NULL;
+	fair_item_t *item;
+
+	pthread_mutex_lock(&f->mtx);
+
+	for (prev = NULL, flow = f->active; flow != NULL;
+	     prev = flow, flow = flow->anext) {
+		if (longest == NULL || flow->count > longest->count) {
+			longest = flow;
+			longest_prev = prev;
+		}
+	}
+
+	if (longest == NULL) {
+		pthread_mutex_unlock(&f->mtx);
+		return;
+	}
+
+	item = longest->head;
+	if ((longest->head = item->next) == NULL)
+		longest->tail = NULL;
+
+	longest->count--;
+	f->stats.count--;
+	f->stats.ncancelled++;
+	if (longest->count == 0) {
+		fair_deactivate(f, longest, longest_prev);
+		fair_release(f, longest);
+	}
+
+	pthread_mutex_unlock(&f->mtx);
+
+	if (item->cancel != NULL)
+		(*item->cancel)(item->arg);
+	pool_task_free(item);
+}
+
+/**
+ * Adds a task to its flow and a ticket for it to the pool
+ * @param f The fair queue
+ * @param key The flow
+ * @param item The task. Freed here on error.
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int fair_push(fair_t *f, uint64_t key, fair_item_t *item)
+{
+	fair_flow_t *flow;
+	pool_task_opts_t opts;
+
+	pthread_mutex_lock(&f->mtx);
+
+	flow = fair_lookup(f, key, 1);
+	if (flow == NULL ||
+	    (f->flow_capacity && flow->count >= f->flow_capacity)) {
+		f->stats.nrejected++;
+		pthread_mutex_unlock(&f->mtx);
+		pool_task_free(item);
+		poolerrno = POOLERRNO_QUEUE_FULL;
+		return -1;
+	}
+
+	/* The ticket goes in first, under the lock, so a worker holding it
+	 * waits for the task to be added before it picks */
+	memset(&opts, 0, sizeof(opts));
+	opts.cancel = fair_drop;
+	if (pool_enqueue_opts(f->pool, fair_run, f, &opts) < 0) {
+		fair_release(f, flow);
+		pthread_mutex_unlock(&f->mtx);
+		pool_task_free(item);
+		return -1;
+	}
+
+	if (flow->tail == NULL)
+		flow->head = item;
+	else
+		flow->tail->next = item;
+	flow->tail = item;
+
+	if (flow->count++ == 0) {
+		if (f->active_tail == NULL)
+			f->active = flow;
+		else
+			f->active_tail->anext = flow;
+		f->active_tail = flow;
+		f->stats.nactive++;
+	}
+
+	f->stats.count++;
+	f->stats.nenqueued++;
+
+	pthread_mutex_unlock(&f->mtx);
+
+	return 0;
+}
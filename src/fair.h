@@ -0,0 +1,57 @@
+#ifndef FAIR_H_
+#define FAIR_H_
+
+#include "pool.h"
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most flows a fair queue can track at once */
+#define FAIR_MAX_FLOWS 65536
+
+/** Largest weight `fair_set_weight()` accepts */
+#define FAIR_MAX_WEIGHT 1000
+
+/**
+ * Forward declaration of a fair queue: a dispatcher in front of a pool
+ * that keeps one subqueue per flow (a client, a tenant, ...) and hands
+ * the pool's workers tasks from the flows in deficit round robin order,
+ * so one busy flow cannot take all of the worker time.
+ */
+typedef struct fair fair_t;
+
+/**
+ * A snapshot of a fair queue's counters, filled by `fair_get_stats()`
+ */
+typedef struct {
+	size_t nflows; /** Flows tracked now, queued, running or weighted */
+	size_t nactive; /** Flows with tasks queued now */
+	size_t count; /** Tasks queued now */
+	uint64_t nenqueued; /** Tasks accepted */
+	uint64_t ndispatched; /** Tasks handed to a worker */
+	uint64_t ncancelled; /** Tasks skipped, past deadline or dropped */
+	uint64_t nrejected; /** Tasks refused: flow full, or no flow free */
+} fair_stats_t;
+
+/*----------------*
+ * FAIR API CALLS *
+ *----------------*/
+
+fair_t *fair_new(pool_t *pool, size_t max_flows, size_t flow_capacity,
+	unsigned long quantum_us);
+void fair_free(fair_t *f);
+int fair_set_weight(fair_t *f, uint64_t key, unsigned weight);
+int fair_enqueue(fair_t *f, uint64_t key, void (*func)(void *), void *arg,
+	const pool_task_opts_t *opts);
+int fair_enqueue_inline(fair_t *f, uint64_t key, void (*func)(void *),
+	const void *data, size_t len, const pool_task_opts_t *opts);
+int fair_get_stats(fair_t *f, fair_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAIR_H_ */
@@ -0,0 +1,422 @@
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np() */
+#include "lane.h"
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+
+/** Tells the CPU it is in a spin loop, to save power and yield to an SMT
+ * sibling without giving up the core */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+/**
+ * A ring slot. `seq` says whose turn it is: equal to the position when
+ * free for a producer, position + 1 when filled for the consumer.
+ */
+typedef struct {
+	atomic_size_t seq; /** Turn counter */
+	void (*func)(void *); /** The task */
+	void *arg; /** The argument, or `data` for inline arguments */
+	uint64_t enqueued; /** `pool_now()` time of enqueue */
+	unsigned char data[POOL_INLINE_ARG_SIZE]; /** Inline argument storage */
+} lane_slot_t;
+
+/**
+ * A lane worker with its own bounded multi-producer/single-consumer ring.
+ * Producer-written, read-only and worker-written fields each get their own
+ * cache line, so the worker's stores never evict what producers read.
+ */
+typedef struct {
+	_Alignas(64) atomic_size_t tail; /** Next position to claim, producers */
+	_Alignas(64) lane_slot_t *slots; /** The ring */
+	size_t mask; /** Number of slots minus one */
+	pthread_t thread; /** The worker's thread */
+	struct lane *lane; /** The lane */
+	_Alignas(64) size_t head; /** Next position to run, worker only */
+	atomic_uint_least64_t ncompleted; /** Written by the worker only */
+	atomic_uint_least64_t hist[LANE_HIST_BUCKETS]; /** Worker only */
+} lane_worker_t;
+
+/**
+ * The lane struct
+ */
+struct lane {
+	lane_worker_t *workers; /** The workers */
+	size_t nworkers; /** Number of workers */
+	atomic_size_t next; /** Round-robin ring choice for producers */
+	atomic_int stopping; /** Set by `lane_free()` */
+	atomic_uint_least64_t nenqueued; /** Tasks accepted */
+	atomic_uint_least64_t nrejected; /** Tasks refused */
+};
+
+static int lane_push(lane_t *lane, void (*func)(void *), void *arg,
+	const void *data, size_t len);
+static void *lane_worker(void *arg);
+
+/**
+ * Creates a latency lane. Its workers never sleep: each spins on its own
+ * ring, so a task starts within the time it takes to notice a cache line
+ * change. That costs one CPU per worker, so pin them to CPUs kept free of
+ * other work (e.g. with isolcpus=). The pool's own workers are unaffected.
+ * @param nworkers Number of workers
+ * @param capacity Slots per worker ring, rounded up to a power of two
+ * @param opts Pinning and scheduling, or NULL for neither
+ * @return Returns a `lane_t` object on success. On error, NULL is returned
+ *   and `poolerrno` is set; EPERM means SCHED_FIFO was not allowed.
+ */
+lane_t *lane_new(size_t nworkers, size_t capacity, const lane_opts_t *opts)
+{
+	lane_t *lane;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	cpu_set_t cpus;
+	size_t n;
+	int rc = 0;
+
+	if (nworkers == 0 || nworkers > LANE_MAX_WORKERS || capacity == 0 ||
+	    capacity > DEFAULT_QUEUE_CAPACITY ||
+	    (opts && opts->pin && opts->cpu_first + nworkers > CPU_SETSIZE)) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	lane = (lane_t *)calloc(1, sizeof(*lane));
+	if (lane == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	lane->workers = (lane_worker_t *)aligned_alloc(64,
+		nworkers * sizeof(*lane->workers));
+	if (lane->workers == NULL) {
+		free(lane);
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+	memset(lane->workers, 0, nworkers * sizeof(*lane->workers));
+
+	for (n = 1; n < capacity; n <<= 1)
+		;
+
+	atomic_init(&lane->next, 0);
+	atomic_init(&lane->stopping, 0);
+	atomic_init(&lane->nenqueued, 0);
+	atomic_init(&lane->nrejected, 0);
+
+	for (size_t i = 0; i < nworkers; i++) {
+		lane_worker_t *w = &lane->workers[i];
+
+		w->slots = (lane_slot_t *)calloc(n, sizeof(*w->slots));
+		if (w->slots == NULL) {
+			lane->nworkers = i;
+			lane_free(lane);
+			poolerrno = ENOMEM;
+			return NULL;
+		}
+		for (size_t j = 0; j < n; j++)
+			atomic_init(&w->slots[j].seq, j);
+		w->mask = n - 1;
+		w->lane = lane;
+		atomic_init(&w->tail, 0);
+	}
+
+	for (size_t i = 0; i < nworkers; i++) {
+		lane_worker_t *w = &lane->workers[i];
+
+		pthread_attr_init(&attr);
+
+		if (opts && opts->pin) {
+			CPU_ZERO(&cpus);
+			CPU_SET(opts->cpu_first + i, &cpus);
+			rc = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+
+		if (rc == 0 && opts && opts->fifo_priority > 0) {
+			memset(&sp, 0, sizeof(sp));
+			sp.sched_priority = opts->fifo_priority;
+			rc = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			if (rc == 0)
+				rc = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+			if (rc == 0)
+				rc = pthread_attr_setschedparam(&attr, &sp);
+		}
+
+		if (rc == 0)
+			rc = pthread_create(&w->thread, &attr, lane_worker, w);
+
+		pthread_attr_destroy(&attr);
+
+		if (rc != 0) {
+			/* Stop the workers already running, free every ring */
+			atomic_store(&lane->stopping, 1);
+			for (size_t j = 0; j < i; j++)
+				pthread_join(lane->workers[j].thread, NULL);
+			for (size_t j = 0; j < nworkers; j++)
+				free(lane->workers[j].slots);
+			free(lane->workers);
+			free(lane);
+			poolerrno = rc;
+			return NULL;
+		}
+
+		lane->nworkers = i + 1;
+	}
+
+	return lane;
+}
+
+/**
+ * Stops a lane once every accepted task has run, and frees it
+ * @param lane The lane, or NULL
+ */
+void lane_free(lane_t *lane)
+{
+	if (lane == NULL)
+		return;
+
+	atomic_store(&lane->stopping, 1);
+
+	for (size_t i = 0; i < lane->nworkers; i++) {
+		if (lane->workers[i].thread)
+			pthread_join(lane->workers[i].thread, NULL);
+		free(lane->workers[i].slots);
+	}
+
+	free(lane->workers);
+	free(lane);
+}
+
+/**
+ * Puts a task on the next worker's ring, trying the others if it is full.
+ * Wait-free for the caller apart from retries on a contended slot.
+ * @param lane The lane
+ * @param func The task
+ * @param arg The argument
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set; `POOLERRNO_QUEUE_FULL` means every ring is full.
+ */
+int lane_enqueue(lane_t *lane, void (*func)(void *), void *arg)
+{
+	if (lane == NULL || func == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	return lane_push(lane, func, arg, NULL, 0);
+}
+
+/**
+ * Like `lane_enqueue()`, but copies `len` bytes of `data` into the slot
+ * and calls `func` with a pointer to the copy, as `pool_enqueue_inline()`
+ * does
+ * @param lane The lane
+ * @param func The task
+ * @param data The argument bytes
+ * @param len Number of bytes, at most `POOL_INLINE_ARG_SIZE`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int lane_enqueue_inline(lane_t *lane, void (*func)(void *),
+	const void *data, size_t len)
+{
+	if (lane == NULL || func == NULL || data == NULL ||
+	    len > POOL_INLINE_ARG_SIZE) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	return lane_push(lane, func, NULL, data, len);
+}
+
+/**
+ * Sums a lane's counters
+ * @param lane The lane
+ * @param stats This variable is filled with the counters
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int lane_get_stats(lane_t *lane, lane_stats_t *stats)
+{
+	if (lane == NULL || stats == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	stats->nworkers = lane->nworkers;
+	stats->nenqueued = atomic_load_explicit(&lane->nenqueued,
+		memory_order_relaxed);
+	stats->nrejected = atomic_load_explicit(&lane->nrejected,
+		memory_order_relaxed);
+
+	for (size_t i = 0; i < lane->nworkers; i++) {
+		lane_worker_t *w = &lane->workers[i];
+
+		stats->ncompleted += atomic_load_explicit(&w->ncompleted,
+			memory_order_relaxed);
+		for (size_t b = 0; b < LANE_HIST_BUCKETS; b++)
+			stats->hist[b] += atomic_load_explicit(&w->hist[b],
+				memory_order_relaxed);
+	}
+
+	return 0;
+}
+
+/**
+ * Reads a percentile off the queue delay histogram
+ * @param stats Counters from `lane_get_stats()`
+ * @param p The percentile, from 0 to 100
+ * @return Returns the upper bound in ns of the bucket holding the
+ *   percentile, or 0 if nothing has run yet
+ */
+uint64_t lane_stats_percentile(const lane_stats_t *stats, double p)
+{
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	uint64_t want;
+
+	for (size_t b = 0; b < LANE_HIST_BUCKETS; b++)
+		total += stats->hist[b];
+	if (total == 0)
+		return 0;
+
+	want = (uint64_t)(total * p / 100.0);
+	if (want >= total)
+		want = total - 1;
+
+	for (size_t b = 0; b < LANE_HIST_BUCKETS; b++) {
+		seen += stats->hist[b];
+		if (seen > want)
+			return (uint64_t)2 << b;
+	}
+
+	return (uint64_t)2 << (LANE_HIST_BUCKETS - 1);
+}
+
+/**
+ * Claims a slot on one of the rings and fills it
+ * @param lane The lane
+ * @param func The task
+ * @param arg The argument, if `data` is NULL
+ * @param data Inline argument bytes, or NULL
+ * @param len Number of bytes in `data`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int lane_push(lane_t *lane, void (*func)(void *), void *arg,
+	const void *data, size_t len)
+{
+	size_t first = atomic_fetch_add_explicit(&lane->next, 1,
+		memory_order_relaxed);
+
+	if (atomic_load_explicit(&lane->stopping, memory_order_relaxed)) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	for (size_t k = 0; k < lane->nworkers; k++) {
+		lane_worker_t *w = &lane->workers[(first + k) % lane->nworkers];
+		size_t pos = atomic_load_explicit(&w->tail, memory_order_relaxed);
+		lane_slot_t *slot;
+
+		for (;;) {
+			size_t seq;
+
+			slot = &w->slots[pos & w->mask];
+			seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+			if (seq == pos) {
+				if (atomic_compare_exchange_weak_explicit(&w->tail,
+				    &pos, pos + 1, memory_order_relaxed,
+				    memory_order_relaxed))
+					break;
+			} else if (seq < pos) {
+				/* Full: the worker has not taken this slot's
+				 * previous task yet */
+				slot = NULL;
+				break;
+			} else {
+				pos = atomic_load_explicit(&w->tail,
+					memory_order_relaxed);
+			}
+		}
+
+		if (slot == NULL)
+			continue;
+
+		slot->func = func;
+		if (data != NULL) {
+			memcpy(slot->data, data, len);
+			slot->arg = slot->data;
+		} else {
+			slot->arg = arg;
+		}
+		slot->enqueued = pool_now();
+		atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+		atomic_fetch_add_explicit(&lane->nenqueued, 1,
+			memory_order_relaxed);
+		return 0;
+	}
+
+	atomic_fetch_add_explicit(&lane->nrejected, 1, memory_order_relaxed);
+	poolerrno = POOLERRNO_QUEUE_FULL;
+	return -1;
+}
+
+/**
+ * A lane worker. Spins on its ring, running tasks as they appear, until
+ * the lane is stopping and the ring is empty.
+ * @param arg The `lane_worker_t`
+ * @return Always returns NULL
+ */
+static void *lane_worker(void *arg)
+{
+	lane_worker_t *w = (lane_worker_t *)arg;
+	lane_t *lane = w->lane;
+	lane_slot_t *slot;
+	uint64_t delay;
+	size_t b;
+
+	for (;;) {
+		slot = &w->slots[w->head & w->mask];
+
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+		    w->head + 1) {
+			/* An empty ring with a claim still being filled is
+			 * not empty, so check the tail too before leaving */
+			if (atomic_load_explicit(&lane->stopping,
+			                         memory_order_acquire) &&
+			    atomic_load_explicit(&w->tail, memory_order_acquire) ==
+			    w->head)
+				break;
+			cpu_relax();
+			continue;
+		}
+
+		delay = pool_now() - slot->enqueued;
+		for (b = 0; b < LANE_HIST_BUCKETS - 1 && (delay >> (b + 1)) != 0; b++)
+			;
+		atomic_store_explicit(&w->hist[b],
+			atomic_load_explicit(&w->hist[b], memory_order_relaxed) + 1,
+			memory_order_relaxed);
+
+		(*slot->func)(slot->arg);
+
+		atomic_store_explicit(&slot->seq, w->head + w->mask + 1,
+			memory_order_release);
+		w->head++;
+
+		atomic_store_explicit(&w->ncompleted,
+			atomic_load_explicit(&w->ncompleted, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef LANE_H_
+#define LANE_H_
+
+#include "pool.h"
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most workers in a lane */
+#define LANE_MAX_WORKERS 64
+
+/**
+ * Number of histogram buckets. Bucket `i` counts queue delays of at
+ * least 2^i and less than 2^(i+1) ns; the last one also counts anything
+ * longer.
+ */
+#define LANE_HIST_BUCKETS 32
+
+/**
+ * Forward declaration of a latency lane: workers that busy-poll their own
+ * rings instead of sleeping, for tasks that cannot wait for a wakeup.
+ */
+typedef struct lane lane_t;
+
+/**
+ * Options for `lane_new()`. Zero-initialize and set what is needed.
+ */
+typedef struct {
+	size_t cpu_first; /** Worker `i` is pinned to CPU `cpu_first + i` */
+	int pin; /** Non-zero to pin workers as above */
+	int fifo_priority; /** SCHED_FIFO priority, or 0 for the default policy */
+} lane_opts_t;
+
+/**
+ * A snapshot of a lane's counters, filled by `lane_get_stats()`
+ */
+typedef struct {
+	size_t nworkers; /** Number of workers */
+	uint64_t nenqueued; /** Tasks accepted */
+	uint64_t ncompleted; /** Tasks that have returned */
+	uint64_t nrejected; /** Tasks refused because every ring was full */
+	uint64_t hist[LANE_HIST_BUCKETS]; /** Enqueue-to-start delay, log2 ns */
+} lane_stats_t;
+
+/*----------------*
+ * LANE API CALLS *
+ *----------------*/
+
+lane_t *lane_new(size_t nworkers, size_t capacity, const lane_opts_t *opts);
+void lane_free(lane_t *lane);
+int lane_enqueue(lane_t *lane, void (*func)(void *), void *arg);
+int lane_enqueue_inline(lane_t *lane, void (*func)(void *),
+	const void *data, size_t len);
+int lane_get_stats(lane_t *lane, lane_stats_t *stats);
+uint64_t lane_stats_percentile(const lane_stats_t *stats, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LANE_H_ */
@@ -0,0 +1,377 @@
+#include "log.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h> /* writev() */
+
+/** Bytes buffered per thread. Must be a power of two */
+#define LOG_RING_SIZE  65536
+
+/** Longest message; longer ones are truncated */
+#define LOG_LINE_MAX   1024
+
+/** How often the log thread looks for new messages */
+#define LOG_FLUSH_MS   5
+
+/** Most buffers gathered into one writev() */
+#define LOG_IOV_MAX    64
+
+/**
+ * A thread's message ring. The owning thread appends at `head` and the log
+ * thread writes out from `tail`; both are running byte counts, so the
+ * ring needs no lock.
+ */
+typedef struct log_buf {
+	struct log_buf *next; /** Next ring in the global list */
+	atomic_uint_fast64_t head; /** Bytes appended so far */
+	atomic_uint_fast64_t tail; /** Bytes written out so far */
+	atomic_int in_use; /** Non-zero while a live thread owns the ring */
+	char data[LOG_RING_SIZE]; /** The messages */
+} log_buf_t;
+
+atomic_int log_level = LOG_LEVEL_WARN;
+
+static pthread_mutex_t bufs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static log_buf_t *bufs = NULL;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static __thread log_buf_t *self = NULL;
+
+static pthread_mutex_t run_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cnd = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static atomic_int running = 0;
+static int stopping = 0;
+static int out_fd = STDOUT_FILENO;
+static atomic_uint_fast64_t ndropped = 0;
+
+static void *log_loop(void *arg);
+static int log_flush(void);
+
+/**
+ * Thread-exit destructor. The ring stays on the list until the log thread
+ * has written it out, but may be taken over by a new thread.
+ * @param arg The exiting thread's ring
+ */
+static void buf_release(void *arg)
+{
+	atomic_store(&((log_buf_t *)arg)->in_use, 0);
+}
+
+static void key_init(void)
+{
+	pthread_key_create(&key, buf_release);
+}
+
+/**
+ * Finds a ring for the calling thread, reusing one left by an exited
+ * thread if possible. Only runs once per thread.
+ * @return Returns the ring, or NULL if out of memory
+ */
+static log_buf_t *buf_acquire(void)
+{
+	log_buf_t *b;
+	int expected;
+
+	pthread_once(&key_once, key_init);
+	pthread_mutex_lock(&bufs_mtx);
+
+	for (b = bufs; b != NULL; b = b->next) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&b->in_use, &expected, 1))
+			break;
+	}
+
+	if (b == NULL && (b = (log_buf_t *)malloc(sizeof(*b))) != NULL) {
+		atomic_init(&b->head, 0);
+		atomic_init(&b->tail, 0);
+		atomic_init(&b->in_use, 1);
+		b->next = bufs;
+		bufs = b;
+	}
+
+	pthread_mutex_unlock(&bufs_mtx);
+
+	if (b != NULL)
+		pthread_setspecific(key, b);
+
+	return b;
+}
+
+/**
+ * Starts the log thread. Until it runs, and after `log_stop()`, messages
+ * are written straight to the file descriptor instead. `log_stop()` is
+ * registered with atexit(), so buffered messages are not lost on exit.
+ * @param fd The file descriptor to write to
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int log_start(int fd)
+{
+	static int registered = 0;
+	int rc;
+
+	if (fd < 0) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (atomic_load(&running)) {
+		poolerrno = EBUSY;
+		return -1;
+	}
+
+	/* Anything printed before now must come out first */
+	fflush(stdout);
+
+	out_fd = fd;
+	stopping = 0;
+
+	if ((rc = pthread_create(&thread, NULL, log_loop, NULL)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	atomic_store(&running, 1);
+
+	if (!registered && atexit(log_stop) == 0)
+		registered = 1;
+
+	return 0;
+}
+
+/**
+ * Writes out everything buffered and stops the log thread
+ */
+void log_stop(void)
+{
+	if (!atomic_exchange(&running, 0))
+		return;
+
+	/* New messages go straight to the descriptor from here on */
+	pthread_mutex_lock(&run_mtx);
+	stopping = 1;
+	pthread_cond_signal(&run_cnd);
+	pthread_mutex_unlock(&run_mtx);
+
+	pthread_join(thread, NULL);
+
+	/* Messages appended while the thread was exiting */
+	log_flush();
+}
+
+/**
+ * Detaches a forked child from the log thread, which the child does not
+ * have. The parent's rings are left alone, and the child's messages are
+ * written straight to standard error, since the log descriptor may be
+ * one the child closes.
+ */
+void log_forked(void)
+{
+	atomic_store(&running, 0);
+	self = NULL;
+	out_fd = STDERR_FILENO;
+}
+
+/**
+ * Sets which messages are logged
+ * @param level The least severe level to log
+ */
+void log_set_level(log_level_t level)
+{
+	atomic_store(&log_level, (int)level);
+}
+
+/**
+ * @return Returns the number of messages dropped because a thread's ring
+ *   was full
+ */
+uint64_t log_dropped(void)
+{
+	return atomic_load(&ndropped);
+}
+
+/**
+ * Formats a message into the calling thread's ring. Never blocks: if the
+ * log thread has fallen behind and the ring is full, the message is
+ * dropped and counted. Use the LOG() macro, which checks the level first.
+ * @param level The message's level
+ * @param fmt printf-style format
+ */
+void log_write(log_level_t level, const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX];
+	log_buf_t *b = self;
+	uint_fast64_t head;
+	uint_fast64_t tail;
+	size_t off;
+	size_t len = 0;
+	va_list ap;
+	int n;
+
+	if (level == LOG_LEVEL_ERROR)
+		len = strlen(strcpy(line, "ERROR: "));
+	else if (level == LOG_LEVEL_WARN)
+		len = strlen(strcpy(line, "WARN: "));
+
+	va_start(ap, fmt);
+	n = vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+	len += (size_t)n;
+	if (len >= sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+
+	if (!atomic_load_explicit(&running, memory_order_acquire)) {
+		if (write(out_fd, line, len) < 0) {
+			/* Nowhere left to report it */
+		}
+		return;
+	}
+
+	if (b == NULL && (b = self = buf_acquire()) == NULL) {
+		atomic_fetch_add(&ndropped, 1);
+		return;
+	}
+
+	head = atomic_load_explicit(&b->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+	if (LOG_RING_SIZE - (head - tail) < len) {
+		atomic_fetch_add(&ndropped, 1);
+		return;
+	}
+
+	off = head & (LOG_RING_SIZE - 1);
+	if (off + len <= LOG_RING_SIZE) {
+		memcpy(b->data + off, line, len);
+	} else {
+		memcpy(b->data + off, line, LOG_RING_SIZE - off);
+		memcpy(b->data, line + (LOG_RING_SIZE - off),
+			len - (LOG_RING_SIZE - off));
+	}
+
+	atomic_store_explicit(&b->head, head + len, memory_order_release);
+}
+
+/**
+ * Gathers every ring's pending bytes and writes them with one writev()
+ * per LOG_IOV_MAX buffers. Only the log thread, or `log_stop()` after it
+ * has exited, may call this.
+ * @return Returns the number of bytes written
+ */
+static int log_flush(void)
+{
+	struct iovec iov[LOG_IOV_MAX];
+	log_buf_t *ring[LOG_IOV_MAX];
+	size_t take[LOG_IOV_MAX];
+	size_t niov;
+	size_t nring;
+	log_buf_t *b;
+	log_buf_t *first;
+	ssize_t n;
+	int total = 0;
+
+	pthread_mutex_lock(&bufs_mtx);
+	first = bufs;
+	pthread_mutex_unlock(&bufs_mtx);
+
+	b = first;
+	while (b != NULL) {
+		niov = 0;
+		nring = 0;
+
+		/* A ring that wraps needs two buffers */
+		for (; b != NULL && niov + 2 <= LOG_IOV_MAX; b = b->next) {
+			uint_fast64_t head = atomic_load_explicit(&b->head,
+				memory_order_acquire);
+			uint_fast64_t tail = atomic_load_explicit(&b->tail,
+				memory_order_relaxed);
+			size_t off = tail & (LOG_RING_SIZE - 1);
+			size_t len = head - tail;
+
+			if (len == 0)
+				continue;
+
+			iov[niov].iov_base = b->data + off;
+			iov[niov].iov_len = len;
+			if (off + len > LOG_RING_SIZE) {
+				iov[niov].iov_len = LOG_RING_SIZE - off;
+				niov++;
+				iov[niov].iov_base = b->data;
+				iov[niov].iov_len = len - (LOG_RING_SIZE - off);
+			}
+			niov++;
+
+			ring[nring] = b;
+			take[nring] = len;
+			nring++;
+		}
+
+		if (niov == 0)
+			break;
+
+		do {
+			n = writev(out_fd, iov, (int)niov);
+		} while (n < 0 && errno == EINTR);
+
+		/* On error the bytes are discarded rather than retried forever */
+		for (size_t i = 0; i < nring; i++) {
+			size_t done = take[i];
+
+			if (n >= 0 && (size_t)n < done)
+				done = (size_t)n;
+			if (n >= 0)
+				n -= done;
+			atomic_fetch_add_explicit(&ring[i]->tail, done,
+				memory_order_release);
+			total += done;
+		}
+	}
+
+	return total;
+}
+
+/**
+ * The log thread. Wakes up every LOG_FLUSH_MS and writes out whatever the
+ * other threads have logged since.
+ * @param arg Unused
+ * @return Always returns NULL
+ */
+static void *log_loop(void *arg)
+{
+	struct timespec ts;
+	int stop = 0;
+
+	(void)arg;
+
+	while (!stop) {
+		log_flush();
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&run_mtx);
+		if (!stopping)
+			pthread_cond_timedwait(&run_cnd, &run_mtx, &ts);
+		stop = stopping;
+		pthread_mutex_unlock(&run_mtx);
+	}
+
+	log_flush();
+
+	return NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Log levels, most severe first. A message is logged if its level is at
+ * most the current level.
+ */
+typedef enum {
+	LOG_LEVEL_OFF = 0, /** Log nothing */
+	LOG_LEVEL_ERROR, /** Failures, prefixed with "ERROR: " */
+	LOG_LEVEL_WARN, /** Recoverable problems, prefixed with "WARN: " */
+	LOG_LEVEL_INFO, /** Per-connection diagnostics */
+	LOG_LEVEL_DEBUG, /** Everything */
+} log_level_t;
+
+/*---------------*
+ * LOG API CALLS *
+ *---------------*/
+
+int log_start(int fd);
+void log_stop(void);
+void log_forked(void);
+void log_set_level(log_level_t level);
+uint64_t log_dropped(void);
+void log_write(log_level_t level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+extern atomic_int log_level;
+
+/**
+ * Logs a printf-style message. The level is checked before the arguments
+ * are evaluated or formatted, so disabled messages cost one relaxed load.
+ */
+#define LOG(level, ...) \
+	do { \
+		if ((int)(level) <= \
+		    atomic_load_explicit(&log_level, memory_order_relaxed)) \
+			log_write((level), __VA_ARGS__); \
+	} while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LOG_H_ */
@@ -1,5 +1,16 @@
 #include "pool.h"
 #include "jsmn.h"
+#include "trace.h"
+#include "admin.h"
+#include "router.h"
+#include "shard.h"
+#include "cache.h"
+#include "log.h"
+#include "capture.h"
+#include "procpool.h"
+#include "pipeline.h"
+#include "fair.h"
+#include "wire.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,11 +26,51 @@
 #define VERSION       "0.1"
 #define DEFAULT_PORT  30303
 
+/** Default time to live of cached replies with -C */
+#define DEFAULT_CACHE_TTL_MS 1000
+
+/** Bytes per entry assumed when sizing the cache with -C */
+#define CACHE_ENTRY_SIZE 128
+
+/** CoDel interval used with -L, the RFC 8289 default */
+#define ADMISSION_INTERVAL_US 100000
+
+/** Worker time each client gets per turn with -F */
+#define FAIR_QUANTUM_US 1000
+
+/** Most clients tracked at once with -F */
+#define FAIR_FLOWS 4096
+
+/** Binary route ids, see wire.h */
+#define WIRE_PING 1
+#define WIRE_ECHO 2
+
 static int port = DEFAULT_PORT;
-static int capacity = MAX_QUEUE_CAPACITY;
+static int capacity = DEFAULT_QUEUE_CAPACITY;
 static int nthreads = MAX_WORKER_THREADS;
 static int verbose = 0;
 static int keep_going = 0;
+static const char *trace_path = NULL;
+static int admin_port = 0;
+static int deadline_ms = 0;
+static int latency_target_us = 0;
+static router_t *router = NULL;
+static int sharded = 0;
+static size_t cache_kb = 0;
+static int cache_ttl_ms = DEFAULT_CACHE_TTL_MS;
+static cache_t *cache = NULL;
+static const char *capture_path = NULL;
+static const char *replay_path = NULL;
+static double replay_speed = 1.0;
+static size_t nprocs = 0;
+static procpool_t *procpool = NULL;
+static int route_id = -1;
+static size_t nshards = 0;
+static int pipelined = 0;
+static pipeline_t *pipe_srv = NULL;
+static int fair_mode = 0;
+static size_t fair_flow_capacity = 0;
+static int watchdog_ms = 0;
 
 /**
  * @param argv0 @todo TODO Document
@@ -30,9 +81,25 @@ void print_help(const char *argv0)
 Usage: %s [OPTIONS]\n\
 \n\
 Options:\n\
+  -a, --admin PORT         Serve stats and accept commands on localhost:PORT\n\
   -c, --capacity  \n\
+  -C, --cache KB           Cache up to KB of replies to identical messages\n\
+  -E, --cache-ttl MS       Expire cached replies after MS (default 1000)\n\
+  -d, --deadline MS        Drop connections queued for longer than MS\n\
   -p, --port      \n\
+  -P, --processes N        Route messages in N crash-isolated processes\n\
+  -r, --capture FILE       Record received messages to FILE\n\
+  -R, --replay FILE        Send a recording to localhost:PORT and exit\n\
+  -s, --speed X            Replay X times faster, 0 for flat out (default 1)\n\
+  -S, --shards N           Run N acceptors with a pool each, 0 for one per CPU\n\
   -t, --threads   \n\
+  -T, --trace FILE         Record task events, write them to FILE on exit\n\
+  -e, --trace-export FILE  Print a trace capture as Chrome trace JSON\n\
+  -L, --latency-target US  Shed load when queue delay stays above US\n\
+  -M, --pipeline           Read, route and reply in separate thread stages\n\
+  -F, --fair N             Share workers fairly between client addresses,\n\
+                           queueing at most N connections each, 0 for no limit\n\
+  -W, --watchdog MS        Report tasks running past MS and replace their workers\n\
   -v, --verbose   \n\
   -V, --version   \n\
 \n",
@@ -49,26 +116,92 @@ void argparser(int argc, char **argv)
 	int c, optind;
 
 	static struct option lopts[] = {
-		{ "capacity", no_argument, 0, 'c' },
+		{ "admin", required_argument, 0, 'a' },
+		{ "capacity", required_argument, 0, 'c' },
+		{ "cache", required_argument, 0, 'C' },
+		{ "cache-ttl", required_argument, 0, 'E' },
+		{ "deadline", required_argument, 0, 'd' },
 		{ "port", required_argument, 0, 'p' },
+		{ "processes", required_argument, 0, 'P' },
+		{ "capture", required_argument, 0, 'r' },
+		{ "replay", required_argument, 0, 'R' },
+		{ "speed", required_argument, 0, 's' },
+		{ "shards", required_argument, 0, 'S' },
 		{ "threads", required_argument, 0, 't' },
+		{ "trace", required_argument, 0, 'T' },
+		{ "trace-export", required_argument, 0, 'e' },
+		{ "latency-target", required_argument, 0, 'L' },
+		{ "pipeline", no_argument, 0, 'M' },
+		{ "fair", required_argument, 0, 'F' },
+		{ "watchdog", required_argument, 0, 'W' },
 		{ "verbose", no_argument, 0, 'v' },
 		{ "version", no_argument, 0, 'V' },
 		{ "help", no_argument, 0, '?' },
 		{ 0, 0, 0, 0 }
 	};
 
-	while ((c = getopt_long(argc, argv, "c:p:t:vV?", lopts, &optind)) != -1) {
+	while ((c = getopt_long(argc, argv, "a:c:C:E:d:p:P:r:R:s:S:t:T:e:L:MF:W:vV?", lopts, &optind)) != -1) {
 		switch (c) {
+		case 'a': /* admin */
+			admin_port = strtoul(optarg, 0, 0);
+			break;
 		case 'c': /* capacity */
 			capacity = strtoul(optarg, 0, 0);
 			break;
+		case 'C': /* cache */
+			cache_kb = strtoul(optarg, 0, 0);
+			break;
+		case 'E': /* cache-ttl */
+			cache_ttl_ms = strtoul(optarg, 0, 0);
+			break;
+		case 'd': /* deadline */
+			deadline_ms = strtoul(optarg, 0, 0);
+			break;
 		case 'p': /* port */
 			port = strtoul(optarg, 0, 0);
 			break;
+		case 'P': /* processes */
+			nprocs = strtoul(optarg, 0, 0);
+			break;
+		case 'r': /* capture */
+			capture_path = optarg;
+			break;
+		case 'R': /* replay */
+			replay_path = optarg;
+			break;
+		case 's': /* speed */
+			replay_speed = strtod(optarg, 0);
+			break;
+		case 'S': /* shards */
+			sharded = 1;
+			nshards = strtoul(optarg, 0, 0);
+			break;
 		case 't': /* nthreads */
 			nthreads = strtoul(optarg, 0, 0);
 			break;
+		case 'T': /* trace */
+			trace_path = optarg;
+			break;
+		case 'e': /* trace-export */
+			if (trace_export_chrome(optarg, stdout) < 0) {
+				printf("ERROR: %s: %s\n", optarg, poolerrno_str(poolerrno));
+				exit(1);
+			}
+			exit(0);
+			break;
+		case 'L': /* latency-target */
+			latency_target_us = strtoul(optarg, 0, 0);
+			break;
+		case 'M': /* pipeline */
+			pipelined = 1;
+			break;
+		case 'F': /* fair */
+			fair_mode = 1;
+			fair_flow_capacity = strtoul(optarg, 0, 0);
+			break;
+		case 'W': /* watchdog */
+			watchdog_ms = strtoul(optarg, 0, 0);
+			break;
 		case 'v': /*verbose */
 			verbose = 1;
 			break;
@@ -88,29 +221,455 @@ void argparser(int argc, char **argv)
 	}
 }
 
+/**
+ * Handles {"type":"ping"} messages
+ * @param msg The tokenized message
+ * @param out Buffer for the reply
+ * @param outlen Size of `out`
+ * @param ctx Unused
+ * @return Returns the reply length
+ */
+int handle_ping(const router_msg_t *msg, char *out, size_t outlen, void *ctx)
+{
+	(void)msg;
+	(void)ctx;
+
+	return snprintf(out, outlen, "{\"type\":\"pong\"}");
+}
+
+/**
+ * Handles {"type":"echo"} messages by replying with the message itself
+ * @param msg The tokenized message
+ * @param out Buffer for the reply
+ * @param outlen Size of `out`
+ * @param ctx Unused
+ * @return Returns the reply length, or -1 if it does not fit
+ */
+int handle_echo(const router_msg_t *msg, char *out, size_t outlen, void *ctx)
+{
+	(void)ctx;
+
+	if (msg->len > outlen)
+		return -1;
+
+	memcpy(out, msg->js, msg->len);
+
+	return (int)msg->len;
+}
+
+/**
+ * Handles binary ping frames with an empty reply
+ * @param msg The frame
+ * @param out Buffer for the reply body
+ * @param outlen Size of `out`
+ * @param ctx Unused
+ * @return Returns the reply body length, 0
+ */
+int handle_wire_ping(const wire_msg_t *msg, void *out, size_t outlen,
+	void *ctx)
+{
+	(void)msg;
+	(void)out;
+	(void)outlen;
+	(void)ctx;
+
+	return 0;
+}
+
+/**
+ * Handles binary echo frames by replying with the body
+ * @param msg The frame
+ * @param out Buffer for the reply body
+ * @param outlen Size of `out`
+ * @param ctx Unused
+ * @return Returns the reply body length, or -1 if it does not fit
+ */
+int handle_wire_echo(const wire_msg_t *msg, void *out, size_t outlen,
+	void *ctx)
+{
+	(void)ctx;
+
+	if (msg->len > outlen) {
+		poolerrno = ENOSPC;
+		return -1;
+	}
+
+	memcpy(out, msg->body, msg->len);
+
+	return (int)msg->len;
+}
+
+/**
+ * Builds the message router. Add new message types here.
+ * @return Returns 0 on success, else -1 with `poolerrno` set
+ */
+int router_setup(void)
+{
+	if ((router = router_new("type")) == NULL)
+		return -1;
+
+	if (router_add(router, "ping", handle_ping, NULL) < 0 ||
+	    router_add(router, "echo", handle_echo, NULL) < 0 ||
+	    router_add_wire(router, WIRE_PING, handle_wire_ping, NULL) < 0 ||
+	    router_add_wire(router, WIRE_ECHO, handle_wire_echo, NULL) < 0 ||
+	    router_compile(router) < 0) {
+		router_free(router);
+		router = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Routes a binary frame to its handler, which writes its body straight
+ * into place behind the reply header
+ * @param arg The frame
+ * @param len Length of `arg`
+ * @param out Buffer for the reply frame
+ * @param outlen Size of `out`
+ * @return Returns the reply length; routing errors are replied to as well
+ */
+int route_wire(const void *arg, size_t len, void *out, size_t outlen)
+{
+	wire_msg_t msg;
+	int n;
+
+	if (outlen < WIRE_HDR_SIZE) {
+		poolerrno = ENOSPC;
+		return -1;
+	}
+
+	if (wire_parse(arg, len, &msg) < 0)
+		return wire_error(arg, len, out, outlen, poolerrno);
+
+	n = router_dispatch_wire(router, &msg, (char *)out + WIRE_HDR_SIZE,
+		outlen - WIRE_HDR_SIZE);
+	if (n < 0)
+		return wire_error(arg, len, out, outlen, poolerrno);
+
+	return wire_frame(out, outlen, msg.type, 0, n);
+}
+
+/**
+ * Routes a message to its handler. With -P this runs in a worker process,
+ * so a handler that crashes only takes that process down. The first byte
+ * picks the framing: binary frames go to `route_wire()`, anything else is
+ * taken as JSON.
+ * @param arg The message
+ * @param len Length of `arg`
+ * @param out Buffer for the reply
+ * @param outlen Size of `out`
+ * @return Returns the reply length; routing errors are replied to as well
+ */
+int route_msg(const void *arg, size_t len, void *out, size_t outlen)
+{
+	int n;
+
+	if (wire_is_frame(arg, len))
+		return route_wire(arg, len, out, outlen);
+
+	n = router_dispatch(router, (const char *)arg, len, (char *)out,
+		outlen);
+
+	if (n < 0)
+		n = snprintf((char *)out, outlen, "{\"error\":\"%s\"}",
+			poolerrno_str(poolerrno));
+
+	return n;
+}
+
+/**
+ * Replies to a message that arrived while an identical one was being
+ * processed, once that one is done
+ * @param val The reply, or NULL if the first message could not be cached
+ * @param len Length of `val`
+ * @param ctx The client socket descriptor, cast to a pointer
+ */
+void reply_cached(const void *val, size_t len, void *ctx)
+{
+	int fd = (int)(intptr_t)ctx;
+	const char *err = "{\"error\":\"Try again\"}";
+
+	if (val == NULL) {
+		val = err;
+		len = strlen(err);
+	}
+
+	if (write(fd, val, len) < 0)
+		LOG(LOG_LEVEL_WARN, "write() failed: %s\n", strerror(errno));
+
+	close(fd);
+}
+
+/**
+ * An accepted connection, passed inline to `process_msg()`
+ */
+typedef struct {
+	int fd; /** The client socket descriptor */
+	uint64_t arrived; /** `capture_now()` time of accept(), or 0 */
+} conn_t;
+
+/**
+ * A message on its way through the server: read, then routed, then
+ * replied to. `process_msg()` does all three in one task; with -M each is
+ * a pipeline stage of its own.
+ */
+typedef struct {
+	int fd; /** The client socket descriptor */
+	uint64_t arrived; /** `capture_now()` time of accept(), or 0 */
+	ssize_t n; /** Bytes read into `buf` */
+	int len; /** Bytes of reply in `out` */
+	size_t klen; /** Length of the cache key in `key`, 0 if not cached */
+	char buf[4096]; /** The message */
+	char out[4096]; /** The reply */
+	char key[4096]; /** The cache key */
+} msg_t;
+
+/**
+ * Reads a message from its socket and records it. A binary frame says
+ * how long it is, so reading goes on until all of it is in; JSON is read
+ * once.
+ * @param m The message, with `fd` set
+ * @return Returns the number of bytes read, 0 or less if there is nothing
+ *   to reply to
+ */
+ssize_t msg_read(msg_t *m)
+{
+	ssize_t r;
+
+	m->len = 0;
+	m->klen = 0;
+
+	memset(m->buf, 0, sizeof(m->buf));
+	m->n = read(m->fd, m->buf, sizeof(m->buf)-1);
+
+	if (wire_is_frame(m->buf, m->n > 0 ? m->n : 0)) {
+		while ((size_t)m->n < wire_frame_len(m->buf, m->n) &&
+		       (size_t)m->n < sizeof(m->buf)-1) {
+			r = read(m->fd, m->buf + m->n, sizeof(m->buf)-1 - m->n);
+			if (r <= 0)
+				break;
+			m->n += r;
+		}
+
+		LOG(LOG_LEVEL_INFO, "Read %zd bytes: binary frame\n", m->n);
+	} else {
+		/* Process buffer contents here */
+		LOG(LOG_LEVEL_INFO, "Read %zd bytes: %s\n", m->n, m->buf);
+	}
+
+	if (m->n > 0)
+		capture_record(m->buf, m->n, m->arrived);
+
+	/* Binary frames skip the cache, its keys are built from JSON */
+	if (m->n > 0 && cache && !wire_is_frame(m->buf, m->n))
+		m->klen = cache_key_json(m->buf, m->n, m->key, sizeof(m->key));
+
+	return m->n;
+}
+
+/**
+ * Computes the reply to a message that was read, unless the cache has
+ * it or another copy of it is already being computed
+ * @param m The message
+ * @return Returns 0 if the reply is in `out`, or 1 if the cache took the
+ *   socket over and replies on its own
+ */
+int msg_route(msg_t *m)
+{
+	size_t vlen;
+	int err;
+
+	if (m->klen > 0) {
+		switch (cache_get(cache, m->key, m->klen, m->out, sizeof(m->out),
+		                  &vlen, reply_cached, (void *)(intptr_t)m->fd)) {
+		case CACHE_HIT:
+			reply_cached(m->out, vlen, (void *)(intptr_t)m->fd);
+			return 1;
+		case CACHE_PENDING:
+			/* reply_cached() answers once the first copy is done */
+			return 1;
+		case CACHE_MISS:
+			break;
+		default:
+			m->klen = 0;
+			break;
+		}
+	}
+
+	if (procpool)
+		m->len = procpool_call(procpool, route_id, m->buf, m->n, m->out,
+			sizeof(m->out));
+	else
+		m->len = route_msg(m->buf, m->n, m->out, sizeof(m->out));
+	if (m->len >= 0) {
+		if (m->klen > 0)
+			cache_put(cache, m->key, m->klen, m->out, m->len);
+		return 0;
+	}
+
+	/* Failures may be transient, e.g. a crashed worker process, so they
+	 * are not cached; the waiters are told to try again */
+	err = poolerrno;
+	if (m->klen > 0)
+		cache_abort(cache, m->key, m->klen);
+	if (wire_is_frame(m->buf, m->n))
+		m->len = wire_error(m->buf, m->n, m->out, sizeof(m->out), err);
+	else
+		m->len = snprintf(m->out, sizeof(m->out), "{\"error\":\"%s\"}",
+			poolerrno_str(err));
+
+	return 0;
+}
+
+/**
+ * Writes the reply, if any, and closes the socket
+ * @param m The message
+ */
+void msg_reply(msg_t *m)
+{
+	if (m->len > 0 && write(m->fd, m->out, m->len) < 0)
+		LOG(LOG_LEVEL_WARN, "write() failed: %s\n", strerror(errno));
+
+	close(m->fd);
+}
+
 /**
  * Processes a received socket message
- * @param arg The buffer containing the received socket message.
- *   This should cast to a `const char *` type.
+ * @param arg Pointer to the inline `conn_t` copy
  */
 void process_msg(void *arg)
 {
-	int fd;
-	char buf[4096];
-	ssize_t n;
+	conn_t conn;
+	msg_t m;
 
 	if (arg == NULL)
 		return;
 
-	fd = *(int *)arg;
+	memcpy(&conn, arg, sizeof(conn));
+	m.fd = conn.fd;
+	m.arrived = conn.arrived;
+
+	if (msg_read(&m) > 0 && msg_route(&m) != 0)
+		return;
 
-	memset(buf, 0, sizeof(buf));
-	n = read(fd, buf, sizeof(buf)-1);
+	msg_reply(&m);
+}
 
-	/* Process buffer contents here */
-	printf("Read %zd bytes: %s\n", n, buf);
+/**
+ * Pipeline stage 0: reads the message
+ * @param item The `msg_t`, with `fd` and `arrived` set
+ * @param ctx Unused
+ * @return Returns the message, or NULL if there is nothing to reply to
+ */
+void *stage_read(void *item, void *ctx)
+{
+	msg_t *m = (msg_t *)item;
 
-	close(fd);
+	(void)ctx;
+
+	if (msg_read(m) > 0)
+		return m;
+
+	msg_reply(m);
+	free(m);
+	return NULL;
+}
+
+/**
+ * Pipeline stage 1: routes the message to its handler
+ * @param item The `msg_t`
+ * @param ctx Unused
+ * @return Returns the message, or NULL if the cache replies instead
+ */
+void *stage_route(void *item, void *ctx)
+{
+	msg_t *m = (msg_t *)item;
+
+	(void)ctx;
+
+	if (msg_route(m) == 0)
+		return m;
+
+	free(m);
+	return NULL;
+}
+
+/**
+ * Pipeline stage 2: writes the reply
+ * @param item The `msg_t`
+ * @param ctx Unused
+ * @return Always returns NULL
+ */
+void *stage_reply(void *item, void *ctx)
+{
+	(void)ctx;
+
+	msg_reply((msg_t *)item);
+	free(item);
+	return NULL;
+}
+
+/**
+ * Builds the -M pipeline. Routing is the CPU-heavy stage and gets the
+ * worker threads; reading and replying get a quarter as many each.
+ * @return Returns the started pipeline, or NULL with `poolerrno` set
+ */
+pipeline_t *pipeline_setup(void)
+{
+	size_t io = nthreads / 4 > 0 ? nthreads / 4 : 1;
+	pipeline_t *p;
+
+	if ((p = pipeline_new(capacity / nthreads > 0 ?
+	                      capacity / nthreads : 1)) == NULL)
+		return NULL;
+
+	if (pipeline_add_stage(p, stage_read, NULL, io) < 0 ||
+	    pipeline_add_stage(p, stage_route, NULL, nthreads) < 0 ||
+	    pipeline_add_stage(p, stage_reply, NULL, io) < 0 ||
+	    pipeline_start(p) < 0) {
+		pipeline_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+/**
+ * Logs each pipeline stage's counters, to show which one is the
+ * bottleneck
+ * @param p The pipeline
+ */
+void pipeline_report(pipeline_t *p)
+{
+	static const char *names[] = { "read", "route", "reply" };
+	pipeline_stats_t st;
+
+	for (size_t i = 0; i < pipeline_stage_count(p); i++) {
+		if (pipeline_get_stats(p, (int)i, &st) < 0)
+			continue;
+		LOG(LOG_LEVEL_INFO, "Stage %s: threads=%zu depth=%zu processed=%llu "
+			"stalls=%llu\n", names[i], st.nthreads, st.depth,
+			(unsigned long long)st.nprocessed,
+			(unsigned long long)st.nstalls);
+	}
+}
+
+/**
+ * Called instead of `process_msg()` when a connection waited in the queue
+ * past its deadline. Nobody is going to read the answer, so just hang up.
+ * @param arg Pointer to the inline `conn_t` copy
+ */
+void drop_msg(void *arg)
+{
+	conn_t conn;
+
+	memcpy(&conn, arg, sizeof(conn));
+
+	LOG(LOG_LEVEL_INFO, "Dropped cfd=%d, deadline passed\n", conn.fd);
+
+	close(conn.fd);
 }
 
 /**
@@ -128,6 +687,157 @@ void sigint_handler(int signo)
 	keep_going = 0;
 }
 
+/**
+ * Hands an accepted connection to a pool
+ * @param pool The pool to run `process_msg()` on
+ * @param cfd The connected socket. Closed here if it cannot be queued.
+ * @param ca The peer address
+ * @param ctx A `fair_t` in front of `pool` to queue the connection on, by
+ *   peer address, or NULL to queue it on the pool directly
+ */
+void dispatch_conn(pool_t *pool, int cfd, const struct sockaddr_in *ca,
+	void *ctx)
+{
+	pool_task_opts_t opts;
+	fair_t *fair = (fair_t *)ctx;
+	conn_t conn;
+
+	/* Stamped here rather than at the read, so a capture records when
+	 * the connection arrived and not when a worker got to it */
+	conn.fd = cfd;
+	conn.arrived = capture_now();
+
+	/* Skip the address formatting too unless it will be logged */
+	if (atomic_load_explicit(&log_level, memory_order_relaxed) >= LOG_LEVEL_INFO) {
+		char buf[INET_ADDRSTRLEN];
+		memset(buf, 0, sizeof(buf));
+		inet_ntop(ca->sin_family, &ca->sin_addr, buf, sizeof(buf));
+		LOG(LOG_LEVEL_INFO, "Received connection from %s (cfd=%d)\n", buf, cfd);
+	}
+
+	memset(&opts, 0, sizeof(opts));
+	if (deadline_ms) {
+		opts.deadline = pool_now() + (uint64_t)deadline_ms * 1000000;
+		opts.cancel = drop_msg;
+	}
+
+	if (fair != NULL) {
+		if (fair_enqueue_inline(fair, ntohl(ca->sin_addr.s_addr),
+		                        process_msg, &conn, sizeof(conn), &opts) < 0) {
+			LOG(LOG_LEVEL_WARN, "fair_enqueue_inline() failed: %s\n",
+				poolerrno_str(poolerrno));
+			close(cfd);
+		}
+		return;
+	}
+
+	/* Copy the descriptor into the queue slot. Passing `&conn` would
+	 * race with the next accept() overwriting it */
+	if (pool_enqueue_inline_opts(pool, process_msg, &conn, sizeof(conn),
+	                             &opts) < 0) {
+		LOG(LOG_LEVEL_WARN, "pool_enqueue_inline_opts() failed: %s\n",
+			poolerrno_str(poolerrno));
+		close(cfd);
+	}
+}
+
+/**
+ * Installs `sigint_handler()` for SIGINT, SIGHUP and SIGTERM, unless the
+ * signal is ignored
+ */
+void install_signals(void)
+{
+	struct sigaction action_new;
+	struct sigaction action_old;
+
+	action_new.sa_handler = sigint_handler;
+	sigemptyset(&action_new.sa_mask);
+	action_new.sa_flags = 0;
+
+	sigaction(SIGINT, NULL, &action_old);
+	if (action_old.sa_handler != SIG_IGN)
+		sigaction(SIGINT, &action_new, NULL);
+	sigaction(SIGHUP, NULL, &action_old);
+	if (action_old.sa_handler != SIG_IGN)
+		sigaction(SIGHUP, &action_new, NULL);
+	sigaction(SIGTERM, NULL, &action_old);
+	if (action_old.sa_handler != SIG_IGN)
+		sigaction (SIGTERM, &action_new, NULL);	
+}
+
+/**
+ * Serves with `nshards` SO_REUSEPORT shards until a signal arrives. The
+ * main thread only waits; every shard accepts and runs its own
+ * connections.
+ * @return Returns 0 on success, else error
+ */
+int serve_sharded(void)
+{
+	shard_set_t *set;
+	admin_t **admins;
+	sigset_t mask;
+	sigset_t old;
+	int ret = 0;
+
+	install_signals();
+
+	/* Held until sigsuspend(), so a signal cannot slip in before it */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+	set = shard_start(nshards, port, nthreads, capacity, dispatch_conn, NULL);
+	if (set == NULL) {
+		LOG(LOG_LEVEL_ERROR, "shard_start() failed: %s\n", poolerrno_str(poolerrno));
+		return 1;
+	}
+
+	admins = (admin_t **)calloc(shard_count(set), sizeof(*admins));
+	if (admins == NULL) {
+		shard_stop(set);
+		return 1;
+	}
+
+	for (size_t i = 0; i < shard_count(set); i++) {
+		pool_t *pool = shard_pool(set, i);
+
+		if ((latency_target_us &&
+		     pool_set_admission(pool, latency_target_us,
+		                        ADMISSION_INTERVAL_US) < 0) ||
+		    (watchdog_ms &&
+		     pool_set_watchdog(pool, watchdog_ms, POOL_WATCHDOG_REPLACE) < 0)) {
+			LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+			ret = 1;
+			break;
+		}
+
+		/* Shard i is administered on the admin port plus i */
+		if (admin_port &&
+		    (admins[i] = admin_start(pool, admin_port + i)) == NULL) {
+			LOG(LOG_LEVEL_ERROR, "admin_start() failed: %s\n",
+				poolerrno_str(poolerrno));
+			ret = 1;
+			break;
+		}
+	}
+
+	if (ret == 0) {
+		LOG(LOG_LEVEL_INFO, "Listening on port %u with %zu shards\n", port,
+			shard_count(set));
+		sigsuspend(&old);
+	}
+
+	for (size_t i = 0; i < shard_count(set); i++)
+		admin_stop(admins[i]);
+	free(admins);
+
+	shard_stop(set);
+
+	return ret;
+}
+
 /**
  * Main program entry point
  * @param argc The count of command-line arguments
@@ -139,32 +849,138 @@ int main(int argc, char **argv)
 	int sfd;
 	int cfd;
 	pool_t *pool;
+	fair_t *fair = NULL;
+	admin_t *admin = NULL;
+	int ret;
 	struct sockaddr_in sa;
 	struct sockaddr_in ca;
 	socklen_t salen;
 	socklen_t calen;
-	struct sigaction action_new;
-	struct sigaction action_old;
+	msg_t *m;
 
 	argparser(argc, argv);
 
+	if (sharded && pipelined) {
+		printf("ERROR: --pipeline cannot be combined with --shards\n");
+		return 1;
+	}
+
+	if (pipelined && nthreads <= 0) {
+		printf("ERROR: --pipeline needs at least one thread\n");
+		return 1;
+	}
+
+	if (fair_mode && (sharded || pipelined)) {
+		printf("ERROR: --fair cannot be combined with --shards or --pipeline\n");
+		return 1;
+	}
+
+	if (replay_path) {
+		if (capture_replay(replay_path, port, replay_speed, nthreads,
+		                   stdout) < 0) {
+			printf("ERROR: %s: %s\n", replay_path, poolerrno_str(poolerrno));
+			return 1;
+		}
+		return 0;
+	}
+
 	if (verbose) {
 		int pad = -1 * (int)strlen("Number of threads");
 		printf("%*s: %u\n", pad, "Port", port);
 		printf("%*s: %u\n", pad, "Number of threads", nthreads);
 		printf("%*s: %u\n", pad, "Queue capacity", capacity);
 		printf("%*s: %s\n", pad, "Verbose", verbose ? "yes" : "no");
+		if (admin_port)
+			printf("%*s: %u\n", pad, "Admin port", admin_port);
+	}
+
+	if (trace_path)
+		trace_set_enabled(1);
+
+	log_set_level(verbose ? LOG_LEVEL_INFO : LOG_LEVEL_WARN);
+	if (log_start(STDOUT_FILENO) < 0) {
+		printf("ERROR: log_start() failed: %s\n", poolerrno_str(poolerrno));
+		return 1;
+	}
+
+	if (capture_path && capture_start(capture_path) < 0) {
+		LOG(LOG_LEVEL_ERROR, "%s: %s\n", capture_path, poolerrno_str(poolerrno));
+		return 1;
+	}
+
+	if (router_setup() < 0) {
+		LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+		return 1;
+	}
+
+	/* Fork the worker processes before any pool threads exist */
+	if (nprocs &&
+	    ((procpool = procpool_new(nprocs, capacity < PROCPOOL_MAX_CAPACITY ?
+	                             capacity : PROCPOOL_MAX_CAPACITY)) == NULL ||
+	     (route_id = procpool_register(procpool, route_msg)) < 0 ||
+	     procpool_start(procpool) < 0)) {
+		LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+		procpool_free(procpool);
+		router_free(router);
+		return 1;
+	}
+
+	if (cache_kb &&
+	    (cache = cache_new(cache_kb * 1024 / CACHE_ENTRY_SIZE + CACHE_SHARDS,
+	                       cache_kb * 1024,
+	                       (uint64_t)cache_ttl_ms * 1000000)) == NULL) {
+		LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+		router_free(router);
+		return 1;
+	}
+
+	if (sharded) {
+		ret = serve_sharded();
+		procpool_free(procpool);
+		capture_stop();
+		cache_free(cache);
+		router_free(router);
+		if (trace_path && trace_write(trace_path) < 0)
+			LOG(LOG_LEVEL_ERROR, "Could not write trace: %s\n",
+				poolerrno_str(poolerrno));
+		return ret;
 	}
 
 	pool = pool_init(nthreads, capacity);
 	if (pool == NULL) {
-		printf("ERROR: %s\n", poolerrno_str(poolerrno));
+		LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+		return 1;
+	}
+
+	if ((latency_target_us &&
+	     pool_set_admission(pool, latency_target_us, ADMISSION_INTERVAL_US) < 0) ||
+	    (watchdog_ms &&
+	     pool_set_watchdog(pool, watchdog_ms, POOL_WATCHDOG_REPLACE) < 0)) {
+		LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+		pool_free(pool);
+		return 1;
+	}
+
+	if (fair_mode &&
+	    (fair = fair_new(pool, FAIR_FLOWS, fair_flow_capacity,
+	                     FAIR_QUANTUM_US)) == NULL) {
+		LOG(LOG_LEVEL_ERROR, "%s\n", poolerrno_str(poolerrno));
+		pool_free(pool);
+		return 1;
+	}
+
+	if (admin_port && (admin = admin_start(pool, admin_port)) == NULL) {
+		LOG(LOG_LEVEL_ERROR, "admin_start() failed: %s\n", poolerrno_str(poolerrno));
+		pool_free(pool);
+		fair_free(fair);
 		return 1;
 	}
 
 	if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		printf("ERROR: socket() failed: %s\n", strerror(errno));
+		LOG(LOG_LEVEL_ERROR, "socket() failed: %s\n", strerror(errno));
+		admin_stop(admin);
 		pool_free(pool);
+		fair_free(fair);
 		return 1;
 	}
 
@@ -177,66 +993,90 @@ int main(int argc, char **argv)
 
 	/* Bind the socket to a port and address */
 	if (bind(sfd, (struct sockaddr *) &sa, salen) < 0) {
-		printf("ERROR: bind() failed: %s\n", strerror(errno));
+		LOG(LOG_LEVEL_ERROR, "bind() failed: %s\n", strerror(errno));
 		close(sfd);
+		admin_stop(admin);
 		pool_free(pool);
+		fair_free(fair);
 		return 1;
 	}
 
 	/* Mark socket for listening. See man listen(2) for details */
 	if (listen(sfd, 128) < 0) {
-		printf("ERROR: listen() failed: %s\n", strerror(errno));
+		LOG(LOG_LEVEL_ERROR, "listen() failed: %s\n", strerror(errno));
 		close(sfd);
+		admin_stop(admin);
 		pool_free(pool);
+		fair_free(fair);
 		return 1;
 	}
 
-	action_new.sa_handler = sigint_handler;
-	sigemptyset(&action_new.sa_mask);
-	action_new.sa_flags = 0;
+	if (pipelined && (pipe_srv = pipeline_setup()) == NULL) {
+		LOG(LOG_LEVEL_ERROR, "pipeline_setup() failed: %s\n",
+			poolerrno_str(poolerrno));
+		close(sfd);
+		admin_stop(admin);
+		pool_free(pool);
+		fair_free(fair);
+		return 1;
+	}
 
-	sigaction(SIGINT, NULL, &action_old);
-	if (action_old.sa_handler != SIG_IGN)
-		sigaction(SIGINT, &action_new, NULL);
-	sigaction(SIGHUP, NULL, &action_old);
-	if (action_old.sa_handler != SIG_IGN)
-		sigaction(SIGHUP, &action_new, NULL);
-	sigaction(SIGTERM, NULL, &action_old);
-	if (action_old.sa_handler != SIG_IGN)
-		sigaction (SIGTERM, &action_new, NULL);	
+	install_signals();
 
 	keep_going = 1;
 
 	while (keep_going) {
 		calen = sizeof(ca);
 
-		if (verbose)
-			printf("Listening on port %u\n", port);
+		LOG(LOG_LEVEL_DEBUG, "Listening on port %u\n", port);
 
 		if ((cfd = accept(sfd, (struct sockaddr *) &ca, &calen)) < 0) {
 			if (errno != EINTR)
-				printf("ERROR: accept() failed: %s\n", strerror(errno));
+				LOG(LOG_LEVEL_ERROR, "accept() failed: %s\n", strerror(errno));
 			break;
 		}
 
-		if (verbose) {
-			char buf[INET_ADDRSTRLEN];
-			memset(buf, 0, sizeof(buf));
-			inet_ntop(ca.sin_family, &ca.sin_addr, buf, sizeof(buf));
-			printf("Received connection from %s (cfd=%d)\n", buf, cfd);
+		if (pipe_srv == NULL) {
+			dispatch_conn(pool, cfd, &ca, fair);
+			continue;
 		}
 
-		if (pool_enqueue(pool, process_msg, &cfd) < 0) {
-			printf("WARN: pool_enqueue() failed: %s\n",
+		/* Blocks while the pipeline is backed up, which holds the
+		 * remaining connections in the listen backlog */
+		if ((m = (msg_t *)malloc(sizeof(*m))) == NULL ||
+		    (m->fd = cfd, m->arrived = capture_now(),
+		     pipeline_push(pipe_srv, m)) < 0) {
+			LOG(LOG_LEVEL_WARN, "pipeline_push() failed: %s\n",
 				poolerrno_str(poolerrno));
+			free(m);
 			close(cfd);
 		}
 	}
 
 	close(sfd);
 
+	if (pipe_srv) {
+		pipeline_report(pipe_srv);
+		pipeline_free(pipe_srv);
+	}
+
+	admin_stop(admin);
+
 	pool_free(pool);
 
+	fair_free(fair);
+
+	procpool_free(procpool);
+
+	capture_stop();
+
+	cache_free(cache);
+
+	router_free(router);
+
+	if (trace_path && trace_write(trace_path) < 0)
+		LOG(LOG_LEVEL_ERROR, "Could not write trace: %s\n", poolerrno_str(poolerrno));
+
 	return 0;
 }
 
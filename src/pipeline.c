@@ -0,0 +1,824 @@
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np() */
+#include "pipeline.h"
+#include "pool.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+/** How long a sleeping thread waits before rechecking on its own, in ms */
+#define PIPELINE_SLEEP_MS 10
+
+/**
+ * A thread that may sleep until a ring it watches changes. The sleeper
+ * raises `sleeping` before its last check, and the other side only takes
+ * the mutex to signal when it sees the flag, so a busy pipeline never
+ * touches it.
+ */
+typedef struct {
+	pthread_mutex_t mtx; /** Held from the last check until the wait */
+	pthread_cond_t cnd; /** Signalled by `waiter_wake()` */
+	atomic_int sleeping; /** Non-zero while the owner may be waiting */
+} waiter_t;
+
+/**
+ * A bounded single-producer/single-consumer ring. Each index lives on its
+ * own cache line next to the other side's last value seen, so the two
+ * threads only share a line when the cached value runs out.
+ */
+typedef struct {
+	_Alignas(64) atomic_size_t head; /** Next slot to take, consumer side */
+	size_t tail_seen; /** Consumer's last read of `tail` */
+	_Alignas(64) atomic_size_t tail; /** Next slot to fill, producer side */
+	size_t head_seen; /** Producer's last read of `head` */
+	_Alignas(64) size_t mask; /** Number of slots minus one */
+	void **slots; /** The items */
+	waiter_t *producer; /** Woken when the consumer frees a slot */
+	waiter_t *consumer; /** Woken when the producer fills a slot */
+} ring_t;
+
+typedef struct stage stage_t;
+
+/**
+ * A stage worker. It owns one input ring per upstream worker and one
+ * output ring per downstream worker.
+ */
+typedef struct {
+	pipeline_t *p; /** The pipeline */
+	stage_t *stage; /** The stage this worker belongs to */
+	pthread_t thread; /** The worker's thread */
+	waiter_t wait; /** Where the worker sleeps when idle or blocked */
+	ring_t **in; /** Input rings */
+	size_t nin; /** Number of input rings */
+	size_t next_in; /** Input ring to poll first */
+	ring_t **out; /** Output rings, none for the last stage */
+	size_t nout; /** Number of output rings */
+	size_t next_out; /** Output ring to try first */
+	atomic_uint_least64_t nprocessed; /** Written by this worker only */
+	atomic_uint_least64_t nconsumed; /** Written by this worker only */
+	atomic_uint_least64_t nstalls; /** Written by this worker only */
+	int started; /** Non-zero once the thread was created */
+} worker_t;
+
+/**
+ * A stage
+ */
+struct stage {
+	pipeline_fn_t fn; /** The stage function */
+	void *ctx; /** Passed to `fn` */
+	size_t index; /** Position in the pipeline */
+	size_t nthreads; /** Number of workers */
+	size_t cpu_first; /** First CPU the workers are pinned to */
+	size_t cpu_count; /** Number of CPUs the workers are pinned to, 0 for any */
+	worker_t *workers; /** The workers */
+	atomic_size_t nalive; /** Workers that have not exited yet */
+};
+
+/**
+ * The pipeline struct
+ */
+struct pipeline {
+	size_t ring_size; /** Slots per ring */
+	stage_t stages[PIPELINE_MAX_STAGES]; /** The stages */
+	size_t nstages; /** Number of stages */
+	ring_t *rings; /** Every ring, stage by stage */
+	void **slots; /** Slot storage for every ring */
+	int started; /** Non-zero after `pipeline_start()` */
+	pthread_mutex_t push_mtx; /** Makes the pushers one producer */
+	waiter_t push_wait; /** Where pushers sleep while stage 0 is full */
+	ring_t **push_out; /** Stage 0 input rings */
+	size_t push_next; /** Stage 0 ring to try first */
+	atomic_int closing; /** Set by `pipeline_free()` */
+};
+
+static void waiter_init(waiter_t *w);
+static void waiter_destroy(waiter_t *w);
+static void waiter_wake(waiter_t *w);
+static void waiter_sleep(waiter_t *w, int (*ready)(void *), void *arg);
+static int ring_push(ring_t *r, void *item);
+static int ring_pop(ring_t *r, void **item);
+static size_t ring_count(ring_t *r);
+static int ring_send(ring_t **rings, size_t n, size_t *next, void *item);
+static int rings_have_room(void *arg);
+static int worker_has_input(void *arg);
+static int worker_has_room(void *arg);
+static void worker_emit(worker_t *w, void *item);
+static void *worker_loop(void *arg);
+
+/**
+ * Creates an empty pipeline. Add stages with `pipeline_add_stage()`, then
+ * call `pipeline_start()`.
+ * @param ring_size Slots in each ring between two workers. Rounded up to a
+ *   power of two.
+ * @return Returns a `pipeline_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+pipeline_t *pipeline_new(size_t ring_size)
+{
+	pipeline_t *p;
+	size_t n;
+
+	if (ring_size == 0 || ring_size > DEFAULT_QUEUE_CAPACITY) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	p = (pipeline_t *)calloc(1, sizeof(*p));
+	if (p == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	for (n = 1; n < ring_size; n <<= 1)
+		;
+	p->ring_size = n;
+
+	pthread_mutex_init(&p->push_mtx, NULL);
+	waiter_init(&p->push_wait);
+	atomic_init(&p->closing, 0);
+
+	return p;
+}
+
+/**
+ * Stops accepting items, waits for every item already pushed to pass
+ * through all stages, and frees the pipeline. Each stage exits once the
+ * stage before it has exited and its input is empty.
+ * @param p The pipeline, or NULL
+ */
+void pipeline_free(pipeline_t *p)
+{
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->push_mtx);
+	atomic_store(&p->closing, 1);
+	pthread_mutex_unlock(&p->push_mtx);
+
+	for (size_t s = 0; s < p->nstages; s++) {
+		stage_t *stage = &p->stages[s];
+
+		if (stage->workers == NULL)
+			continue;
+		for (size_t i = 0; i < stage->nthreads; i++) {
+			if (s == 0 && stage->workers[i].started)
+				waiter_wake(&stage->workers[i].wait);
+		}
+		for (size_t i = 0; i < stage->nthreads; i++) {
+			if (stage->workers[i].started)
+				pthread_join(stage->workers[i].thread, NULL);
+		}
+	}
+
+	for (size_t s = 0; s < p->nstages; s++) {
+		stage_t *stage = &p->stages[s];
+
+		if (stage->workers == NULL)
+			continue;
+		for (size_t i = 0; i < stage->nthreads; i++)
+			waiter_destroy(&stage->workers[i].wait);
+		free(stage->workers[0].in);
+		free(stage->workers[0].out);
+		free(stage->workers);
+	}
+
+	waiter_destroy(&p->push_wait);
+	pthread_mutex_destroy(&p->push_mtx);
+	free(p->push_out);
+	free(p->rings);
+	free(p->slots);
+	free(p);
+}
+
+/**
+ * Appends a stage. Must be called before `pipeline_start()`.
+ * @param p The pipeline
+ * @param fn The stage function
+ * @param ctx Passed to `fn`
+ * @param nthreads Number of workers running `fn`
+ * @return Returns the index of the stage on success. On error, less than
+ *   0 is returned and `poolerrno` is set.
+ */
+int pipeline_add_stage(pipeline_t *p, pipeline_fn_t fn, void *ctx,
+	size_t nthreads)
+{
+	stage_t *stage;
+
+	if (p == NULL || fn == NULL || nthreads == 0 ||
+	    nthreads > PIPELINE_MAX_THREADS) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (p->started || p->nstages >= PIPELINE_MAX_STAGES) {
+		poolerrno = EBUSY;
+		return -1;
+	}
+
+	stage = &p->stages[p->nstages];
+	stage->fn = fn;
+	stage->ctx = ctx;
+	stage->index = p->nstages;
+	stage->nthreads = nthreads;
+
+	return (int)p->nstages++;
+}
+
+/**
+ * Pins a stage's workers to a range of CPUs, so each stage keeps its
+ * working set in its own cores' caches. Must be called before
+ * `pipeline_start()`.
+ * @param p The pipeline
+ * @param stage The stage index
+ * @param first First CPU
+ * @param count Number of CPUs, or 0 to stop pinning
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pipeline_set_affinity(pipeline_t *p, int stage, size_t first,
+	size_t count)
+{
+	if (p == NULL || stage < 0 || (size_t)stage >= p->nstages ||
+	    first + count > CPU_SETSIZE) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (p->started) {
+		poolerrno = EBUSY;
+		return -1;
+	}
+
+	p->stages[stage].cpu_first = first;
+	p->stages[stage].cpu_count = count;
+
+	return 0;
+}
+
+/**
+ * Connects the stages and starts their workers. Stage 0 gets one ring per
+ * worker, fed by `pipeline_push()`; every later stage gets one ring per
+ * pair of upstream and downstream workers, so each ring has exactly one
+ * producer and one consumer.
+ * @param p The pipeline
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set; the pipeline must then be freed.
+ */
+int pipeline_start(pipeline_t *p)
+{
+	size_t nrings;
+	size_t r = 0;
+	int rc;
+
+	if (p == NULL || p->nstages == 0) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (p->started) {
+		poolerrno = EBUSY;
+		return -1;
+	}
+	p->started = 1;
+
+	nrings = p->stages[0].nthreads;
+	for (size_t s = 1; s < p->nstages; s++)
+		nrings += p->stages[s - 1].nthreads * p->stages[s].nthreads;
+
+	p->rings = (ring_t *)aligned_alloc(64, nrings * sizeof(*p->rings));
+	p->slots = (void **)malloc(nrings * p->ring_size * sizeof(*p->slots));
+	p->push_out = (ring_t **)malloc(p->stages[0].nthreads *
+		sizeof(*p->push_out));
+	if (p->rings == NULL || p->slots == NULL || p->push_out == NULL) {
+		poolerrno = ENOMEM;
+		return -1;
+	}
+
+	/* Workers, with their ring pointer arrays in one block per stage */
+	for (size_t s = 0; s < p->nstages; s++) {
+		stage_t *stage = &p->stages[s];
+		size_t nin = s == 0 ? 1 : p->stages[s - 1].nthreads;
+		size_t nout = s + 1 < p->nstages ? p->stages[s + 1].nthreads : 0;
+		ring_t **in, **out;
+
+		stage->workers = (worker_t *)calloc(stage->nthreads,
+			sizeof(*stage->workers));
+		if (stage->workers == NULL) {
+			poolerrno = ENOMEM;
+			return -1;
+		}
+
+		in = (ring_t **)calloc(stage->nthreads * nin, sizeof(*in));
+		out = (ring_t **)calloc(stage->nthreads * (nout ? nout : 1),
+			sizeof(*out));
+		if (in == NULL || out == NULL) {
+			free(in);
+			free(out);
+			free(stage->workers);
+			stage->workers = NULL;
+			poolerrno = ENOMEM;
+			return -1;
+		}
+
+		for (size_t i = 0; i < stage->nthreads; i++) {
+			worker_t *w = &stage->workers[i];
+
+			w->p = p;
+			w->stage = stage;
+			w->in = in + i * nin;
+			w->nin = nin;
+			w->out = out + i * (nout ? nout : 1);
+			w->nout = nout;
+			waiter_init(&w->wait);
+			atomic_init(&w->nprocessed, 0);
+			atomic_init(&w->nconsumed, 0);
+			atomic_init(&w->nstalls, 0);
+		}
+		atomic_init(&stage->nalive, stage->nthreads);
+	}
+
+	/* Rings: pushers to stage 0, then every upstream/downstream pair */
+	for (size_t s = 0; s < p->nstages; s++) {
+		stage_t *down = &p->stages[s];
+		stage_t *up = s > 0 ? &p->stages[s - 1] : NULL;
+		size_t nup = up ? up->nthreads : 1;
+
+		for (size_t i = 0; i < nup; i++) {
+			for (size_t j = 0; j < down->nthreads; j++, r++) {
+				ring_t *ring = &p->rings[r];
+
+				atomic_init(&ring->head, 0);
+				atomic_init(&ring->tail, 0);
+				ring->tail_seen = 0;
+				ring->head_seen = 0;
+				ring->mask = p->ring_size - 1;
+				ring->slots = p->slots + r * p->ring_size;
+				ring->producer = up ? &up->workers[i].wait : &p->push_wait;
+				ring->consumer = &down->workers[j].wait;
+
+				down->workers[j].in[i] = ring;
+				if (up)
+					up->workers[i].out[j] = ring;
+				else
+					p->push_out[j] = ring;
+			}
+		}
+	}
+
+	for (size_t s = 0; s < p->nstages; s++) {
+		stage_t *stage = &p->stages[s];
+		pthread_attr_t attr;
+		cpu_set_t cpus;
+
+		pthread_attr_init(&attr);
+		if (stage->cpu_count > 0) {
+			CPU_ZERO(&cpus);
+			for (size_t c = stage->cpu_first;
+			     c < stage->cpu_first + stage->cpu_count; c++)
+				CPU_SET(c, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+
+		for (size_t i = 0; i < stage->nthreads; i++) {
+			worker_t *w = &stage->workers[i];
+
+			rc = pthread_create(&w->thread, &attr, worker_loop, w);
+			if (rc != 0) {
+				pthread_attr_destroy(&attr);
+				/* Workers that never ran count as exited */
+				atomic_fetch_sub(&stage->nalive, stage->nthreads - i);
+				for (size_t t = s + 1; t < p->nstages; t++)
+					atomic_store(&p->stages[t].nalive, 0);
+				poolerrno = rc;
+				return -1;
+			}
+			w->started = 1;
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	return 0;
+}
+
+/**
+ * Pushes an item into the first stage, waiting while its input rings are
+ * full. This is where backpressure from a slow stage reaches the caller.
+ * Safe to call from several threads at once.
+ * @param p The pipeline
+ * @param item The item
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pipeline_push(pipeline_t *p, void *item)
+{
+	if (p == NULL || !p->started) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->push_mtx);
+
+	while (!atomic_load(&p->closing) &&
+	       ring_send(p->push_out, p->stages[0].nthreads, &p->push_next,
+	                 item) < 0)
+		waiter_sleep(&p->push_wait, rings_have_room, p);
+
+	if (atomic_load(&p->closing)) {
+		pthread_mutex_unlock(&p->push_mtx);
+		poolerrno = EPIPE;
+		return -1;
+	}
+
+	pthread_mutex_unlock(&p->push_mtx);
+
+	return 0;
+}
+
+/**
+ * Pushes an item into the first stage unless its input rings are full
+ * @param p The pipeline
+ * @param item The item
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set; `POOLERRNO_QUEUE_FULL` means the pipeline is
+ *   backed up.
+ */
+int pipeline_try_push(pipeline_t *p, void *item)
+{
+	int ret = 0;
+
+	if (p == NULL || !p->started) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->push_mtx);
+
+	if (atomic_load(&p->closing)) {
+		poolerrno = EPIPE;
+		ret = -1;
+	} else if (ring_send(p->push_out, p->stages[0].nthreads,
+	                     &p->push_next, item) < 0) {
+		poolerrno = POOLERRNO_QUEUE_FULL;
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&p->push_mtx);
+
+	return ret;
+}
+
+/**
+ * Returns the number of stages
+ * @param p The pipeline
+ * @return Returns the number of stages
+ */
+size_t pipeline_stage_count(const pipeline_t *p)
+{
+	return p->nstages;
+}
+
+/**
+ * Sums a stage's per-worker counters
+ * @param p The pipeline
+ * @param stage The stage index
+ * @param stats This variable is filled with the counters
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pipeline_get_stats(pipeline_t *p, int stage, pipeline_stats_t *stats)
+{
+	stage_t *st;
+
+	if (p == NULL || stats == NULL || stage < 0 ||
+	    (size_t)stage >= p->nstages) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	st = &p->stages[stage];
+
+	stats->nthreads = st->nthreads;
+	stats->depth = 0;
+	stats->nprocessed = 0;
+	stats->nconsumed = 0;
+	stats->nstalls = 0;
+
+	if (st->workers == NULL)
+		return 0;
+
+	for (size_t i = 0; i < st->nthreads; i++) {
+		worker_t *w = &st->workers[i];
+
+		for (size_t j = 0; j < w->nin; j++)
+			if (w->in[j] != NULL)
+				stats->depth += ring_count(w->in[j]);
+		stats->nprocessed += atomic_load_explicit(&w->nprocessed,
+			memory_order_relaxed);
+		stats->nconsumed += atomic_load_explicit(&w->nconsumed,
+			memory_order_relaxed);
+		stats->nstalls += atomic_load_explicit(&w->nstalls,
+			memory_order_relaxed);
+	}
+
+	return 0;
+}
+
+/**
+ * Initializes a waiter. Its condition variable waits on CLOCK_MONOTONIC.
+ * @param w The waiter
+ */
+static void waiter_init(waiter_t *w)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&w->mtx, NULL);
+	pthread_cond_init(&w->cnd, &attr);
+	pthread_condattr_destroy(&attr);
+	atomic_init(&w->sleeping, 0);
+}
+
+/**
+ * Destroys a waiter
+ * @param w The waiter
+ */
+static void waiter_destroy(waiter_t *w)
+{
+	pthread_cond_destroy(&w->cnd);
+	pthread_mutex_destroy(&w->mtx);
+}
+
+/**
+ * Wakes a waiter if it is asleep. The caller must have published the
+ * change the waiter is waiting for before calling this.
+ * @param w The waiter
+ */
+static void waiter_wake(waiter_t *w)
+{
+	/* Pairs with the fence in waiter_sleep(): either the sleeper sees
+	 * the change, or this sees `sleeping` */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&w->sleeping, memory_order_relaxed)) {
+		pthread_mutex_lock(&w->mtx);
+		pthread_cond_signal(&w->cnd);
+		pthread_mutex_unlock(&w->mtx);
+	}
+}
+
+/**
+ * Sleeps until woken, unless `ready(arg)` is already true. Wakes up on
+ * its own after `PIPELINE_SLEEP_MS` regardless, so callers loop.
+ * @param w The caller's own waiter
+ * @param ready Checks for the condition being waited for
+ * @param arg Passed to `ready`
+ */
+static void waiter_sleep(waiter_t *w, int (*ready)(void *), void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&w->mtx);
+	atomic_store_explicit(&w->sleeping, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!(*ready)(arg)) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += PIPELINE_SLEEP_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&w->cnd, &w->mtx, &ts);
+	}
+
+	atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/**
+ * Adds an item to a ring. Producer side only.
+ * @param r The ring
+ * @param item The item
+ * @return Returns 0 on success, or -1 if the ring is full
+ */
+static int ring_push(ring_t *r, void *item)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (tail - r->head_seen > r->mask) {
+		r->head_seen = atomic_load_explicit(&r->head,
+			memory_order_acquire);
+		if (tail - r->head_seen > r->mask)
+			return -1;
+	}
+
+	r->slots[tail & r->mask] = item;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	waiter_wake(r->consumer);
+
+	return 0;
+}
+
+/**
+ * Takes an item from a ring. Consumer side only.
+ * @param r The ring
+ * @param item This variable is set to the item
+ * @return Returns 0 on success, or -1 if the ring is empty
+ */
+static int ring_pop(ring_t *r, void **item)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head == r->tail_seen) {
+		r->tail_seen = atomic_load_explicit(&r->tail,
+			memory_order_acquire);
+		if (head == r->tail_seen)
+			return -1;
+	}
+
+	*item = r->slots[head & r->mask];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	waiter_wake(r->producer);
+
+	return 0;
+}
+
+/**
+ * Returns how many items a ring holds. Either side, or an observer.
+ * @param r The ring
+ * @return Returns the number of items
+ */
+static size_t ring_count(ring_t *r)
+{
+	return atomic_load_explicit(&r->tail, memory_order_acquire) -
+		atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+/**
+ * Pushes to the first ring with room, round robin
+ * @param rings The producer's output rings
+ * @param n Number of rings
+ * @param next Ring to try first; advanced past the one used
+ * @param item The item
+ * @return Returns 0 on success, or -1 if every ring is full
+ */
+static int ring_send(ring_t **rings, size_t n, size_t *next, void *item)
+{
+	for (size_t k = 0; k < n; k++) {
+		size_t i = (*next + k) % n;
+
+		if (ring_push(rings[i], item) == 0) {
+			*next = i + 1;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * `waiter_sleep()` check for the pushers
+ * @param arg The pipeline
+ * @return Returns non-zero if a stage 0 ring has room or the pipeline is
+ *   closing
+ */
+static int rings_have_room(void *arg)
+{
+	pipeline_t *p = (pipeline_t *)arg;
+
+	if (atomic_load(&p->closing))
+		return 1;
+
+	for (size_t i = 0; i < p->stages[0].nthreads; i++)
+		if (ring_count(p->push_out[i]) <= p->push_out[i]->mask)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * `waiter_sleep()` check for an idle worker
+ * @param arg The worker
+ * @return Returns non-zero if an input ring holds an item, or the stage
+ *   before has finished
+ */
+static int worker_has_input(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+	pipeline_t *p = w->p;
+	stage_t *stage = w->stage;
+
+	for (size_t i = 0; i < w->nin; i++)
+		if (ring_count(w->in[i]) > 0)
+			return 1;
+
+	if (stage->index == 0)
+		return atomic_load(&p->closing);
+
+	return atomic_load(&p->stages[stage->index - 1].nalive) == 0;
+}
+
+/**
+ * `waiter_sleep()` check for a worker blocked on its output
+ * @param arg The worker
+ * @return Returns non-zero if an output ring has room
+ */
+static int worker_has_room(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+
+	for (size_t i = 0; i < w->nout; i++)
+		if (ring_count(w->out[i]) <= w->out[i]->mask)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * Passes an item downstream, sleeping while every output ring is full
+ * @param w The worker
+ * @param item The item
+ */
+static void worker_emit(worker_t *w, void *item)
+{
+	if (ring_send(w->out, w->nout, &w->next_out, item) == 0)
+		return;
+
+	atomic_store_explicit(&w->nstalls,
+		atomic_load_explicit(&w->nstalls, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+
+	while (ring_send(w->out, w->nout, &w->next_out, item) < 0)
+		waiter_sleep(&w->wait, worker_has_room, w);
+}
+
+/**
+ * A stage worker. Takes items round robin from its input rings, runs the
+ * stage function on each and passes the result on. Exits once the stage
+ * before it (or, for stage 0, the pushers) is done and its input is empty.
+ * @param arg The worker
+ * @return Always returns NULL
+ */
+static void *worker_loop(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+	pipeline_t *p = w->p;
+	stage_t *stage = w->stage;
+	void *item;
+	void *out;
+	int done;
+	int got;
+
+	for (;;) {
+		/* Check upstream before the rings, so an empty pass after
+		 * seeing it finished really is the end */
+		if (stage->index == 0)
+			done = atomic_load(&p->closing);
+		else
+			done = atomic_load(&p->stages[stage->index - 1].nalive) == 0;
+
+		got = 0;
+		for (size_t k = 0; k < w->nin; k++) {
+			size_t i = (w->next_in + k) % w->nin;
+
+			if (ring_pop(w->in[i], &item) < 0)
+				continue;
+
+			w->next_in = i + 1;
+			got = 1;
+
+			out = (*stage->fn)(item, stage->ctx);
+			atomic_store_explicit(&w->nprocessed,
+				atomic_load_explicit(&w->nprocessed,
+					memory_order_relaxed) + 1,
+				memory_order_relaxed);
+
+			if (out == NULL) {
+				atomic_store_explicit(&w->nconsumed,
+					atomic_load_explicit(&w->nconsumed,
+						memory_order_relaxed) + 1,
+					memory_order_relaxed);
+			} else if (w->nout > 0) {
+				worker_emit(w, out);
+			}
+			break;
+		}
+
+		if (got)
+			continue;
+
+		if (done)
+			break;
+
+		waiter_sleep(&w->wait, worker_has_input, w);
+	}
+
+	/* Let the next stage notice, in case all of its workers sleep */
+	atomic_fetch_sub(&stage->nalive, 1);
+	for (size_t i = 0; i < w->nout; i++)
+		waiter_wake(w->out[i]->consumer);
+
+	return NULL;
+}
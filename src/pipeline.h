@@ -0,0 +1,67 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most stages in a pipeline */
+#define PIPELINE_MAX_STAGES  16
+
+/** Most worker threads in one stage */
+#define PIPELINE_MAX_THREADS 64
+
+/**
+ * A stage function, run on one of the stage's workers for every item
+ * that reaches the stage
+ * @param item The item from the previous stage, or from `pipeline_push()`
+ * @param ctx The `ctx` passed to `pipeline_add_stage()`
+ * @return Returns the item to pass to the next stage, or NULL if this
+ *   stage consumed it. The last stage's return value is ignored.
+ */
+typedef void *(*pipeline_fn_t)(void *item, void *ctx);
+
+/**
+ * Forward declaration of a pipeline. Stages run on their own threads and
+ * are connected by bounded single-producer/single-consumer rings, one per
+ * pair of neighbouring workers.
+ */
+typedef struct pipeline pipeline_t;
+
+/**
+ * A snapshot of one stage's counters, filled by `pipeline_get_stats()`.
+ * The stage with the deepest input and the busiest upstream stalls is the
+ * bottleneck.
+ */
+typedef struct {
+	size_t nthreads; /** Number of worker threads */
+	size_t depth; /** Items waiting in the stage's input rings */
+	uint64_t nprocessed; /** Items the stage function has run on */
+	uint64_t nconsumed; /** Items the stage function returned NULL for */
+	uint64_t nstalls; /** Times a worker found every output ring full */
+} pipeline_stats_t;
+
+/*--------------------*
+ * PIPELINE API CALLS *
+ *--------------------*/
+
+pipeline_t *pipeline_new(size_t ring_size);
+void pipeline_free(pipeline_t *p);
+int pipeline_add_stage(pipeline_t *p, pipeline_fn_t fn, void *ctx,
+	size_t nthreads);
+int pipeline_set_affinity(pipeline_t *p, int stage, size_t first,
+	size_t count);
+int pipeline_start(pipeline_t *p);
+int pipeline_push(pipeline_t *p, void *item);
+int pipeline_try_push(pipeline_t *p, void *item);
+size_t pipeline_stage_count(const pipeline_t *p);
+int pipeline_get_stats(pipeline_t *p, int stage, pipeline_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIPELINE_H_ */
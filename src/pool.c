@@ -1,22 +1,168 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
 #include "pool.h"
+#include "alloc.h"
+#include "trace.h"
+#include "log.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <string.h> /* strerror() */
 #include <errno.h> /* ESRCH, EINVAL, etc */
 #include <signal.h>
+#include <time.h> /* clock_gettime() */
+#include <stdatomic.h>
+#include <sched.h> /* cpu_set_t */
 
 int poolerrno = POOLERRNO_OK;
 
+/**
+ * Options of a queue item. Few items have a token or deadline, so those
+ * are kept out of line, allocated with `pool_task_alloc()`, and the slot
+ * only holds a pointer to them. A cancel callback alone fits in the slot.
+ */
+typedef struct {
+	void (*cancel)(void *arg); /** Called if the item is skipped, or NULL */
+	pool_token_t *token; /** Cancellation token holding a reference, or NULL */
+	uint64_t deadline; /** pool_now() time after which to skip, or 0 */
+} queue_opts_t;
+
+/** Queue item flags */
+#define ITEM_INLINE 0x1 /** The argument is in `data`, not `arg` */
+#define ITEM_TIMED  0x2 /** `enqueued` is set, admission control was on */
+#define ITEM_OPTS   0x4 /** `opts` is set, else `cancel` */
+#define ITEM_REQUEUED 0x8 /** Taken back from a stalled worker, see item_id() */
+
 /**
  * A queue item that will be handled by a worker thread. The worker thread
  * will pop one of these items off the queue, then call the `func`
  * method with the `arg` parameter.
+ *
+ * Items enqueued with `pool_enqueue_inline()` carry their argument in
+ * `data` instead, which shares its space with `arg`.
+ *
+ * Items enqueued with options may instead be skipped at dequeue, in which
+ * case the `cancel` option (if set) is called in place of `func`.
  */
 typedef struct {
 	void (*func)(void *arg); /** Function pointer */
-	void *arg; /** Argument passed to the `func` function pointer */
+	union {
+		queue_opts_t *opts; /** Options, with ITEM_OPTS */
+		void (*cancel)(void *arg); /** Cancel callback or NULL, without */
+	};
+	uint32_t enqueued; /** Enqueue time in us, wrapping, or ITEM_REQUEUED id */
+	uint32_t flags; /** ITEM_* flags */
+	union {
+		void *arg; /** Argument passed to the `func` function pointer */
+		unsigned char data[POOL_INLINE_ARG_SIZE]; /** Inline argument */
+	};
 } queue_item_t;
 
+_Static_assert(sizeof(queue_item_t) == 64, "queue_item_t is one cache line");
+
+/** Queue items per segment. A segment is 8 KiB */
+#define QUEUE_SEGMENT_ITEMS 128
+
+/** How often spare segments beyond recent need are released, in ms */
+#define QUEUE_TRIM_MS 1000
+
+/**
+ * A fixed-size piece of the queue. The queue is a list of segments that
+ * are allocated as it grows, so memory follows the depth actually used
+ * rather than the capacity. Emptied segments go on a spare list, and
+ * spares the queue has not needed for a while are freed.
+ */
+typedef struct queue_segment {
+	_Alignas(64) queue_item_t items[QUEUE_SEGMENT_ITEMS]; /** The items */
+	struct queue_segment *next; /** Next segment towards the tail */
+} queue_segment_t;
+
+/**
+ * A cancellation token. Shared between the caller and every queued item
+ * that refers to it, and freed when the last reference is dropped.
+ */
+struct pool_token {
+	atomic_int cancelled; /** Non-zero once `pool_token_cancel()` is called */
+	atomic_int refs; /** Reference count */
+};
+
+/** Token and deadline of the task running on this thread, if any */
+static __thread pool_token_t *task_token = NULL;
+static __thread uint64_t task_deadline = 0;
+
+/** Keyed items a strand runs before giving its worker back */
+#define STRAND_BATCH 16
+
+/** Most queue items a worker takes per lock acquisition */
+#define POOL_BATCH_MAX 16
+
+/** Set in the trace ids of keyed items, which are numbered apart from the
+ * queue's since they are enqueued without the pool mutex */
+#define KEYED_TRACE_ID (1ull << 63)
+
+/**
+ * A keyed work item waiting in a strand. Allocated with
+ * `pool_task_alloc()` so nodes made on workers avoid malloc. The option
+ * fields mean the same as in `queue_item_t`.
+ */
+typedef struct strand_node {
+	_Atomic(struct strand_node *) next; /** Next node toward the tail */
+	void (*func)(void *arg); /** Function pointer */
+	void *arg; /** Argument passed to the `func` function pointer */
+	void (*cancel)(void *arg); /** Called if the item is skipped, or NULL */
+	pool_token_t *token; /** Cancellation token holding a reference, or NULL */
+	uint64_t deadline; /** pool_now() time after which to skip, or 0 */
+	uint64_t id; /** Trace id, with KEYED_TRACE_ID set */
+} strand_node_t;
+
+/**
+ * A serial executor. Producers push onto an intrusive multi-producer,
+ * single-consumer queue without locks. The strand is put on the pool's
+ * ready list only when it goes from idle to having work, and then at most
+ * one worker at a time drains it, so items run in FIFO order and never in
+ * parallel with each other.
+ */
+typedef struct strand {
+	_Atomic(strand_node_t *) tail; /** Producers append here */
+	strand_node_t *head; /** Next node to run; owned by the running worker */
+	strand_node_t stub; /** Placeholder node that keeps the queue non-empty */
+	atomic_int scheduled; /** Non-zero while ready or running */
+	struct strand *next; /** Link in the pool's ready list */
+} strand_t;
+
+/**
+ * A task enqueued with `pool_enqueue_hedged()`. Each copy queued or running
+ * holds a reference. Once a copy starts, the task is on the pool's
+ * `hedges` list until one returns, and the watchdog looks there for tasks
+ * that have run too long.
+ */
+typedef struct pool_hedge {
+	struct pool_hedge *next; /** Next on the `hedges` list */
+	struct pool_hedge **pprev; /** The link pointing at this one */
+	pool_t *pool; /** The pool it runs on */
+	void *(*func)(void *arg); /** The task */
+	void *arg; /** Passed to `func` and `done` */
+	void (*done)(void *arg, void *result, int first); /** Gets each result */
+	pool_token_t *token; /** Cancelled once a copy has returned */
+	uint64_t started; /** pool_now() time the first copy started, or 0 */
+	int hedged; /** Non-zero once a duplicate was queued */
+	atomic_int finished; /** Set by the first copy to return */
+	atomic_int refs; /** Reference count */
+} pool_hedge_t;
+
+/**
+ * State of the CoDel admission controller, see `pool_set_admission()`.
+ * Protected by the pool mutex. Times are `pool_now()` nanoseconds.
+ */
+typedef struct {
+	uint64_t target; /** Acceptable queue delay; 0 disables the controller */
+	uint64_t interval; /** How long delay must stay above target */
+	uint64_t first_above; /** When delay may be declared persistent, or 0 */
+	uint64_t drop_next; /** When the next item is shed while dropping */
+	uint32_t drop_count; /** Items shed in the current dropping state */
+	uint32_t last_count; /** `drop_count` when the last state began */
+	int dropping; /** Non-zero while shedding load */
+} codel_t;
+
 /**
  * The runtime status of the pool. Typically, the state should always
  * be `POOL_STATUS_NORMAL` until `pool_free()` is called.
@@ -26,25 +172,233 @@ typedef enum {
 	POOL_STATUS_SHUTDOWN,
 } pool_status_t;
 
+/**
+ * Lifecycle of a worker slot. Slots are reused when the number of threads
+ * is changed at runtime with `pool_set_threads()`.
+ */
+typedef enum {
+	WORKER_STOPPED = 0, /** No thread, or the thread has been joined */
+	WORKER_RUNNING, /** The thread is running */
+	WORKER_EXITED, /** The thread retired and must be joined */
+} worker_state_t;
+
+/**
+ * Per-worker state. Each worker thread is handed a pointer to its own
+ * entry in the pool's `workers` array.
+ */
+typedef struct {
+	pool_t *pool; /** The pool this worker belongs to */
+	pthread_t thread; /** The worker's thread handle */
+	size_t id; /** Index into `workers`; ids >= `pool_wanted()` retire */
+	worker_state_t state; /** Protected by the pool mutex */
+	alloc_cache_t *cache; /** Backs pool_task_alloc() for this worker */
+	_Atomic(void (*)(void *)) task_func; /** Task running while watched */
+	atomic_uint_least64_t task_start; /** pool_now() time it started */
+	uint64_t stall_start; /** `task_start` of the last stall reported */
+	int stalled; /** Counted in `nstalled`; protected by the pool mutex */
+	queue_item_t *batch; /** The batch being run, on the worker's stack */
+	uint64_t *batch_ids; /** Task ids of `batch` */
+	size_t nbatch; /** Items in `batch`; protected by the pool mutex */
+	atomic_size_t batch_next; /** Next `batch` item to claim */
+} worker_t;
+
 /**
  * The threadpool struct
  */
 struct pool {
-	queue_item_t *queue; /** Pointer to the beginning of the queue space */
-	queue_item_t *head; /** Points to the queue 'push' point */
-	queue_item_t *tail; /** Points to the queue 'pop' point */
-	pthread_t *threads; /** Pointer to the beginning of the threads space */
+	queue_segment_t *head_seg; /** Segment holding the queue 'pop' point */
+	size_t head_idx; /** Index of the 'pop' point in `head_seg` */
+	queue_segment_t *tail_seg; /** Segment holding the queue 'push' point */
+	size_t tail_idx; /** Index of the 'push' point in `tail_seg` */
+	queue_segment_t *spare; /** Emptied segments kept for reuse */
+	size_t nspare; /** Number of segments on `spare` */
+	size_t nsegments; /** Segments allocated, spares included */
+	size_t queue_peak; /** Deepest the queue got since the last trim */
+	uint64_t trim_start; /** pool_now() time of the last trim */
+	worker_t *workers; /** MAX_WORKER_THREADS worker slots */
 	pthread_mutex_t mtx; /** The mutex used to lock critical sections */
 	pthread_cond_t cnd; /** The condtion used for thread synchronization */
 	pool_status_t status; /** The runtime status of the pool */
-	size_t nthreads; /** Number of threads allocated */
+	size_t nthreads; /** Number of threads wanted */
 	size_t nalive; /** Number of threads alive */
+	size_t nbusy; /** Number of threads running a task */
 	size_t capacity; /** Maximum queue depth */
 	size_t count; /** Current queue depth */
+	uint64_t nenqueued; /** Total items enqueued, also the next task id */
+	uint64_t ndequeued; /** Total items dequeued */
+	uint64_t ncompleted; /** Total tasks that returned */
+	uint64_t ncancelled; /** Total items skipped as cancelled or expired */
+	uint64_t nshed; /** Total items refused or dropped by admission control */
+	codel_t codel; /** Admission control state */
+	uint64_t nrejected; /** Total items refused because the queue was full */
+	strand_t *strands; /** POOL_STRANDS strands for keyed items */
+	strand_t *ready_head; /** Strands with work, waiting for a worker */
+	strand_t *ready_tail; /** Last strand on the ready list */
+	atomic_size_t nkeyed; /** Keyed items waiting in strands */
+	atomic_uint_least64_t nkeyed_ids; /** Next keyed trace id */
+	atomic_size_t depth; /** Copy of `count` readable without lock */
+	atomic_size_t keyed_limit; /** Copy of `capacity` readable without lock */
+	atomic_int closed; /** Set with POOL_STATUS_SHUTDOWN, read without lock */
+	size_t cpu_first; /** First CPU workers are pinned to */
+	size_t cpu_count; /** Number of CPUs workers are pinned to, 0 for any */
+	cpu_set_t cpu_allowed; /** CPUs the thread calling pool_init() may use */
+	pthread_t watchdog; /** Watchdog thread, see pool_set_watchdog() */
+	int watchdog_started; /** Non-zero once `watchdog` was created */
+	pthread_cond_t watch_cnd; /** Wakes the watchdog; monotonic clock */
+	uint64_t watch_threshold; /** Run time that counts as a stall, or 0 */
+	int watch_flags; /** POOL_WATCHDOG_* flags */
+	atomic_int watching; /** Non-zero while `watch_threshold` is set */
+	size_t nstalled; /** Workers stalled and not yet back */
+	uint64_t nstalls; /** Total stalls reported */
+	uint64_t nhedged; /** Total hedged duplicates queued */
+	pool_hedge_t *hedges; /** Hedged tasks running */
 };
 
 /* Definition here, more details at implementation */
 static void *worker(void *arg);
+static int worker_spawn(pool_t *pool, size_t i);
+static void worker_cpus(pool_t *pool, cpu_set_t *cpus);
+static int queue_push(pool_t *pool, void (*func)(void *), void *arg,
+	const void *data, size_t len, const pool_task_opts_t *opts);
+static int queue_push_locked(pool_t *pool, void (*func)(void *), void *arg,
+	const void *data, size_t len, void (*cancel)(void *), queue_opts_t *qo);
+static queue_segment_t *queue_segment_get(pool_t *pool);
+static queue_item_t *queue_slot_push(pool_t *pool);
+static queue_item_t *queue_slot_pop(pool_t *pool);
+static queue_item_t *queue_slot_unpop(pool_t *pool, queue_segment_t **seg);
+static void queue_trim(pool_t *pool, uint64_t now);
+static int codel_shed(codel_t *codel, uint64_t now, uint64_t sojourn,
+	size_t backlog);
+static int strand_ready(pool_t *pool, strand_t *strand);
+static void strand_run(worker_t *self, strand_t *strand, size_t *ran,
+	size_t *skipped);
+static void *watchdog(void *arg);
+static void watchdog_scan(pool_t *pool, uint64_t now);
+static size_t watchdog_unbatch(pool_t *pool, worker_t *w);
+static void hedge_run(void *arg);
+static void hedge_put(void *arg);
+
+/**
+ * Number of worker slots that should be running: the configured threads
+ * plus one replacement per stalled worker. Caller must hold the pool mutex.
+ * @param pool The pool to use
+ * @return Returns the number of slots, at most `MAX_WORKER_THREADS`
+ */
+static inline size_t pool_wanted(const pool_t *pool)
+{
+	size_t n = pool->nthreads + pool->nstalled;
+
+	return n < MAX_WORKER_THREADS ? n : MAX_WORKER_THREADS;
+}
+
+/**
+ * Publishes the task a worker is about to run, or NULL once it returned,
+ * for the watchdog. Does nothing while no watchdog is set.
+ * @param self The worker
+ * @param func The task, or NULL
+ */
+static inline void worker_watch(worker_t *self, void (*func)(void *))
+{
+	if (func == NULL) {
+		if (atomic_load_explicit(&self->task_func, memory_order_relaxed))
+			atomic_store_explicit(&self->task_func, NULL,
+				memory_order_relaxed);
+		return;
+	}
+
+	if (!atomic_load_explicit(&self->pool->watching, memory_order_relaxed))
+		return;
+
+	atomic_store_explicit(&self->task_start, pool_now(), memory_order_relaxed);
+	atomic_store_explicit(&self->task_func, func, memory_order_release);
+}
+
+/**
+ * @return Returns the argument to pass to an item's function and cancel
+ *   callback
+ */
+static inline void *item_arg(queue_item_t *item)
+{
+	return (item->flags & ITEM_INLINE) ? (void *)item->data : item->arg;
+}
+
+/**
+ * Gives a popped item its task id. The queue is FIFO, so the dequeue order
+ * gives the id, except for items a stalled worker was holding: those were
+ * counted when first dequeued and keep the id they got then, which is
+ * less than `ndequeued` and rebuilt from its low 32 bits. Caller must
+ * hold the pool mutex.
+ * @param pool The pool to use
+ * @param item The item just popped
+ * @return Returns the task id
+ */
+static inline uint64_t item_id(pool_t *pool, const queue_item_t *item)
+{
+	if (item->flags & ITEM_REQUEUED)
+		return pool->ndequeued -
+			(uint32_t)((uint32_t)pool->ndequeued - item->enqueued);
+
+	return pool->ndequeued++;
+}
+
+/**
+ * @return Returns an item's out-of-line options, or NULL
+ */
+static inline queue_opts_t *item_opts(queue_item_t *item)
+{
+	return (item->flags & ITEM_OPTS) ? item->opts : NULL;
+}
+
+/**
+ * Calls an item's cancel callback, if it has one, in place of its function
+ * @param item The item being skipped
+ */
+static inline void item_cancel(queue_item_t *item)
+{
+	void (*cancel)(void *) = (item->flags & ITEM_OPTS) ?
+		item->opts->cancel : item->cancel;
+
+	if (cancel != NULL)
+		(*cancel)(item_arg(item));
+}
+
+/**
+ * Copies an item's options out of line, if it has a token or deadline. A
+ * cancel callback alone is stored in the slot instead.
+ * @param opts The options passed to the enqueue call, or NULL
+ * @param qo Set to the copy, or NULL if there is nothing to copy
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int queue_opts_new(const pool_task_opts_t *opts, queue_opts_t **qo)
+{
+	*qo = NULL;
+
+	if (opts == NULL || (opts->token == NULL && opts->deadline == 0))
+		return 0;
+
+	if ((*qo = (queue_opts_t *)pool_task_alloc(sizeof(**qo))) == NULL)
+		return -1;
+
+	(*qo)->cancel = opts->cancel;
+	(*qo)->token = opts->token;
+	(*qo)->deadline = opts->deadline;
+
+	return 0;
+}
+
+/**
+ * Releases an item's options and the token reference they hold
+ * @param qo The options, may be NULL
+ */
+static inline void queue_opts_free(queue_opts_t *qo)
+{
+	if (qo == NULL)
+		return;
+
+	pool_token_free(qo->token);
+	pool_task_free(qo);
+}
 
 /**
  * Initializes a thread pool used to perform various asynchronous work
@@ -57,6 +411,7 @@ pool_t *pool_init(size_t nthreads, size_t capacity)
 {
 	int rc;
 	pool_t *pool;
+	pthread_condattr_t attr;
 
 	/* Verify function arguments */
 	if (nthreads > MAX_WORKER_THREADS) {
@@ -76,21 +431,36 @@ pool_t *pool_init(size_t nthreads, size_t capacity)
 	}
 
 	do {
-		/* Allocate the pool's queue */
-		pool->queue = (queue_item_t *)calloc(capacity, sizeof(*pool->queue));
-		if (pool->queue == NULL) {
+		/* The queue itself is allocated a segment at a time as it fills */
+
+		/* Allocate every worker slot now so the thread count can be
+		 * changed later without moving the array under running workers
+		 */
+		pool->workers = (worker_t *)calloc(MAX_WORKER_THREADS,
+			sizeof(*pool->workers));
+		if (pool->workers == NULL) {
 			poolerrno = ENOMEM;
 			break;
 		}
-		pool->head = pool->queue;
-		pool->tail = pool->queue;
-	
-		/* Allocate the pool's worker threads */
-		pool->threads = (pthread_t *)calloc(nthreads, sizeof(*pool->threads));
-		if (pool->threads == NULL) {
+		for (size_t i = 0; i < MAX_WORKER_THREADS; i++) {
+			pool->workers[i].pool = pool;
+			pool->workers[i].id = i;
+		}
+
+		/* Allocate the strands used by pool_enqueue_keyed() */
+		pool->strands = (strand_t *)calloc(POOL_STRANDS,
+			sizeof(*pool->strands));
+		if (pool->strands == NULL) {
 			poolerrno = ENOMEM;
 			break;
 		}
+		for (size_t i = 0; i < POOL_STRANDS; i++) {
+			strand_t *st = &pool->strands[i];
+			atomic_init(&st->stub.next, NULL);
+			atomic_init(&st->tail, &st->stub);
+			atomic_init(&st->scheduled, 0);
+			st->head = &st->stub;
+		}
 
 		/* Initialize mutex */
 		if ((rc = pthread_mutex_init(&pool->mtx, NULL)) != 0) {
@@ -104,16 +474,27 @@ pool_t *pool_init(size_t nthreads, size_t capacity)
 			break;
 		}
 
+		/* The watchdog measures pool_now() times, so it waits on the
+		 * monotonic clock */
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		rc = pthread_cond_init(&pool->watch_cnd, &attr);
+		pthread_condattr_destroy(&attr);
+		if (rc != 0) {
+			poolerrno = rc;
+			break;
+		}
+
 	} while (0);
 
 	/* If there is an error, back out the memory allocations, then exit */
 	if (poolerrno != POOLERRNO_OK) {
-		if (pool->threads)
-			free(pool->threads);
-		pool->threads = NULL;
-		if (pool->queue)
-			free(pool->queue);
-		pool->queue = NULL;
+		if (pool->strands)
+			free(pool->strands);
+		pool->strands = NULL;
+		if (pool->workers)
+			free(pool->workers);
+		pool->workers = NULL;
 		free(pool);
 		pool = NULL;
 		return NULL;
@@ -125,31 +506,50 @@ pool_t *pool_init(size_t nthreads, size_t capacity)
 
 	pool->status = POOL_STATUS_NORMAL;
 	pool->nthreads = nthreads;
+	if (sched_getaffinity(0, sizeof(pool->cpu_allowed),
+	                      &pool->cpu_allowed) < 0)
+		for (size_t c = 0; c < CPU_SETSIZE; c++)
+			CPU_SET(c, &pool->cpu_allowed);
 	pool->nalive = 0;
+	pool->nbusy = 0;
 	pool->capacity = capacity;
 	pool->count = 0;
+	pool->nenqueued = 0;
+	pool->ndequeued = 0;
+	pool->ncompleted = 0;
+	pool->ncancelled = 0;
+	pool->nshed = 0;
+	pool->nrejected = 0;
+	pool->ready_head = NULL;
+	pool->ready_tail = NULL;
+	atomic_init(&pool->nkeyed, 0);
+	atomic_init(&pool->nkeyed_ids, 0);
+	atomic_init(&pool->depth, 0);
+	atomic_init(&pool->keyed_limit, capacity);
+	atomic_init(&pool->closed, 0);
+	pool->trim_start = pool_now();
 
+	pthread_mutex_lock(&pool->mtx);
 	for (size_t i = 0; i < nthreads; i++) {
-		rc = pthread_create(&pool->threads[i], NULL, worker, (void *)pool);
-		if (rc != 0) {
-			poolerrno = rc;
+		if (worker_spawn(pool, i) < 0)
 			break;
-		}
-		pool->nalive++;
 	}
+	pthread_mutex_unlock(&pool->mtx);
 
 	return pool;
 }
 
 /**
- * @todo Document
- * @param pool @todo Document
+ * Shuts a pool down and frees it. Workers finish the tasks they are
+ * running. Items that never ran get their cancel callback, which may call
+ * back into the pool; enqueues are refused from the moment this is called.
+ * @param pool The pool to free, may be NULL
  */
 void pool_free(pool_t *pool)
 {
 	int i;
 	int rc;
-	size_t nalive;
+	queue_item_t item;
 
 	if (pool == NULL)
 		return;
@@ -157,48 +557,106 @@ void pool_free(pool_t *pool)
 	/* First things first... get the mutex */
 	pthread_mutex_lock(&pool->mtx);
 
-	/* This can *probably* be done outside the mutex */
-	nalive = pool->nalive;
-
 	/* We are protected here, so set the status to SHUTDOWN and
 	 * broadcast a signal out to all waiting threads to wake them up
 	 */
 	pool->status = POOL_STATUS_SHUTDOWN;
+	atomic_store(&pool->closed, 1);
 	pthread_cond_broadcast(&pool->cnd);
+	pthread_cond_signal(&pool->watch_cnd);
 
 	/* However, some of the threads could be doing work and thus won't receive
 	 * the broadcast. No worries. We set the status so that when they finish
-	 * their current work they will shutdown
+	 * their current work they will shutdown. Once the status is SHUTDOWN no
+	 * worker changes its slot state any more, so the slots can be read
+	 * without the mutex below
 	 */
 	pthread_mutex_unlock(&pool->mtx);
 
+	if (pool->watchdog_started &&
+	    (rc = pthread_join(pool->watchdog, NULL)) != 0)
+		LOG(LOG_LEVEL_WARN, "Could not join watchdog: %s\n", strerror(rc));
+
 	/* Wait for threads to shutdown themselves. Waiting on them (joining)
 	 * is the only way to be sure they are done
 	 */
-	for (i = 0; (size_t)i < nalive; ++i) {
-		if ((rc = pthread_join(pool->threads[i], NULL)) != 0) {
-			printf("WARN: Could not join thread %d: %s\n", i, strerror(rc));
+	for (i = 0; i < MAX_WORKER_THREADS; ++i) {
+		if (pool->workers[i].state == WORKER_STOPPED)
+			continue;
+		if ((rc = pthread_join(pool->workers[i].thread, NULL)) != 0) {
+			LOG(LOG_LEVEL_WARN, "Could not join thread %d: %s\n", i, strerror(rc));
+		}
+		if (pool->workers[i].state == WORKER_RUNNING)
+			pool->nalive--;
+		pool->workers[i].state = WORKER_STOPPED;
+	}
+
+	/* Items that never ran. Give the cancel callbacks a chance to release
+	 * their arguments, and drop the token references. The mutex is still
+	 * valid, so a callback that calls back into the pool is refused
+	 * rather than undefined */
+	for (;;) {
+		pthread_mutex_lock(&pool->mtx);
+		if (pool->count == 0) {
+			pthread_mutex_unlock(&pool->mtx);
+			break;
+		}
+		item = *queue_slot_pop(pool);
+		pool->count--;
+		pthread_mutex_unlock(&pool->mtx);
+
+		item_cancel(&item);
+		queue_opts_free(item_opts(&item));
+	}
+
+	/* Keyed items that never ran. Their memory may have come from the
+	 * worker caches, so it must go back before the caches are released */
+	if (pool->strands) {
+		for (i = 0; i < POOL_STRANDS; i++) {
+			strand_node_t *n = pool->strands[i].head;
+			while (n != NULL) {
+				strand_node_t *next = atomic_load(&n->next);
+				if (n != &pool->strands[i].stub) {
+					if (n->cancel != NULL)
+						(*n->cancel)(n->arg);
+					pool_token_free(n->token);
+					pool_task_free(n);
+				}
+				n = next;
+			}
 		}
-		pool->nalive--;
+		free(pool->strands);
 	}
+	pool->strands = NULL;
 
 	/* To make it here, all the threads are done working and exited
 	 * Destroy the mutex
 	 */
 	if ((rc = pthread_mutex_destroy(&pool->mtx)) != 0)
-		printf("ERROR: Could not destroy mutex: %s\n", strerror(rc));
+		LOG(LOG_LEVEL_ERROR, "Could not destroy mutex: %s\n", strerror(rc));
 
 	/* Destroy the signal condition */
 	if ((rc = pthread_cond_destroy(&pool->cnd)) != 0)
-		printf("ERROR: Could not destroy condition: %s\n", strerror(rc));
+		LOG(LOG_LEVEL_ERROR, "Could not destroy condition: %s\n", strerror(rc));
+	pthread_cond_destroy(&pool->watch_cnd);
 
-	if (pool->queue)
-		free(pool->queue);
-	pool->queue = NULL;
+	/* The last segment stays in place when the queue empties */
+	if (pool->head_seg != NULL) {
+		pool->head_seg->next = pool->spare;
+		pool->spare = pool->head_seg;
+	}
+	while (pool->spare != NULL) {
+		queue_segment_t *next = pool->spare->next;
+		free(pool->spare);
+		pool->spare = next;
+	}
 
-	if (pool->threads)
-		free(pool->threads);
-	pool->threads = NULL;
+	if (pool->workers) {
+		for (i = 0; i < MAX_WORKER_THREADS; i++)
+			alloc_cache_free(pool->workers[i].cache);
+		free(pool->workers);
+	}
+	pool->workers = NULL;
 
 	if (pool)
 		free(pool);
@@ -217,37 +675,226 @@ void pool_free(pool_t *pool)
  */
 int pool_enqueue(pool_t *pool, void (*func)(void *), void *arg)
 {
-	int rc;
+	return queue_push(pool, func, arg, NULL, 0, NULL);
+}
 
-	if (pool == NULL) {
+/**
+ * Puts a work item into the tail of the queue, copying `len` bytes of
+ * `data` into the queue slot itself. The function is called with a pointer
+ * to the worker's copy of those bytes, which is only valid until `func`
+ * returns. The caller does not need to keep `data` alive after this call,
+ * so small arguments need no heap allocation.
+ * @param pool The pool to use
+ * @param func The function used for the work item
+ * @param data The argument bytes to copy into the queue slot
+ * @param len Number of bytes in `data`, at most `POOL_INLINE_ARG_SIZE`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_enqueue_inline(pool_t *pool, void (*func)(void *),
+	const void *data, size_t len)
+{
+	if (data == NULL || len > POOL_INLINE_ARG_SIZE) {
 		poolerrno = EINVAL;
 		return -1;
 	}
 
-	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
-		poolerrno = rc;
+	return queue_push(pool, func, NULL, data, len, NULL);
+}
+
+/**
+ * Like `pool_enqueue()`, but the item can be cancelled. A worker that
+ * dequeues the item after `opts->deadline` has passed, or after
+ * `opts->token` has been cancelled, does not run `func`. It calls
+ * `opts->cancel` with `arg` instead, if set, so the argument's resources
+ * can be released. A cancel callback alone is kept in the queue slot; a
+ * token or deadline costs a `pool_task_alloc()` per item.
+ * @param pool The pool to use
+ * @param func The function used for the work item
+ * @param arg The argument to the function used for the work item
+ * @param opts Deadline, token and cancel callback. May be NULL
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_enqueue_opts(pool_t *pool, void (*func)(void *), void *arg,
+	const pool_task_opts_t *opts)
+{
+	return queue_push(pool, func, arg, NULL, 0, opts);
+}
+
+/**
+ * Combination of `pool_enqueue_inline()` and `pool_enqueue_opts()`. The
+ * cancel callback, if called, gets a pointer to the inline copy.
+ * @param pool The pool to use
+ * @param func The function used for the work item
+ * @param data The argument bytes to copy into the queue slot
+ * @param len Number of bytes in `data`, at most `POOL_INLINE_ARG_SIZE`
+ * @param opts Deadline, token and cancel callback. May be NULL
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_enqueue_inline_opts(pool_t *pool, void (*func)(void *),
+	const void *data, size_t len, const pool_task_opts_t *opts)
+{
+	if (data == NULL || len > POOL_INLINE_ARG_SIZE) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	return queue_push(pool, func, NULL, data, len, opts);
+}
+
+/**
+ * Puts a work item on the strand selected by `key`. Items with the same
+ * key run one at a time, in the order they were enqueued, while items with
+ * different keys run in parallel. No worker ever blocks waiting for a key;
+ * a strand only occupies a worker while it has items to run.
+ *
+ * Keys are hashed onto `POOL_STRANDS` strands, so two different keys may
+ * share a strand and then also run serially with respect to each other.
+ *
+ * Keyed items share the queue capacity with queued items. They are not
+ * subject to admission control, which only measures the queue.
+ * @param pool The pool to use
+ * @param key Identifies the serial order, e.g. a client or session id
+ * @param func The function used for the work item
+ * @param arg The argument to the function used for the work item
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_enqueue_keyed(pool_t *pool, uint64_t key, void (*func)(void *),
+	void *arg)
+{
+	return pool_enqueue_keyed_opts(pool, key, func, arg, NULL);
+}
+
+/**
+ * Like `pool_enqueue_keyed()`, but the item can be cancelled, as with
+ * `pool_enqueue_opts()`. A skipped item does not hold up the items behind
+ * it on its strand. `opts->cancel` is also called for items still waiting
+ * when the pool is freed.
+ * @param pool The pool to use
+ * @param key Identifies the serial order, e.g. a client or session id
+ * @param func The function used for the work item
+ * @param arg The argument to the function used for the work item
+ * @param opts Deadline, token and cancel callback. May be NULL
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_enqueue_keyed_opts(pool_t *pool, uint64_t key, void (*func)(void *),
+	void *arg, const pool_task_opts_t *opts)
+{
+	strand_t *strand;
+	strand_node_t *node;
+	strand_node_t *prev;
+
+	if (pool == NULL || func == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (atomic_load(&pool->closed)) {
+		poolerrno = POOLERRNO_SHUTDOWN;
 		return -1;
 	}
 
-	if (pool->count == pool->capacity) {
+	/* Both counters move without the mutex, so under contention the
+	 * total may pass the capacity by the number of racing producers */
+	if (atomic_fetch_add(&pool->nkeyed, 1) + atomic_load(&pool->depth) >=
+	    atomic_load(&pool->keyed_limit)) {
+		atomic_fetch_sub(&pool->nkeyed, 1);
 		poolerrno = POOLERRNO_QUEUE_FULL;
 		return -1;
 	}
 
-	/* Tail points to new work item */
-	pool->tail->func = func;
-	pool->tail->arg = arg;
+	if ((node = (strand_node_t *)pool_task_alloc(sizeof(*node))) == NULL) {
+		atomic_fetch_sub(&pool->nkeyed, 1);
+		return -1;
+	}
+
+	node->func = func;
+	node->arg = arg;
+	if (opts != NULL) {
+		node->cancel = opts->cancel;
+		node->token = opts->token;
+		node->deadline = opts->deadline;
+		if (opts->token != NULL)
+			atomic_fetch_add(&opts->token->refs, 1);
+	} else {
+		node->cancel = NULL;
+		node->token = NULL;
+		node->deadline = 0;
+	}
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	node->id = KEYED_TRACE_ID | atomic_fetch_add_explicit(&pool->nkeyed_ids,
+		1, memory_order_relaxed);
+	TRACE_EVENT(TRACE_ENQUEUE, node->id);
 
-	if (++pool->tail == pool->queue + pool->capacity)
-		pool->tail = pool->queue;
+	/* Fibonacci hashing spreads sequential keys across the strands */
+	strand = &pool->strands[(key * 0x9E3779B97F4A7C15ull) >> 32 &
+		(POOL_STRANDS - 1)];
 
-	pool->count++;
+	prev = atomic_exchange(&strand->tail, node);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
 
-	/* Tell waiting threads there's something to work on */
-	pthread_cond_signal(&pool->cnd);
+	/* Only the push that wakes an idle strand schedules it */
+	if (atomic_exchange(&strand->scheduled, 1) == 0)
+		return strand_ready(pool, strand);
 
-	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
-		poolerrno = rc;
+	return 0;
+}
+
+/**
+ * Puts an idempotent task on the queue that may be run twice. If it is
+ * still running after the watchdog threshold (see `pool_set_watchdog()`),
+ * a duplicate is queued, and whichever copy returns first supplies the
+ * result. The copy still running sees `pool_task_cancelled()` set and
+ * may return early. Without a watchdog the task runs once.
+ * @param pool The pool to use
+ * @param func The task. It must be safe to run twice, concurrently, and
+ *   return its result rather than act on it
+ * @param arg The argument to `func` and `done`
+ * @param done Called once for each copy that returns, with its result;
+ *   `first` is non-zero for the first one only, which is the one to use.
+ *   Not called if no copy ever ran, e.g. if the pool was freed first.
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_enqueue_hedged(pool_t *pool, void *(*func)(void *), void *arg,
+	void (*done)(void *arg, void *result, int first))
+{
+	pool_hedge_t *h;
+	pool_task_opts_t opts;
+
+	if (pool == NULL || func == NULL || done == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((h = (pool_hedge_t *)pool_task_alloc(sizeof(*h))) == NULL)
+		return -1;
+
+	if ((h->token = pool_token_new()) == NULL) {
+		pool_task_free(h);
+		return -1;
+	}
+
+	h->next = NULL;
+	h->pprev = NULL;
+	h->pool = pool;
+	h->func = func;
+	h->arg = arg;
+	h->done = done;
+	h->started = 0;
+	h->hedged = 0;
+	atomic_init(&h->finished, 0);
+	atomic_init(&h->refs, 1);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.cancel = hedge_put;
+	if (queue_push(pool, hedge_run, h, NULL, 0, &opts) < 0) {
+		pool_token_free(h->token);
+		pool_task_free(h);
 		return -1;
 	}
 
@@ -317,76 +964,1407 @@ int pool_get_queue_capacity(pool_t *pool, size_t *capacity)
 }
 
 /**
- * Converts a `poolerrno` error number into a human-readable string
- * @param poolerrno The error number to convert to a string
- * @return Returns a human-readable string of `poolerrno`
- */
-const char *poolerrno_str(int poolerrno)
-{
-	switch (poolerrno) {
-	case POOLERRNO_OK:
-		return "ok";
-	case POOLERRNO_QUEUE_FULL:
-		return "queue is full";
-	default:
-		return strerror(poolerrno);
-	}
-}
-
-/**
- * This is a worker thread that acts on the queue. There can be multiple
- * workers, which is the reason for the mutex locks
- * @param arg This must be the pool_t object allocated from 
- * @return @todo Document
+ * Changes the number of worker threads while the pool is running. New
+ * workers start immediately. Surplus workers finish the task they are
+ * running, if any, and then exit; queued work is not disturbed.
+ * @param pool The pool to use
+ * @param nthreads The new number of worker threads, at least 1, since a
+ *   pool without workers would accept work it never runs
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
  */
-void *worker(void *arg)
+int pool_set_threads(pool_t *pool, size_t nthreads)
 {
 	int rc;
-	pool_t *pool;
-	queue_item_t item;
+	int ret = 0;
 
-	if (arg == NULL) {
+	if (pool == NULL || nthreads == 0 || nthreads > MAX_WORKER_THREADS) {
 		poolerrno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
-	pool = (pool_t *)arg;
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
 
-	for (;;) {
-		if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
-			poolerrno = rc;
-			return NULL;
-		}
+	pool->nthreads = nthreads;
 
-		while (pool->count == 0 && pool->status != POOL_STATUS_SHUTDOWN) {
-			if ((rc = pthread_cond_wait(&pool->cnd, &pool->mtx)) != 0) {
-				poolerrno = rc;
-			}
-		}
+	/* Wake idle workers so the surplus ones notice they should retire */
+	pthread_cond_broadcast(&pool->cnd);
+
+	for (size_t i = 0; i < pool_wanted(pool); i++) {
+		if (worker_spawn(pool, i) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Changes the queue capacity while the pool is running. The capacity is
+ * only a limit; queue memory grows and shrinks with the actual depth. It
+ * cannot be set below the current queue depth.
+ * @param pool The pool to use
+ * @param capacity The new maximum queue depth
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_set_queue_capacity(pool_t *pool, size_t capacity)
+{
+	int rc;
+
+	if (pool == NULL || capacity > MAX_QUEUE_CAPACITY) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	if (capacity < pool->count + atomic_load(&pool->nkeyed)) {
+		pthread_mutex_unlock(&pool->mtx);
+		poolerrno = EBUSY;
+		return -1;
+	}
+
+	pool->capacity = capacity;
+	atomic_store(&pool->keyed_limit, capacity);
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Enables CoDel-style admission control. The pool measures how long each
+ * item waited in the queue. Once the shortest wait has stayed above
+ * `target_us` for `interval_us`, the pool starts shedding load: new items
+ * are refused with `POOLERRNO_OVERLOADED`, and queued items are dropped at
+ * an increasing rate (their cancel callback is called, if any) until the
+ * wait falls back under the target. Queue delay then stays near the target
+ * under overload instead of growing with the queue length.
+ * @param pool The pool to use
+ * @param target_us Acceptable queue delay in microseconds, 0 to disable
+ * @param interval_us Time the delay may exceed the target before shedding
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_set_admission(pool_t *pool, unsigned long target_us,
+	unsigned long interval_us)
+{
+	int rc;
+
+	if (pool == NULL || (target_us != 0 && interval_us == 0)) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	memset(&pool->codel, 0, sizeof(pool->codel));
+	pool->codel.target = (uint64_t)target_us * 1000;
+	pool->codel.interval = (uint64_t)interval_us * 1000;
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Pins the worker threads to the CPUs `first` to `first + count - 1`.
+ * Running workers are moved right away and workers started later, e.g. by
+ * `pool_set_threads()`, are created on those CPUs. A pool whose workers
+ * stay on a few cores keeps its queue and task data in those cores' caches.
+ * CPUs in the range that the thread which created the pool could not use,
+ * e.g. outside a container's cpuset, are left out.
+ * @param pool The pool to use
+ * @param first The first CPU number
+ * @param count The number of CPUs, or 0 to let workers run anywhere
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set; EINVAL if no CPU in the range may be used.
+ */
+int pool_set_affinity(pool_t *pool, size_t first, size_t count)
+{
+	int rc;
+	int ret = 0;
+	size_t old_first;
+	size_t old_count;
+	cpu_set_t cpus;
+
+	if (pool == NULL || first + count > CPU_SETSIZE) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	old_first = pool->cpu_first;
+	old_count = pool->cpu_count;
+	pool->cpu_first = first;
+	pool->cpu_count = count;
+	worker_cpus(pool, &cpus);
+
+	if (CPU_COUNT(&cpus) == 0) {
+		pool->cpu_first = old_first;
+		pool->cpu_count = old_count;
+		pthread_mutex_unlock(&pool->mtx);
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < MAX_WORKER_THREADS; i++) {
+		if (pool->workers[i].state != WORKER_RUNNING)
+			continue;
+		rc = pthread_setaffinity_np(pool->workers[i].thread,
+			sizeof(cpus), &cpus);
+		if (rc != 0) {
+			poolerrno = rc;
+			ret = -1;
+		}
+	}
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Watches for tasks that run longer than `threshold_ms`, e.g. a handler
+ * blocked in `read()` on a client that never sends. Each one is logged
+ * with its worker, function address and age, and counted in the stats.
+ * Items the stalled worker dequeued with the task but had not started go
+ * back to the front of the queue. With `POOL_WATCHDOG_REPLACE` a temporary
+ * worker is started for each stalled one, up to `MAX_WORKER_THREADS`, and
+ * retires once the stalled task returns. Hedged tasks past the threshold
+ * get their duplicate. Watched workers read the clock once per task.
+ * @param pool The pool to use
+ * @param threshold_ms Run time that counts as a stall, or 0 to stop
+ *   watching
+ * @param flags 0 or `POOL_WATCHDOG_REPLACE`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int pool_set_watchdog(pool_t *pool, unsigned long threshold_ms, int flags)
+{
+	int rc;
+
+	if (pool == NULL || (flags & ~POOL_WATCHDOG_REPLACE) != 0) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	/* The thread stays until pool_free(), idle while switched off */
+	if (threshold_ms != 0 && !pool->watchdog_started) {
+		if ((rc = pthread_create(&pool->watchdog, NULL, watchdog,
+		                         pool)) != 0) {
+			pthread_mutex_unlock(&pool->mtx);
+			poolerrno = rc;
+			return -1;
+		}
+		pool->watchdog_started = 1;
+	}
+
+	pool->watch_threshold = (uint64_t)threshold_ms * 1000000;
+	pool->watch_flags = flags;
+	atomic_store(&pool->watching, threshold_ms != 0);
+	pthread_cond_signal(&pool->watch_cnd);
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Takes a consistent snapshot of the pool's counters
+ * @param pool The pool to use
+ * @param stats This variable is filled with the pool's counters
+ * @return Returns 0 on success and `stats` is set. On error, less than 0
+ * is returned, `stats` is undefined, and `poolerrno` is set.
+ */
+int pool_get_stats(pool_t *pool, pool_stats_t *stats)
+{
+	int rc;
+
+	if (pool == NULL || stats == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	stats->nthreads = pool->nthreads;
+	stats->nalive = pool->nalive;
+	stats->nbusy = pool->nbusy;
+	stats->capacity = pool->capacity;
+	stats->count = pool->count;
+	stats->nenqueued = pool->nenqueued;
+	stats->ndequeued = pool->ndequeued;
+	stats->ncompleted = pool->ncompleted;
+	stats->ncancelled = pool->ncancelled;
+	stats->nshed = pool->nshed;
+	stats->nrejected = pool->nrejected;
+	stats->nsegments = pool->nsegments;
+	stats->nstalled = pool->nstalled;
+	stats->nstalls = pool->nstalls;
+	stats->nhedged = pool->nhedged;
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads CLOCK_MONOTONIC, the clock used for task deadlines
+ * @return Returns the current time in nanoseconds
+ */
+uint64_t pool_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Allocates a cancellation token. One token may be shared by any number
+ * of queued items, e.g. all the work for one client request.
+ * @return Returns the token on success. On error, NULL is returned and
+ *   `poolerrno` is set.
+ */
+pool_token_t *pool_token_new(void)
+{
+	pool_token_t *token;
+
+	token = (pool_token_t *)malloc(sizeof(*token));
+	if (token == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	atomic_init(&token->cancelled, 0);
+	atomic_init(&token->refs, 1);
+
+	return token;
+}
+
+/**
+ * Drops the caller's reference to a token. Items still queued keep their
+ * own reference, so the token may be freed at any time.
+ * @param token The token, may be NULL
+ */
+void pool_token_free(pool_token_t *token)
+{
+	if (token != NULL && atomic_fetch_sub(&token->refs, 1) == 1)
+		free(token);
+}
+
+/**
+ * Cancels every item that refers to `token`. Items still in the queue are
+ * skipped; tasks already running can notice with `pool_task_cancelled()`.
+ * @param token The token to cancel
+ */
+void pool_token_cancel(pool_token_t *token)
+{
+	if (token != NULL)
+		atomic_store_explicit(&token->cancelled, 1, memory_order_release);
+}
+
+/**
+ * @param token The token to test, may be NULL
+ * @return Returns non-zero if `token` has been cancelled
+ */
+int pool_token_is_cancelled(const pool_token_t *token)
+{
+	return token != NULL &&
+		atomic_load_explicit(&token->cancelled, memory_order_acquire);
+}
+
+/**
+ * Lets a running task poll whether its work is still wanted. Long tasks
+ * should check this between steps and return early when it is set.
+ * @return Returns non-zero if the current task's token was cancelled or
+ *   its deadline has passed. Returns 0 outside a task.
+ */
+int pool_task_cancelled(void)
+{
+	if (pool_token_is_cancelled(task_token))
+		return 1;
+
+	return task_deadline != 0 && pool_now() > task_deadline;
+}
+
+/**
+ * Converts a `poolerrno` error number into a human-readable string
+ * @param poolerrno The error number to convert to a string
+ * @return Returns a human-readable string of `poolerrno`
+ */
+const char *poolerrno_str(int poolerrno)
+{
+	switch (poolerrno) {
+	case POOLERRNO_OK:
+		return "ok";
+	case POOLERRNO_QUEUE_FULL:
+		return "queue is full";
+	case POOLERRNO_OVERLOADED:
+		return "pool is overloaded";
+	case POOLERRNO_CRASHED:
+		return "worker process crashed";
+	case POOLERRNO_SHUTDOWN:
+		return "pool is shutting down";
+	default:
+		return strerror(poolerrno);
+	}
+}
+
+/**
+ * Common implementation of the enqueue calls. When `data` is not NULL the
+ * bytes are copied into the slot and `arg` is ignored.
+ * @param pool The pool to use
+ * @param func The function used for the work item
+ * @param arg The argument to the function, if `data` is NULL
+ * @param data Inline argument bytes, or NULL
+ * @param len Number of bytes in `data`
+ * @param opts Cancellation options, or NULL
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int queue_push(pool_t *pool, void (*func)(void *), void *arg,
+	const void *data, size_t len, const pool_task_opts_t *opts)
+{
+	int rc;
+	int ret;
+	queue_opts_t *qo;
+
+	if (pool == NULL || func == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	/* Allocate before locking, so the mutex only covers the slot */
+	if (queue_opts_new(opts, &qo) < 0)
+		return -1;
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		pool_task_free(qo);
+		poolerrno = rc;
+		return -1;
+	}
+
+	ret = queue_push_locked(pool, func, arg, data, len,
+		opts != NULL ? opts->cancel : NULL, qo);
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	if (ret < 0)
+		pool_task_free(qo);
+
+	return ret;
+}
+
+/**
+ * Body of `queue_push()`. Caller must hold the pool mutex.
+ * @param pool The pool to use
+ * @param func The function used for the work item
+ * @param arg The argument to the function, if `data` is NULL
+ * @param data Inline argument bytes, or NULL
+ * @param len Number of bytes in `data`
+ * @param cancel Cancel callback, or NULL; ignored if `qo` is set
+ * @param qo Options from `queue_opts_new()`, or NULL. The item takes them
+ *   over on success; on error they stay the caller's
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int queue_push_locked(pool_t *pool, void (*func)(void *), void *arg,
+	const void *data, size_t len, void (*cancel)(void *), queue_opts_t *qo)
+{
+	queue_item_t *slot;
+
+	if (pool->status == POOL_STATUS_SHUTDOWN) {
+		poolerrno = POOLERRNO_SHUTDOWN;
+		return -1;
+	}
+
+	if (pool->count + atomic_load_explicit(&pool->nkeyed,
+	                                       memory_order_relaxed) >=
+	    pool->capacity) {
+		pool->nrejected++;
+		poolerrno = POOLERRNO_QUEUE_FULL;
+		return -1;
+	}
+
+	/* While the admission controller is shedding, refuse new work early
+	 * rather than letting it queue up behind work that is already late */
+	if (pool->codel.dropping) {
+		pool->nshed++;
+		poolerrno = POOLERRNO_OVERLOADED;
+		return -1;
+	}
+
+	if ((slot = queue_slot_push(pool)) == NULL) {
+		poolerrno = ENOMEM;
+		return -1;
+	}
+
+	TRACE_EVENT(TRACE_ENQUEUE, pool->nenqueued);
+	pool->nenqueued++;
+
+	slot->func = func;
+	slot->flags = 0;
+	if (data != NULL) {
+		memcpy(slot->data, data, len);
+		slot->flags |= ITEM_INLINE;
+	} else {
+		slot->arg = arg;
+	}
+
+	if (qo != NULL) {
+		slot->opts = qo;
+		slot->flags |= ITEM_OPTS;
+		if (qo->token != NULL)
+			atomic_fetch_add(&qo->token->refs, 1);
+	} else {
+		slot->cancel = cancel;
+	}
+
+	if (pool->codel.target != 0) {
+		slot->enqueued = (uint32_t)(pool_now() / 1000);
+		slot->flags |= ITEM_TIMED;
+	}
+
+	if (++pool->count > pool->queue_peak)
+		pool->queue_peak = pool->count;
+	atomic_store_explicit(&pool->depth, pool->count, memory_order_relaxed);
+
+	/* Tell waiting threads there's something to work on */
+	pthread_cond_signal(&pool->cnd);
+
+	return 0;
+}
+
+/**
+ * Takes a segment off the spare list, or allocates one. Must be called
+ * with the pool mutex held.
+ * @param pool The pool to use
+ * @return Returns the segment, or NULL if it could not be allocated
+ */
+static queue_segment_t *queue_segment_get(pool_t *pool)
+{
+	queue_segment_t *seg;
+
+	if ((seg = pool->spare) != NULL) {
+		pool->spare = seg->next;
+		pool->nspare--;
+	} else if ((seg = (queue_segment_t *)aligned_alloc(
+	                   _Alignof(queue_segment_t), sizeof(*seg))) != NULL) {
+		pool->nsegments++;
+	}
+
+	return seg;
+}
+
+/**
+ * Claims the slot at the tail of the queue, starting a new segment if the
+ * tail one is full. Must be called with the pool mutex held, and only when
+ * the queue is below capacity.
+ * @param pool The pool to use
+ * @return Returns the slot to fill, or NULL if a segment could not be
+ *   allocated
+ */
+static queue_item_t *queue_slot_push(pool_t *pool)
+{
+	queue_segment_t *seg;
+
+	if (pool->tail_seg == NULL || pool->tail_idx == QUEUE_SEGMENT_ITEMS) {
+		if ((seg = queue_segment_get(pool)) == NULL)
+			return NULL;
+		seg->next = NULL;
+
+		if (pool->tail_seg != NULL) {
+			pool->tail_seg->next = seg;
+		} else {
+			pool->head_seg = seg;
+			pool->head_idx = 0;
+		}
+		pool->tail_seg = seg;
+		pool->tail_idx = 0;
+	}
+
+	return &pool->tail_seg->items[pool->tail_idx++];
+}
+
+/**
+ * Takes the slot at the head of the queue. A segment that has been
+ * emptied goes on the spare list; if the queue is now empty, the last
+ * segment is rewound instead so a lightly used queue stays in one
+ * segment. Must be called with the pool mutex held, and only when the
+ * queue is not empty.
+ * @param pool The pool to use
+ * @return Returns the slot, valid until the pool mutex is released
+ */
+static queue_item_t *queue_slot_pop(pool_t *pool)
+{
+	queue_segment_t *seg = pool->head_seg;
+	queue_item_t *slot = &seg->items[pool->head_idx++];
+
+	if (seg == pool->tail_seg && pool->head_idx == pool->tail_idx) {
+		pool->head_idx = 0;
+		pool->tail_idx = 0;
+	} else if (pool->head_idx == QUEUE_SEGMENT_ITEMS) {
+		pool->head_seg = seg->next;
+		pool->head_idx = 0;
+		seg->next = pool->spare;
+		pool->spare = seg;
+		pool->nspare++;
+	}
+
+	return slot;
+}
+
+/**
+ * Claims the slot in front of the head of the queue, for an item going
+ * back to the front. Must be called with the pool mutex held, and only
+ * when the queue is not empty.
+ * @param pool The pool to use
+ * @param seg A segment from `queue_segment_get()`, used and set to NULL if
+ *   the head segment has no room in front
+ * @return Returns the slot to fill
+ */
+static queue_item_t *queue_slot_unpop(pool_t *pool, queue_segment_t **seg)
+{
+	if (pool->head_idx == 0) {
+		(*seg)->next = pool->head_seg;
+		pool->head_seg = *seg;
+		pool->head_idx = QUEUE_SEGMENT_ITEMS;
+		*seg = NULL;
+	}
+
+	return &pool->head_seg->items[--pool->head_idx];
+}
+
+/**
+ * Frees spare segments the queue has not needed lately. Once every
+ * `QUEUE_TRIM_MS` the spares are cut down to what the deepest queue of
+ * the last interval would have used, so a burst keeps its segments while
+ * it lasts and gives them back after. Must be called with the pool mutex
+ * held.
+ * @param pool The pool to use
+ * @param now The current `pool_now()` time
+ */
+static void queue_trim(pool_t *pool, uint64_t now)
+{
+	size_t need;
+	size_t inuse;
+	queue_segment_t *seg;
+
+	if (now - pool->trim_start < (uint64_t)QUEUE_TRIM_MS * 1000000)
+		return;
+
+	need = (pool->queue_peak + QUEUE_SEGMENT_ITEMS - 1) / QUEUE_SEGMENT_ITEMS;
+	inuse = pool->nsegments - pool->nspare;
+	need = need > inuse ? need - inuse : 0;
+
+	while (pool->nspare > need) {
+		seg = pool->spare;
+		pool->spare = seg->next;
+		pool->nspare--;
+		pool->nsegments--;
+		free(seg);
+	}
+
+	pool->trim_start = now;
+	pool->queue_peak = pool->count;
+}
+
+/**
+ * Starts the worker thread for slot `i`, first joining the slot's previous
+ * thread if it retired. Must be called with the pool mutex held, or before
+ * any worker is running.
+ * @param pool The pool to use
+ * @param i The worker slot to start
+ * @return Returns 0 on success, or if the slot is already running. On
+ *   error, less than 0 is returned and `poolerrno` is set.
+ */
+static int worker_spawn(pool_t *pool, size_t i)
+{
+	int rc;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	worker_t *w = &pool->workers[i];
+
+	if (w->state == WORKER_RUNNING)
+		return 0;
+
+	/* A retired thread no longer touches the mutex once it has marked
+	 * itself EXITED, so joining it here cannot deadlock */
+	if (w->state == WORKER_EXITED) {
+		pthread_join(w->thread, NULL);
+		w->state = WORKER_STOPPED;
+	}
+
+	if (w->cache == NULL && (w->cache = alloc_cache_new()) == NULL)
+		return -1;
+
+	if ((rc = pthread_attr_init(&attr)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	/* Unpinned workers inherit the affinity of whoever spawned them */
+	if (pool->cpu_count > 0) {
+		worker_cpus(pool, &cpus);
+		rc = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	if (rc == 0)
+		rc = pthread_create(&w->thread, &attr, worker, (void *)w);
+	pthread_attr_destroy(&attr);
+
+	if (rc != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	w->state = WORKER_RUNNING;
+	pool->nalive++;
+
+	return 0;
+}
+
+/**
+ * Builds the CPU set workers of this pool may run on. Unpinned workers get
+ * the calling thread's own set, pinned ones the allowed CPUs of their
+ * range. Caller must hold the pool mutex.
+ * @param pool The pool to use
+ * @param cpus This variable is filled with the CPU set
+ */
+static void worker_cpus(pool_t *pool, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+
+	if (pool->cpu_count == 0) {
+		if (sched_getaffinity(0, sizeof(*cpus), cpus) < 0)
+			for (size_t c = 0; c < CPU_SETSIZE; c++)
+				CPU_SET(c, cpus);
+		return;
+	}
+
+	for (size_t c = pool->cpu_first; c < pool->cpu_first + pool->cpu_count; c++)
+		if (CPU_ISSET(c, &pool->cpu_allowed))
+			CPU_SET(c, cpus);
+}
+
+/**
+ * Integer square root, for the CoDel control law
+ * @param x The value
+ * @return Returns floor(sqrt(x))
+ */
+static uint32_t isqrt(uint32_t x)
+{
+	uint32_t r = 0;
+	uint32_t bit = 1u << 30;
+
+	while (bit > x)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return r;
+}
+
+/**
+ * The CoDel decision for one dequeued item, following RFC 8289. Must be
+ * called with the pool mutex held.
+ * @param codel The controller state
+ * @param now The current `pool_now()` time
+ * @param sojourn How long the item waited in the queue
+ * @param backlog Items still queued behind this one
+ * @return Returns non-zero if the item should be shed
+ */
+static int codel_shed(codel_t *codel, uint64_t now, uint64_t sojourn,
+	size_t backlog)
+{
+	int ok_to_drop = 0;
+	uint32_t delta;
+
+	/* An empty queue means the workers are keeping up */
+	if (sojourn < codel->target || backlog == 0) {
+		codel->first_above = 0;
+	} else if (codel->first_above == 0) {
+		codel->first_above = now + codel->interval;
+	} else if (now >= codel->first_above) {
+		ok_to_drop = 1;
+	}
+
+	if (codel->dropping) {
+		if (!ok_to_drop) {
+			codel->dropping = 0;
+			return 0;
+		}
+		if (now < codel->drop_next)
+			return 0;
+		codel->drop_count++;
+		codel->drop_next += codel->interval / isqrt(codel->drop_count);
+		return 1;
+	}
+
+	if (!ok_to_drop)
+		return 0;
+
+	/* Re-entering soon after the last state ended: resume near the old
+	 * drop rate instead of starting over */
+	delta = codel->drop_count - codel->last_count;
+	if (delta > 1 && now - codel->drop_next < 16 * codel->interval)
+		codel->drop_count = delta;
+	else
+		codel->drop_count = 1;
+	codel->last_count = codel->drop_count;
+	codel->drop_next = now + codel->interval / isqrt(codel->drop_count);
+	codel->dropping = 1;
+
+	return 1;
+}
+
+/**
+ * Appends a strand to the pool's ready list and wakes a worker for it.
+ * The caller must have set the strand's `scheduled` flag.
+ * @param pool The pool to use
+ * @param strand The strand that has work
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int strand_ready(pool_t *pool, strand_t *strand)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	strand->next = NULL;
+	if (pool->ready_tail != NULL)
+		pool->ready_tail->next = strand;
+	else
+		pool->ready_head = strand;
+	pool->ready_tail = strand;
+
+	pthread_cond_signal(&pool->cnd);
+
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Takes the oldest node off a strand. Only the worker running the strand
+ * may call this. This is the consumer side of Dmitry Vyukov's intrusive
+ * MPSC queue.
+ * @param strand The strand to pop from
+ * @return Returns the node, or NULL if the strand is empty or a producer
+ *   is half way through a push
+ */
+static strand_node_t *strand_pop(strand_t *strand)
+{
+	strand_node_t *head = strand->head;
+	strand_node_t *next;
+	strand_node_t *prev;
+
+	next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+	if (head == &strand->stub) {
+		if (next == NULL)
+			return NULL;
+		strand->head = next;
+		head = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		strand->head = next;
+		return head;
+	}
+
+	if (head != atomic_load(&strand->tail))
+		return NULL;
+
+	/* `head` is the last node. Push the stub behind it so it can go */
+	atomic_store_explicit(&strand->stub.next, NULL, memory_order_relaxed);
+	prev = atomic_exchange(&strand->tail, &strand->stub);
+	atomic_store_explicit(&prev->next, &strand->stub, memory_order_release);
+
+	next = atomic_load_explicit(&head->next, memory_order_acquire);
+	if (next != NULL) {
+		strand->head = next;
+		return head;
+	}
+
+	return NULL;
+}
+
+/**
+ * Runs up to STRAND_BATCH items from a strand on the calling worker, then
+ * either gives the strand up or puts it back on the ready list so other
+ * strands and queue items get a turn. Items whose token was cancelled or
+ * whose deadline passed are skipped, like queue items.
+ * @param self The calling worker
+ * @param strand The strand taken off the ready list
+ * @param ran Incremented for each item run
+ * @param skipped Incremented for each item skipped
+ */
+static void strand_run(worker_t *self, strand_t *strand, size_t *ran,
+	size_t *skipped)
+{
+	pool_t *pool = self->pool;
+	strand_node_t *node;
+	void (*func)(void *);
+	void (*cancel)(void *);
+	void *arg;
+	pool_token_t *token;
+	uint64_t deadline;
+	uint64_t id;
+
+	for (int i = 0; i < STRAND_BATCH; i++) {
+		if ((node = strand_pop(strand)) == NULL)
+			break;
+
+		func = node->func;
+		arg = node->arg;
+		cancel = node->cancel;
+		token = node->token;
+		deadline = node->deadline;
+		id = node->id;
+		pool_task_free(node);
+		atomic_fetch_sub(&pool->nkeyed, 1);
+
+		TRACE_EVENT(TRACE_DEQUEUE, id);
+
+		if (pool_token_is_cancelled(token) ||
+		    (deadline != 0 && pool_now() > deadline)) {
+			if (cancel != NULL)
+				(*cancel)(arg);
+			(*skipped)++;
+		} else {
+			task_token = token;
+			task_deadline = deadline;
+			TRACE_EVENT(TRACE_START, id);
+			worker_watch(self, func);
+			(*func)(arg);
+			worker_watch(self, NULL);
+			TRACE_EVENT(TRACE_END, id);
+			task_token = NULL;
+			task_deadline = 0;
+			(*ran)++;
+		}
+
+		pool_token_free(token);
+		alloc_task_end();
+	}
+
+	/* Still has items, or a producer is mid-push: keep it scheduled */
+	if (atomic_load(&strand->tail) != &strand->stub) {
+		strand_ready(pool, strand);
+		return;
+	}
+
+	/* Empty. Release it, then look again in case a producer pushed after
+	 * our check but saw `scheduled` still set and left it to us */
+	atomic_store(&strand->scheduled, 0);
+	if (atomic_load(&strand->tail) != &strand->stub &&
+	    atomic_exchange(&strand->scheduled, 1) == 0)
+		strand_ready(pool, strand);
+}
+
+/**
+ * The watchdog thread. Looks at the workers a few times per threshold,
+ * so a stall is reported at most a quarter of the threshold late.
+ * @param arg The pool
+ * @return Returns NULL
+ */
+static void *watchdog(void *arg)
+{
+	pool_t *pool = (pool_t *)arg;
+	struct timespec ts;
+	uint64_t wake;
+
+	pthread_mutex_lock(&pool->mtx);
+
+	while (pool->status != POOL_STATUS_SHUTDOWN) {
+		if (pool->watch_threshold == 0) {
+			pthread_cond_wait(&pool->watch_cnd, &pool->mtx);
+			continue;
+		}
+
+		wake = pool_now() + pool->watch_threshold / 4;
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		pthread_cond_timedwait(&pool->watch_cnd, &pool->mtx, &ts);
+
+		if (pool->status != POOL_STATUS_SHUTDOWN &&
+		    pool->watch_threshold != 0)
+			watchdog_scan(pool, pool_now());
+	}
+
+	pthread_mutex_unlock(&pool->mtx);
+
+	return NULL;
+}
+
+/**
+ * Reports workers whose task has run past the threshold, starts their
+ * replacements, and queues duplicates of stalled hedged tasks. Caller
+ * must hold the pool mutex.
+ * @param pool The pool to use
+ * @param now The current `pool_now()` time
+ */
+static void watchdog_scan(pool_t *pool, uint64_t now)
+{
+	pool_hedge_t *h;
+
+	for (size_t i = 0; i < MAX_WORKER_THREADS; i++) {
+		worker_t *w = &pool->workers[i];
+		void (*func)(void *);
+		uint64_t start;
+
+		if (w->state != WORKER_RUNNING)
+			continue;
+
+		/* The slot is written without the mutex; if the start time
+		 * moves while reading, the worker is clearly not stuck */
+		start = atomic_load_explicit(&w->task_start, memory_order_acquire);
+		func = atomic_load_explicit(&w->task_func, memory_order_acquire);
+		if (func == NULL || start == w->stall_start ||
+		    now - start < pool->watch_threshold ||
+		    start != atomic_load_explicit(&w->task_start,
+		                                  memory_order_relaxed))
+			continue;
+
+		w->stall_start = start;
+		pool->nstalls++;
+		LOG(LOG_LEVEL_WARN, "Worker %zu stalled in task %p for %llu ms, "
+			"%zu queued items taken back\n", i, (void *)func,
+			(unsigned long long)(now - start) / 1000000,
+			watchdog_unbatch(pool, w));
+
+		if (!(pool->watch_flags & POOL_WATCHDOG_REPLACE) || w->stalled ||
+		    pool_wanted(pool) == MAX_WORKER_THREADS)
+			continue;
+
+		w->stalled = 1;
+		pool->nstalled++;
+		if (worker_spawn(pool, pool_wanted(pool) - 1) < 0)
+			LOG(LOG_LEVEL_WARN, "Could not replace worker %zu: %s\n", i,
+				poolerrno_str(poolerrno));
+	}
+
+	for (h = pool->hedges; h != NULL; h = h->next) {
+		if (h->hedged || atomic_load(&h->finished) ||
+		    now - h->started < pool->watch_threshold)
+			continue;
+
+		/* The running copy holds a reference, so this one cannot be
+		 * the last to go if the push fails */
+		atomic_fetch_add(&h->refs, 1);
+		if (queue_push_locked(pool, hedge_run, h, NULL, 0, hedge_put,
+		                      NULL) < 0) {
+			atomic_fetch_sub(&h->refs, 1);
+			continue;
+		}
+		h->hedged = 1;
+		pool->nhedged++;
+	}
+}
+
+/**
+ * Runs one copy of a hedged task. The first copy to return takes the
+ * task off the `hedges` list and cancels the token the other one sees.
+ * @param arg The `pool_hedge_t`
+ */
+static void hedge_run(void *arg)
+{
+	pool_hedge_t *h = (pool_hedge_t *)arg;
+	pool_t *pool = h->pool;
+	pool_token_t *token = task_token;
+	void *result;
+	int first;
+
+	/* The other copy already returned */
+	if (atomic_load(&h->finished)) {
+		hedge_put(h);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mtx);
+	if (h->started == 0) {
+		h->started = pool_now();
+		if ((h->next = pool->hedges) != NULL)
+			h->next->pprev = &h->next;
+		h->pprev = &pool->hedges;
+		pool->hedges = h;
+	}
+	pthread_mutex_unlock(&pool->mtx);
+
+	task_token = h->token;
+	result = (*h->func)(h->arg);
+	task_token = token;
+
+	first = atomic_exchange(&h->finished, 1) == 0;
+	if (first) {
+		pool_token_cancel(h->token);
+		pthread_mutex_lock(&pool->mtx);
+		if ((*h->pprev = h->next) != NULL)
+			h->next->pprev = h->pprev;
+		pthread_mutex_unlock(&pool->mtx);
+	}
+
+	(*h->done)(h->arg, result, first);
+	hedge_put(h);
+}
+
+/**
+ * Drops a reference to a hedged task, freeing it with the last one. Also
+ * the cancel callback of its queued copies.
+ * @param arg The `pool_hedge_t`
+ */
+static void hedge_put(void *arg)
+{
+	pool_hedge_t *h = (pool_hedge_t *)arg;
+
+	if (atomic_fetch_sub(&h->refs, 1) == 1) {
+		pool_token_free(h->token);
+		pool_task_free(h);
+	}
+}
+
+/**
+ * Takes back the items a stalled worker dequeued in its batch but has not
+ * started, and puts them at the front of the queue in their old order so
+ * the other workers, or the stalled one's replacement, can run them.
+ * Caller must hold the pool mutex, which keeps the worker from reusing
+ * its batch.
+ * @param pool The pool to use
+ * @param w The stalled worker
+ * @return Returns the number of items put back
+ */
+static size_t watchdog_unbatch(pool_t *pool, worker_t *w)
+{
+	queue_segment_t *seg = NULL;
+	size_t first;
+
+	first = atomic_load_explicit(&w->batch_next, memory_order_relaxed);
+	if (first >= w->nbatch)
+		return 0;
+
+	/* Once claimed, the items cannot be handed back to the worker, so
+	 * the room for them is found first. The worker can only claim more
+	 * meanwhile, which needs less room. */
+	if (pool->count > 0 && pool->head_idx < w->nbatch - first &&
+	    (seg = queue_segment_get(pool)) == NULL)
+		return 0;
+
+	/* Moves the claim point past the end, so the worker stops after the
+	 * item it is running */
+	first = atomic_exchange_explicit(&w->batch_next, POOL_BATCH_MAX,
+		memory_order_relaxed);
+	if (first >= w->nbatch) {
+		first = w->nbatch;
+	} else if (pool->count == 0) {
+		/* An empty queue has been rewound to the start of its segment */
+		pool->head_idx = pool->tail_idx = w->nbatch - first;
+	}
+
+	/* Admission control measured them when they were first dequeued */
+	for (size_t i = w->nbatch; i > first; i--) {
+		queue_item_t *slot = queue_slot_unpop(pool, &seg);
+
+		*slot = w->batch[i - 1];
+		slot->flags = (slot->flags & ~ITEM_TIMED) | ITEM_REQUEUED;
+		slot->enqueued = (uint32_t)w->batch_ids[i - 1];
+	}
+
+	if (seg != NULL) {
+		seg->next = pool->spare;
+		pool->spare = seg;
+		pool->nspare++;
+	}
+
+	pool->count += w->nbatch - first;
+	if (pool->count > pool->queue_peak)
+		pool->queue_peak = pool->count;
+	atomic_store_explicit(&pool->depth, pool->count, memory_order_relaxed);
+	pthread_cond_broadcast(&pool->cnd);
+
+	return w->nbatch - first;
+}
+
+/**
+ * This is a worker thread that acts on the queue. There can be multiple
+ * workers, which is the reason for the mutex locks
+ * @param arg This must be the worker_t entry allocated for this thread
+ * @return @todo Document
+ */
+void *worker(void *arg)
+{
+	int rc;
+	pool_t *pool;
+	worker_t *self;
+	queue_item_t batch[POOL_BATCH_MAX];
+	int drop[POOL_BATCH_MAX];
+	uint64_t ids[POOL_BATCH_MAX];
+	size_t nbatch;
+	size_t idle;
+	strand_t *strand;
+	uint64_t now;
+	size_t ran = 0;
+	size_t skipped = 0;
+	size_t shed = 0;
+	int busy = 0;
+	int turn = 0;
+	int flushed = 0;
+
+	if (arg == NULL) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	self = (worker_t *)arg;
+	pool = self->pool;
+	alloc_cache_bind(self->cache);
+
+	for (;;) {
+		if ((rc = pthread_mutex_lock(&pool->mtx)) != 0) {
+			poolerrno = rc;
+			return NULL;
+		}
+
+		if (busy) {
+			pool->nbusy--;
+			busy = 0;
+		}
+		self->nbatch = 0;
+		/* Back from a stall: retire the replacement */
+		if (self->stalled) {
+			self->stalled = 0;
+			pool->nstalled--;
+			pthread_cond_broadcast(&pool->cnd);
+		}
+		pool->ncompleted += ran;
+		pool->ncancelled += skipped;
+		pool->nshed += shed;
+		ran = 0;
+		skipped = 0;
+		shed = 0;
+
+		while (pool->count == 0 && pool->ready_head == NULL &&
+		       pool->status != POOL_STATUS_SHUTDOWN &&
+		       self->id < pool_wanted(pool)) {
+			/* Going idle: hand back memory freed for other workers,
+			 * outside the lock, then look for work once more */
+			if (!flushed) {
+				flushed = 1;
+				pthread_mutex_unlock(&pool->mtx);
+				alloc_cache_flush();
+				pthread_mutex_lock(&pool->mtx);
+				continue;
+			}
+
+			/* With spares to give back, wake up to trim them even if
+			 * no more work arrives */
+			if (pool->nspare > 0) {
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += QUEUE_TRIM_MS / 1000;
+				rc = pthread_cond_timedwait(&pool->cnd, &pool->mtx, &ts);
+				queue_trim(pool, pool_now());
+			} else {
+				rc = pthread_cond_wait(&pool->cnd, &pool->mtx);
+			}
+			if (rc != 0 && rc != ETIMEDOUT) {
+				poolerrno = rc;
+			}
+		}
+
+		flushed = 0;
 
 		if (pool->status == POOL_STATUS_SHUTDOWN)
 			break;
 
-		item.func = pool->head->func;
-		item.arg = pool->head->arg;
+		/* The pool was shrunk below this worker's slot */
+		if (self->id >= pool_wanted(pool)) {
+			self->state = WORKER_EXITED;
+			pool->nalive--;
+			break;
+		}
+
+		/* Alternate between ready strands and the queue so neither can
+		 * starve the other */
+		turn = !turn;
+		if (pool->ready_head != NULL && (turn || pool->count == 0)) {
+			strand = pool->ready_head;
+			if ((pool->ready_head = strand->next) == NULL)
+				pool->ready_tail = NULL;
+			pool->nbusy++;
+			busy = 1;
+
+			if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+				poolerrno = rc;
+				return NULL;
+			}
 
-		if (++pool->head >= pool->queue + pool->capacity)
-			pool->head = pool->queue;
+			strand_run(self, strand, &ran, &skipped);
+			continue;
+		}
 
-		pool->count--;
+		/* Take a share of the backlog in one go, but leave enough for
+		 * the idle workers that will wake up after us */
+		idle = pool->nalive > pool->nbusy ? pool->nalive - pool->nbusy - 1 : 0;
+		nbatch = pool->count / (idle + 1);
+		if (nbatch < 1)
+			nbatch = 1;
+		if (nbatch > POOL_BATCH_MAX)
+			nbatch = POOL_BATCH_MAX;
+
+		now = pool->codel.target != 0 ? pool_now() : 0;
+
+		for (size_t i = 0; i < nbatch; i++) {
+			queue_item_t *item = &batch[i];
+
+			/* The slot may be reused as soon as the mutex is released,
+			 * so take a private copy, inline argument and all */
+			*item = *queue_slot_pop(pool);
+			pool->count--;
+			ids[i] = item_id(pool, item);
+
+			drop[i] = 0;
+			if (now != 0 && (item->flags & ITEM_TIMED))
+				drop[i] = codel_shed(&pool->codel, now,
+					(uint64_t)((uint32_t)(now / 1000) -
+					           item->enqueued) * 1000,
+					pool->count);
+		}
+
+		atomic_store_explicit(&pool->depth, pool->count,
+			memory_order_relaxed);
+
+		/* Items are claimed one at a time, so that if this worker
+		 * stalls the watchdog can take back the ones not yet started */
+		self->batch = batch;
+		self->batch_ids = ids;
+		self->nbatch = nbatch;
+		atomic_store_explicit(&self->batch_next, 0, memory_order_relaxed);
+
+		if (pool->nspare > 0)
+			queue_trim(pool, now != 0 ? now : pool_now());
+
+		pool->nbusy++;
+		busy = 1;
 
 		if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
 			poolerrno = rc;
 			return NULL;
 		}
 
-		(*item.func)(item.arg);
+		for (;;) {
+			size_t i = atomic_fetch_add_explicit(&self->batch_next, 1,
+				memory_order_relaxed);
+			queue_item_t *item;
+			queue_opts_t *qo;
+
+			if (i >= nbatch)
+				break;
+			item = &batch[i];
+			qo = item_opts(item);
+
+			TRACE_EVENT(TRACE_DEQUEUE, ids[i]);
+
+			/* Nobody wants the answer any more, or admission control is
+			 * shedding it. Skip it, but let the owner release whatever
+			 * the argument holds */
+			if (drop[i]) {
+				item_cancel(item);
+				shed++;
+			} else if (qo != NULL &&
+			    (pool_token_is_cancelled(qo->token) ||
+			     (qo->deadline != 0 && pool_now() > qo->deadline))) {
+				item_cancel(item);
+				skipped++;
+			} else {
+				if (qo != NULL) {
+					task_token = qo->token;
+					task_deadline = qo->deadline;
+				}
+				TRACE_EVENT(TRACE_START, ids[i]);
+				worker_watch(self, item->func);
+				(*item->func)(item_arg(item));
+				worker_watch(self, NULL);
+				TRACE_EVENT(TRACE_END, ids[i]);
+				task_token = NULL;
+				task_deadline = 0;
+				ran++;
+			}
+
+			queue_opts_free(qo);
+			alloc_task_end();
+		}
 	}
 
-	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0) {
+	if ((rc = pthread_mutex_unlock(&pool->mtx)) != 0)
 		poolerrno = rc;
-		return NULL;
-	}
+
+	/* Retiring or shutting down: send what is still pending */
+	alloc_cache_flush();
 
 	return NULL;
 }
@@ -2,6 +2,7 @@
 #define POOL_H_
 
 #include <stdlib.h> /* size_t */
+#include <stdint.h> /* uint64_t */
 #include <limits.h> /* INT_MIN, INT_MAX */
 
 #ifdef __cplusplus
@@ -9,7 +10,36 @@ extern "C" {
 #endif
 
 #define MAX_WORKER_THREADS   16
-#define MAX_QUEUE_CAPACITY   65536
+
+/**
+ * Largest queue capacity. The queue only allocates memory for the items
+ * it actually holds, so this is a sanity limit rather than a cost.
+ */
+#define MAX_QUEUE_CAPACITY   (1 << 24)
+
+/** Queue capacity used when none is given */
+#define DEFAULT_QUEUE_CAPACITY 65536
+
+/**
+ * Number of strands (serial executors) per pool used by
+ * `pool_enqueue_keyed()`. Keys are hashed onto this many strands. Must be
+ * a power of two.
+ */
+#define POOL_STRANDS         1024
+
+/**
+ * The largest argument, in bytes, that `pool_enqueue_inline()` can copy
+ * directly into a queue slot. A slot is the function pointer, a pointer to
+ * the options or the cancel callback, the enqueue time and flags, and this
+ * inline space, so a slot fills exactly one 64-byte cache line.
+ */
+#define POOL_INLINE_ARG_SIZE 40
+
+/**
+ * Flag for `pool_set_watchdog()`: start a temporary extra worker for each
+ * worker stuck in a task, so stalls do not eat into the pool's capacity
+ */
+#define POOL_WATCHDOG_REPLACE 0x1
 
 /**
  * Global error value set by the pool functions, very much like the
@@ -23,6 +53,9 @@ extern int poolerrno;
 typedef enum {
 	POOLERRNO_OK = 0,
 	POOLERRNO_QUEUE_FULL = 1000,
+	POOLERRNO_OVERLOADED = 1001,
+	POOLERRNO_CRASHED = 1002,
+	POOLERRNO_SHUTDOWN = 1003,
 } poolerrno_t;
 
 /**
@@ -32,6 +65,44 @@ typedef enum {
  */
 typedef struct pool pool_t;
 
+/**
+ * Forward declaration of a cancellation token. A token can be shared by
+ * many queued items and cancelled at any time with `pool_token_cancel()`.
+ */
+typedef struct pool_token pool_token_t;
+
+/**
+ * Options for `pool_enqueue_opts()`. Zero-initialize and set what is
+ * needed; every field is optional.
+ */
+typedef struct {
+	uint64_t deadline; /** `pool_now()` time after which to skip the item */
+	pool_token_t *token; /** Skip the item once this token is cancelled */
+	void (*cancel)(void *arg); /** Called with `arg` if the item is skipped */
+} pool_task_opts_t;
+
+/**
+ * A snapshot of a pool's counters, filled by `pool_get_stats()`. The
+ * `n*ed` totals only ever grow.
+ */
+typedef struct {
+	size_t nthreads; /** Number of worker threads configured */
+	size_t nalive; /** Number of worker threads running */
+	size_t nbusy; /** Number of worker threads running a task */
+	size_t capacity; /** Maximum queue depth */
+	size_t count; /** Current queue depth */
+	uint64_t nenqueued; /** Items accepted into the queue */
+	uint64_t ndequeued; /** Items taken off the queue by a worker */
+	uint64_t ncompleted; /** Tasks that have returned */
+	uint64_t ncancelled; /** Items skipped as cancelled or past deadline */
+	uint64_t nshed; /** Items refused or dropped by admission control */
+	uint64_t nrejected; /** Items refused because the queue was full */
+	size_t nsegments; /** Queue segments allocated, spares included */
+	size_t nstalled; /** Workers running a task past the watchdog threshold */
+	uint64_t nstalls; /** Tasks the watchdog has flagged as stalled */
+	uint64_t nhedged; /** Duplicates started for stalled hedged tasks */
+} pool_stats_t;
+
 /*-----------------------*
  * THREAD POOL API CALLS *
  *-----------------------*/
@@ -39,8 +110,46 @@ typedef struct pool pool_t;
 pool_t *pool_init(size_t nthreads, size_t capacity);
 void pool_free(pool_t *pool);
 int pool_enqueue(pool_t *pool, void (*func)(void *), void *arg);
+int pool_enqueue_inline(pool_t *pool, void (*func)(void *),
+	const void *data, size_t len);
+int pool_enqueue_opts(pool_t *pool, void (*func)(void *), void *arg,
+	const pool_task_opts_t *opts);
+int pool_enqueue_inline_opts(pool_t *pool, void (*func)(void *),
+	const void *data, size_t len, const pool_task_opts_t *opts);
+int pool_enqueue_keyed(pool_t *pool, uint64_t key, void (*func)(void *),
+	void *arg);
+int pool_enqueue_keyed_opts(pool_t *pool, uint64_t key, void (*func)(void *),
+	void *arg, const pool_task_opts_t *opts);
+int pool_enqueue_hedged(pool_t *pool, void *(*func)(void *), void *arg,
+	void (*done)(void *arg, void *result, int first));
 int pool_get_queue_count(pool_t *pool, size_t *count);
 int pool_get_queue_capacity(pool_t *pool, size_t *capacity);
+int pool_get_stats(pool_t *pool, pool_stats_t *stats);
+int pool_set_threads(pool_t *pool, size_t nthreads);
+int pool_set_queue_capacity(pool_t *pool, size_t capacity);
+int pool_set_admission(pool_t *pool, unsigned long target_us,
+	unsigned long interval_us);
+int pool_set_affinity(pool_t *pool, size_t first, size_t count);
+int pool_set_watchdog(pool_t *pool, unsigned long threshold_ms, int flags);
+
+/*------------------------*
+ * CANCELLATION API CALLS *
+ *------------------------*/
+
+uint64_t pool_now(void);
+pool_token_t *pool_token_new(void);
+void pool_token_free(pool_token_t *token);
+void pool_token_cancel(pool_token_t *token);
+int pool_token_is_cancelled(const pool_token_t *token);
+int pool_task_cancelled(void);
+
+/*-----------------------*
+ * TASK MEMORY API CALLS *
+ *-----------------------*/
+
+void *pool_task_alloc(size_t size);
+void pool_task_free(void *ptr);
+void *pool_task_arena_alloc(size_t size);
 
 const char *poolerrno_str(int poolerrno);
 
@@ -0,0 +1,671 @@
+#define _GNU_SOURCE /* pthread_mutex_consistent() */
+#include "procpool.h"
+#include "pool.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h> /* O_* */
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/** Longest a waiting process sleeps before it looks around again */
+#define PROCPOOL_WAIT_MS  100
+
+/** How often the parent checks for dead workers */
+#define PROCPOOL_REAP_MS  10
+
+/** How long `procpool_free()` lets a busy worker finish before killing it */
+#define PROCPOOL_KILL_MS  1000
+
+/**
+ * Lifecycle of an arena block
+ */
+typedef enum {
+	BLOCK_FREE = 0, /** On the free list */
+	BLOCK_QUEUED, /** Holds a task waiting in the queue */
+	BLOCK_RUNNING, /** A worker is running the task */
+	BLOCK_DONE, /** Finished, result waiting for the caller */
+	BLOCK_FAILED, /** The worker died, or the pool shut down */
+} block_state_t;
+
+/**
+ * An arena block. Carries one task's argument into a worker and, for
+ * `procpool_call()`, its result back out.
+ */
+typedef struct {
+	uint32_t state; /** One of `block_state_t` */
+	uint32_t waited; /** Non-zero if a caller waits for the result */
+	uint32_t handler; /** Handler id */
+	uint32_t len; /** Argument length */
+	int32_t result; /** Handler return value */
+	uint32_t reserved; /** Keeps `arg` 8-byte aligned */
+	unsigned char arg[PROCPOOL_ARG_SIZE]; /** The argument */
+	unsigned char out[PROCPOOL_ARG_SIZE]; /** The result */
+} pp_block_t;
+
+/**
+ * A worker process slot
+ */
+typedef struct {
+	pid_t pid; /** The process, or 0 */
+	int32_t block; /** Block being run, or -1 */
+} pp_worker_t;
+
+/**
+ * Header of the shared region. It is followed by the queue of arena
+ * offsets, the free list of block indices, and the arena itself.
+ *
+ * Sleeping is done on bare futexes rather than process-shared condition
+ * variables: glibc condition variables keep internal state that a process
+ * killed halfway through a wait or signal leaves locked for everyone else,
+ * whereas a futex word has no owner.
+ */
+typedef struct {
+	pthread_mutex_t mtx; /** Robust, process-shared */
+	atomic_uint work; /** Futex, bumped when a task is queued */
+	atomic_uint done; /** Futex, bumped when a waited-on block finishes */
+	int shutdown; /** Set by `procpool_free()` */
+	size_t capacity; /** Number of blocks, and queue size */
+	size_t head; /** Queue pop point */
+	size_t tail; /** Queue push point */
+	size_t count; /** Current queue depth */
+	size_t nfree; /** Blocks on the free list */
+	uint64_t ncompleted; /** Tasks that returned */
+	uint64_t ncrashed; /** Workers that died outside shutdown */
+	uint64_t nrespawned; /** Workers started to replace them */
+	pp_worker_t workers[PROCPOOL_MAX_PROCS]; /** Worker slots */
+} pp_shm_t;
+
+/**
+ * The process pool struct. Lives in the parent's private memory; the
+ * workers see the copy they were forked with.
+ */
+struct procpool {
+	pp_shm_t *shm; /** The shared region */
+	size_t size; /** Size of the shared region */
+	uint64_t *queue; /** `capacity` arena offsets, in the shared region */
+	uint32_t *freelist; /** `capacity` block indices, in the shared region */
+	unsigned char *arena; /** `capacity` blocks, in the shared region */
+	size_t nprocs; /** Number of worker processes */
+	procpool_fn_t fns[PROCPOOL_MAX_HANDLERS]; /** Handlers, by id */
+	size_t nfns; /** Number of handlers */
+	pid_t parent; /** The parent's pid, for the workers */
+	pthread_t reaper; /** Thread running `pp_reaper()` */
+	int started; /** Set once the workers have been forked */
+	volatile int stop; /** Tells the reaper to exit */
+};
+
+static int pp_lock(pp_shm_t *shm);
+static void pp_wait(pp_shm_t *shm, atomic_uint *seq);
+static void pp_wake(atomic_uint *seq, int n);
+static pp_block_t *pp_enqueue(procpool_t *pp, int handler, const void *arg,
+	size_t len, int waited);
+static int pp_spawn(procpool_t *pp, size_t i);
+static void pp_child(procpool_t *pp, size_t i);
+static void *pp_reaper(void *arg);
+
+/**
+ * Creates a process pool. The shared region is created with shm_open()
+ * and unlinked right away, so only this process and its forked workers
+ * can reach it. Register handlers, then call `procpool_start()`.
+ * @param nprocs The number of worker processes
+ * @param capacity The depth of the queue
+ * @return Returns a `procpool_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+procpool_t *procpool_new(size_t nprocs, size_t capacity)
+{
+	static int seq = 0;
+	char name[64];
+	procpool_t *pp;
+	pp_shm_t *shm;
+	pthread_mutexattr_t ma;
+	size_t qoff;
+	size_t foff;
+	size_t aoff;
+	void *mem;
+	int fd;
+
+	if (nprocs == 0 || nprocs > PROCPOOL_MAX_PROCS || capacity == 0 ||
+	    capacity > PROCPOOL_MAX_CAPACITY) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	pp = (procpool_t *)calloc(1, sizeof(*pp));
+	if (pp == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	qoff = sizeof(pp_shm_t);
+	foff = qoff + capacity * sizeof(uint64_t);
+	aoff = (foff + capacity * sizeof(uint32_t) + 63) & ~(size_t)63;
+	pp->size = aoff + capacity * sizeof(pp_block_t);
+
+	snprintf(name, sizeof(name), "/threadpool-%d-%d", (int)getpid(), seq++);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+		poolerrno = errno;
+		free(pp);
+		return NULL;
+	}
+	shm_unlink(name);
+
+	if (ftruncate(fd, pp->size) < 0) {
+		poolerrno = errno;
+		close(fd);
+		free(pp);
+		return NULL;
+	}
+
+	mem = mmap(NULL, pp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		poolerrno = errno;
+		free(pp);
+		return NULL;
+	}
+
+	pp->shm = shm = (pp_shm_t *)mem;
+	pp->queue = (uint64_t *)((char *)mem + qoff);
+	pp->freelist = (uint32_t *)((char *)mem + foff);
+	pp->arena = (unsigned char *)mem + aoff;
+	pp->nprocs = nprocs;
+	pp->parent = getpid();
+
+	/* A worker may die holding the mutex; robust lets the others go on */
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->mtx, &ma);
+	pthread_mutexattr_destroy(&ma);
+
+	shm->capacity = capacity;
+	shm->nfree = capacity;
+	for (size_t i = 0; i < capacity; i++)
+		pp->freelist[i] = (uint32_t)(capacity - 1 - i);
+	for (size_t i = 0; i < PROCPOOL_MAX_PROCS; i++)
+		shm->workers[i].block = -1;
+
+	return pp;
+}
+
+/**
+ * Registers a handler. Handlers are called by id, since a function
+ * pointer is only meaningful to processes forked from this one, so every
+ * handler must be registered before `procpool_start()`.
+ * @param pp The pool to use
+ * @param fn The handler
+ * @return Returns the handler id on success. On error, less than 0 is
+ *   returned and `poolerrno` is set.
+ */
+int procpool_register(procpool_t *pp, procpool_fn_t fn)
+{
+	if (pp == NULL || fn == NULL || pp->nfns >= PROCPOOL_MAX_HANDLERS) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (pp->started) {
+		poolerrno = EBUSY;
+		return -1;
+	}
+
+	pp->fns[pp->nfns] = fn;
+
+	return (int)pp->nfns++;
+}
+
+/**
+ * Forks the worker processes and starts the thread that replaces the ones
+ * that die. Handlers run in the workers with copies of the parent's memory
+ * as of the fork, and without the parent's other threads; they should not
+ * take locks the parent's threads may have held.
+ * @param pp The pool to use
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int procpool_start(procpool_t *pp)
+{
+	int rc;
+
+	if (pp == NULL || pp->started) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < pp->nprocs; i++)
+		if (pp_spawn(pp, i) < 0)
+			return -1;
+
+	pp->started = 1;
+
+	if ((rc = pthread_create(&pp->reaper, NULL, pp_reaper, pp)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the workers and frees the pool. Queued tasks are dropped and
+ * callers waiting on them get POOLERRNO_CRASHED; no call may still be
+ * waiting when the region is unmapped, so stop the callers first.
+ * @param pp The pool to free
+ */
+void procpool_free(procpool_t *pp)
+{
+	pp_shm_t *shm;
+
+	if (pp == NULL)
+		return;
+
+	shm = pp->shm;
+
+	if (pp->started) {
+		pp->stop = 1;
+		pthread_join(pp->reaper, NULL);
+	}
+
+	pp_lock(shm);
+	shm->shutdown = 1;
+	for (size_t i = 0; i < shm->count; i++) {
+		uint64_t off = pp->queue[(shm->head + i) % shm->capacity];
+		pp_block_t *b = (pp_block_t *)(pp->arena + off);
+
+		b->state = BLOCK_FAILED;
+	}
+	shm->count = 0;
+	pthread_mutex_unlock(&shm->mtx);
+	pp_wake(&shm->work, INT32_MAX);
+	pp_wake(&shm->done, INT32_MAX);
+
+	for (size_t i = 0; i < pp->nprocs; i++) {
+		pid_t pid = shm->workers[i].pid;
+		int waited = 0;
+
+		if (pid <= 0)
+			continue;
+
+		/* Give a busy worker time to finish its task */
+		while (waitpid(pid, NULL, WNOHANG) == 0) {
+			struct timespec ts = { 0, PROCPOOL_REAP_MS * 1000000L };
+
+			if ((waited += PROCPOOL_REAP_MS) > PROCPOOL_KILL_MS) {
+				kill(pid, SIGKILL);
+				waitpid(pid, NULL, 0);
+				break;
+			}
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	pthread_mutex_destroy(&shm->mtx);
+	munmap(pp->shm, pp->size);
+	free(pp);
+}
+
+/**
+ * Queues a task and returns right away
+ * @param pp The pool to use
+ * @param handler The handler id from `procpool_register()`
+ * @param arg The argument, copied into shared memory
+ * @param len Length of `arg`, at most PROCPOOL_ARG_SIZE
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int procpool_submit(procpool_t *pp, int handler, const void *arg, size_t len)
+{
+	return pp_enqueue(pp, handler, arg, len, 0) != NULL ? 0 : -1;
+}
+
+/**
+ * Runs a task in a worker process and waits for its result. If the worker
+ * dies while running it, the call fails with POOLERRNO_CRASHED and the
+ * rest of the server carries on.
+ * @param pp The pool to use
+ * @param handler The handler id from `procpool_register()`
+ * @param arg The argument, copied into shared memory
+ * @param len Length of `arg`, at most PROCPOOL_ARG_SIZE
+ * @param out Buffer for the result
+ * @param outlen Size of `out`
+ * @return Returns the handler's return value. On error, less than 0 is
+ *   returned and `poolerrno` is set; a handler error sets EIO.
+ */
+int procpool_call(procpool_t *pp, int handler, const void *arg, size_t len,
+	void *out, size_t outlen)
+{
+	pp_shm_t *shm;
+	pp_block_t *b;
+	int ret;
+
+	if ((b = pp_enqueue(pp, handler, arg, len, 1)) == NULL)
+		return -1;
+
+	shm = pp->shm;
+	pp_lock(shm);
+
+	while (b->state != BLOCK_DONE && b->state != BLOCK_FAILED)
+		pp_wait(shm, &shm->done);
+
+	if (b->state == BLOCK_FAILED) {
+		poolerrno = POOLERRNO_CRASHED;
+		ret = -1;
+	} else if (b->result < 0) {
+		poolerrno = EIO;
+		ret = -1;
+	} else if ((size_t)b->result > outlen) {
+		poolerrno = E2BIG;
+		ret = -1;
+	} else {
+		memcpy(out, b->out, b->result);
+		ret = b->result;
+	}
+
+	b->state = BLOCK_FREE;
+	pp->freelist[shm->nfree++] = (uint32_t)(((unsigned char *)b - pp->arena) /
+		sizeof(pp_block_t));
+
+	pthread_mutex_unlock(&shm->mtx);
+
+	return ret;
+}
+
+/**
+ * Takes a snapshot of the pool's counters
+ * @param pp The pool to use
+ * @param stats This variable is filled with the counters
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int procpool_get_stats(procpool_t *pp, procpool_stats_t *stats)
+{
+	int rc;
+
+	if (pp == NULL || stats == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((rc = pp_lock(pp->shm)) != 0) {
+		poolerrno = rc;
+		return -1;
+	}
+
+	stats->nprocs = pp->nprocs;
+	stats->capacity = pp->shm->capacity;
+	stats->count = pp->shm->count;
+	stats->ncompleted = pp->shm->ncompleted;
+	stats->ncrashed = pp->shm->ncrashed;
+	stats->nrespawned = pp->shm->nrespawned;
+
+	pthread_mutex_unlock(&pp->shm->mtx);
+
+	return 0;
+}
+
+/**
+ * Locks the shared mutex. If its owner died, the state it protects is
+ * still usable: every critical section only does a few plain stores, and
+ * the dead worker's block is cleaned up by the reaper.
+ * @param shm The shared region
+ * @return Returns 0 on success, else an error number
+ */
+static int pp_lock(pp_shm_t *shm)
+{
+	int rc = pthread_mutex_lock(&shm->mtx);
+
+	if (rc == EOWNERDEAD)
+		rc = pthread_mutex_consistent(&shm->mtx);
+
+	return rc;
+}
+
+/**
+ * Sleeps until `seq` changes, for at most PROCPOOL_WAIT_MS. The shared
+ * mutex must be held; it is released while sleeping. Since `seq` is read
+ * under the mutex, a wakeup sent after the caller checked its condition
+ * cannot be missed.
+ * @param shm The shared region
+ * @param seq The futex word to wait on
+ */
+static void pp_wait(pp_shm_t *shm, atomic_uint *seq)
+{
+	struct timespec ts = { 0, PROCPOOL_WAIT_MS * 1000000L };
+	unsigned int v = atomic_load(seq);
+
+	pthread_mutex_unlock(&shm->mtx);
+	syscall(SYS_futex, seq, FUTEX_WAIT, v, &ts, NULL, 0);
+	pp_lock(shm);
+}
+
+/**
+ * Bumps a futex word and wakes processes sleeping on it
+ * @param seq The futex word
+ * @param n The most sleepers to wake
+ */
+static void pp_wake(atomic_uint *seq, int n)
+{
+	atomic_fetch_add(seq, 1);
+	syscall(SYS_futex, seq, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/**
+ * Copies a task into a free block and queues the block's offset
+ * @return Returns the block, or NULL with `poolerrno` set
+ */
+static pp_block_t *pp_enqueue(procpool_t *pp, int handler, const void *arg,
+	size_t len, int waited)
+{
+	int rc;
+	pp_shm_t *shm;
+	pp_block_t *b;
+	uint32_t idx;
+
+	if (pp == NULL || handler < 0 || (size_t)handler >= pp->nfns ||
+	    (arg == NULL && len > 0) || len > PROCPOOL_ARG_SIZE) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	shm = pp->shm;
+
+	if ((rc = pp_lock(shm)) != 0) {
+		poolerrno = rc;
+		return NULL;
+	}
+
+	if (shm->shutdown) {
+		pthread_mutex_unlock(&shm->mtx);
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	if (shm->nfree == 0) {
+		pthread_mutex_unlock(&shm->mtx);
+		poolerrno = POOLERRNO_QUEUE_FULL;
+		return NULL;
+	}
+
+	idx = pp->freelist[--shm->nfree];
+	b = (pp_block_t *)(pp->arena + (size_t)idx * sizeof(pp_block_t));
+	b->state = BLOCK_QUEUED;
+	b->waited = waited;
+	b->handler = (uint32_t)handler;
+	b->len = (uint32_t)len;
+	b->result = 0;
+	if (len > 0)
+		memcpy(b->arg, arg, len);
+
+	pp->queue[shm->tail] = (uint64_t)idx * sizeof(pp_block_t);
+	shm->tail = (shm->tail + 1) % shm->capacity;
+	shm->count++;
+
+	pthread_mutex_unlock(&shm->mtx);
+	pp_wake(&shm->work, 1);
+
+	return b;
+}
+
+/**
+ * Forks the worker for a slot
+ * @param pp The pool to use
+ * @param i The worker slot
+ * @return Returns 0 on success, else -1 with `poolerrno` set
+ */
+static int pp_spawn(procpool_t *pp, size_t i)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	if (pid == 0)
+		pp_child(pp, i);
+
+	pp_lock(pp->shm);
+	pp->shm->workers[i].pid = pid;
+	pthread_mutex_unlock(&pp->shm->mtx);
+
+	return 0;
+}
+
+/**
+ * A worker process. Pops arena offsets off the shared queue and runs the
+ * handlers on them until the pool shuts down. Never returns.
+ * @param pp The pool, as inherited from the parent
+ * @param i The worker slot
+ */
+static void pp_child(procpool_t *pp, size_t i)
+{
+	pp_shm_t *shm = pp->shm;
+	pp_block_t *b;
+	uint64_t off;
+	uint32_t idx;
+	int res;
+
+	/* The parent decides when workers stop. PR_SET_PDEATHSIG would fire
+	 * when the forking thread exits rather than the parent process, so
+	 * idle workers check for the parent themselves */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	/* A replacement is forked from the running server, so it would hold
+	 * every client and listening socket open and clients would never see
+	 * EOF. The worker only needs the shared region, which is mapped. */
+	log_forked();
+	if (close_range(3, ~0U, 0) < 0) {
+		long max = sysconf(_SC_OPEN_MAX);
+
+		for (int fd = 3; fd < max; fd++)
+			close(fd);
+	}
+
+	for (;;) {
+		pp_lock(shm);
+
+		while (shm->count == 0 && !shm->shutdown &&
+		       getppid() == pp->parent)
+			pp_wait(shm, &shm->work);
+
+		if (shm->shutdown || getppid() != pp->parent) {
+			pthread_mutex_unlock(&shm->mtx);
+			_exit(0);
+		}
+
+		off = pp->queue[shm->head];
+		shm->head = (shm->head + 1) % shm->capacity;
+		shm->count--;
+
+		idx = (uint32_t)(off / sizeof(pp_block_t));
+		b = (pp_block_t *)(pp->arena + off);
+		b->state = BLOCK_RUNNING;
+		shm->workers[i].block = (int32_t)idx;
+
+		pthread_mutex_unlock(&shm->mtx);
+
+		res = pp->fns[b->handler](b->arg, b->len, b->out, sizeof(b->out));
+
+		pp_lock(shm);
+
+		shm->workers[i].block = -1;
+		shm->ncompleted++;
+
+		if (b->waited) {
+			b->result = res;
+			b->state = BLOCK_DONE;
+		} else {
+			b->state = BLOCK_FREE;
+			pp->freelist[shm->nfree++] = idx;
+		}
+
+		pthread_mutex_unlock(&shm->mtx);
+
+		if (b->waited)
+			pp_wake(&shm->done, INT32_MAX);
+	}
+}
+
+/**
+ * The parent's reaper thread. Notices dead workers, releases the block a
+ * dead worker was running, and forks a replacement.
+ * @param arg This must be the `procpool_t` object
+ * @return Always returns NULL
+ */
+static void *pp_reaper(void *arg)
+{
+	procpool_t *pp = (procpool_t *)arg;
+	pp_shm_t *shm = pp->shm;
+	struct timespec ts = { 0, PROCPOOL_REAP_MS * 1000000L };
+	int status;
+
+	while (!pp->stop) {
+		for (size_t i = 0; i < pp->nprocs && !pp->stop; i++) {
+			pid_t pid = shm->workers[i].pid;
+			int32_t idx;
+
+			if (pid <= 0 || waitpid(pid, &status, WNOHANG) != pid)
+				continue;
+
+			pp_lock(shm);
+
+			if ((idx = shm->workers[i].block) >= 0) {
+				pp_block_t *b = (pp_block_t *)(pp->arena +
+					(size_t)idx * sizeof(pp_block_t));
+
+				if (b->waited) {
+					b->state = BLOCK_FAILED;
+				} else {
+					b->state = BLOCK_FREE;
+					pp->freelist[shm->nfree++] = (uint32_t)idx;
+				}
+			}
+
+			shm->workers[i].block = -1;
+			shm->workers[i].pid = 0;
+			shm->ncrashed++;
+			shm->nrespawned++;
+
+			pthread_mutex_unlock(&shm->mtx);
+
+			pp_wake(&shm->done, INT32_MAX);
+			pp_spawn(pp, i);
+		}
+
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
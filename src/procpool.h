@@ -0,0 +1,71 @@
+#ifndef PROCPOOL_H_
+#define PROCPOOL_H_
+
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most worker processes in one process pool */
+#define PROCPOOL_MAX_PROCS    64
+
+/** Most handlers one process pool can hold */
+#define PROCPOOL_MAX_HANDLERS 64
+
+/** Largest queue capacity. Every queued task holds 8 KiB of shared memory */
+#define PROCPOOL_MAX_CAPACITY 4096
+
+/** Largest argument, and largest result, of one task */
+#define PROCPOOL_ARG_SIZE     4096
+
+/**
+ * A task handler. Runs in a worker process, on a copy of the argument in
+ * shared memory, and writes its result, if any, next to it.
+ * @param arg The argument
+ * @param len Length of `arg`
+ * @param out Buffer for the result
+ * @param outlen Size of `out`, PROCPOOL_ARG_SIZE
+ * @return Returns the result length, or less than 0 on error
+ */
+typedef int (*procpool_fn_t)(const void *arg, size_t len, void *out,
+	size_t outlen);
+
+/**
+ * Counters of a process pool
+ */
+typedef struct {
+	size_t nprocs; /** Worker processes wanted */
+	size_t capacity; /** Maximum queue depth */
+	size_t count; /** Current queue depth */
+	uint64_t ncompleted; /** Tasks that returned */
+	uint64_t ncrashed; /** Worker processes that died abnormally */
+	uint64_t nrespawned; /** Worker processes started to replace them */
+} procpool_stats_t;
+
+/**
+ * Forward declaration of the process pool. Its queue and task arguments
+ * live in a shared memory region, and its workers are forked processes,
+ * so a crashing handler only takes down its own worker.
+ */
+typedef struct procpool procpool_t;
+
+/*--------------------*
+ * PROCPOOL API CALLS *
+ *--------------------*/
+
+procpool_t *procpool_new(size_t nprocs, size_t capacity);
+int procpool_register(procpool_t *pp, procpool_fn_t fn);
+int procpool_start(procpool_t *pp);
+void procpool_free(procpool_t *pp);
+int procpool_submit(procpool_t *pp, int handler, const void *arg, size_t len);
+int procpool_call(procpool_t *pp, int handler, const void *arg, size_t len,
+	void *out, size_t outlen);
+int procpool_get_stats(procpool_t *pp, procpool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROCPOOL_H_ */
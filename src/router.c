@@ -0,0 +1,519 @@
+#define JSMN_HEADER /* The jsmn implementation is compiled into main.c */
+#include "router.h"
+#include "pool.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/** Displacements tried per bucket by `router_compile()` before giving up */
+#define ROUTER_MAX_DISPLACE 1000000
+
+/**
+ * A registered handler
+ */
+typedef struct {
+	const char *name; /** Value of the routing field, owned by the router */
+	size_t len; /** Length of `name` */
+	router_handler_t fn; /** The handler */
+	void *ctx; /** Passed to the handler */
+} route_t;
+
+/**
+ * A registered binary handler
+ */
+typedef struct {
+	router_wire_handler_t fn; /** The handler, NULL if the id is free */
+	void *ctx; /** Passed to the handler */
+} wire_route_t;
+
+/**
+ * The router struct
+ */
+struct router {
+	char *field; /** Name of the top-level routing field, e.g. "type" */
+	size_t field_len; /** Length of `field` */
+	route_t *routes; /** Registered handlers, in registration order */
+	size_t nroutes; /** Number of registered handlers */
+	route_t **table; /** Perfect hash table, NULL until compiled */
+	size_t mask; /** Table size minus one, the size is a power of two */
+	uint32_t *disp; /** Displacement per bucket */
+	size_t nbuckets; /** Number of buckets */
+	wire_route_t *wire; /** Binary handlers, indexed by route id */
+};
+
+/**
+ * FNV-1a over the name. Computed once per lookup; the bucket and the slot
+ * are both derived from it.
+ * @param s The bytes to hash
+ * @param len Number of bytes
+ * @return Returns the hash
+ */
+static uint64_t route_hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+/**
+ * Maps a name hash and its bucket's displacement to a table slot
+ * @param h The name hash from `route_hash()`
+ * @param d The bucket's displacement
+ * @param mask Table size minus one
+ * @return Returns the slot
+ */
+static inline size_t route_slot(uint64_t h, uint32_t d, size_t mask)
+{
+	h ^= (uint64_t)d * 0x9E3779B97F4A7C15ull;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+
+	return h & mask;
+}
+
+/**
+ * @return Returns the bucket of a name hash
+ */
+static inline size_t route_bucket(uint64_t h, size_t nbuckets)
+{
+	return (h >> 32) % nbuckets;
+}
+
+/**
+ * Allocates a router that dispatches on a top-level string field
+ * @param field Name of the field, e.g. "type"
+ * @return Returns a `router_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+router_t *router_new(const char *field)
+{
+	router_t *router;
+
+	if (field == NULL || *field == '\0') {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	router = (router_t *)calloc(1, sizeof(*router));
+	if (router == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	router->field_len = strlen(field);
+	router->field = strdup(field);
+	router->routes = (route_t *)calloc(ROUTER_MAX_ROUTES,
+		sizeof(*router->routes));
+	router->wire = (wire_route_t *)calloc(ROUTER_MAX_WIRE_ROUTES,
+		sizeof(*router->wire));
+	if (router->field == NULL || router->routes == NULL ||
+	    router->wire == NULL) {
+		router_free(router);
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	return router;
+}
+
+/**
+ * Frees a router and everything it owns
+ * @param router The router, may be NULL
+ */
+void router_free(router_t *router)
+{
+	if (router == NULL)
+		return;
+
+	for (size_t i = 0; i < router->nroutes; i++)
+		free((char *)router->routes[i].name);
+
+	free(router->routes);
+	free(router->wire);
+	free(router->table);
+	free(router->disp);
+	free(router->field);
+	free(router);
+}
+
+/**
+ * Registers a handler for messages whose routing field equals `name`.
+ * Must be called before `router_compile()`.
+ * @param router The router
+ * @param name The field value to route on
+ * @param fn The handler
+ * @param ctx Passed to the handler
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int router_add(router_t *router, const char *name, router_handler_t fn,
+	void *ctx)
+{
+	route_t *r;
+
+	if (router == NULL || name == NULL || fn == NULL ||
+	    router->table != NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (router->nroutes == ROUTER_MAX_ROUTES) {
+		poolerrno = ENOSPC;
+		return -1;
+	}
+
+	for (size_t i = 0; i < router->nroutes; i++) {
+		if (strcmp(router->routes[i].name, name) == 0) {
+			poolerrno = EEXIST;
+			return -1;
+		}
+	}
+
+	r = &router->routes[router->nroutes];
+	if ((r->name = strdup(name)) == NULL) {
+		poolerrno = ENOMEM;
+		return -1;
+	}
+	r->len = strlen(name);
+	r->fn = fn;
+	r->ctx = ctx;
+	router->nroutes++;
+
+	return 0;
+}
+
+/**
+ * Registers a handler for binary frames with route id `type`. Ids index a
+ * flat table, so they should be small and dense. Must be called before
+ * `router_compile()`.
+ * @param router The router
+ * @param type The route id
+ * @param fn The handler
+ * @param ctx Passed to the handler
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int router_add_wire(router_t *router, uint16_t type,
+	router_wire_handler_t fn, void *ctx)
+{
+	if (router == NULL || fn == NULL || router->table != NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (type >= ROUTER_MAX_WIRE_ROUTES) {
+		poolerrno = ERANGE;
+		return -1;
+	}
+
+	if (router->wire[type].fn != NULL) {
+		poolerrno = EEXIST;
+		return -1;
+	}
+
+	router->wire[type].fn = fn;
+	router->wire[type].ctx = ctx;
+
+	return 0;
+}
+
+/**
+ * Freezes the registered names into a perfect hash table using hash and
+ * displace: names are split into small buckets, and each bucket, largest
+ * first, gets the first displacement that sends all its names to free
+ * slots. A lookup is then two cheap mixes and one compare, no matter how
+ * many routes exist.
+ * @param router The router
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int router_compile(router_t *router)
+{
+	route_t **table;
+	uint32_t *disp;
+	size_t *order;
+	size_t *count;
+	size_t nb;
+	size_t size = 1;
+
+	if (router == NULL || router->table != NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	/* A load factor of at most one half keeps the search short */
+	while (size < 2 * router->nroutes)
+		size <<= 1;
+	nb = router->nroutes / 2 + 1;
+
+	table = (route_t **)calloc(size, sizeof(*table));
+	disp = (uint32_t *)calloc(nb, sizeof(*disp));
+	order = (size_t *)calloc(nb, sizeof(*order));
+	count = (size_t *)calloc(nb, sizeof(*count));
+	if (table == NULL || disp == NULL || order == NULL || count == NULL) {
+		free(table);
+		free(disp);
+		free(order);
+		free(count);
+		poolerrno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t i = 0; i < router->nroutes; i++) {
+		route_t *r = &router->routes[i];
+		count[route_bucket(route_hash(r->name, r->len), nb)]++;
+	}
+
+	/* Largest buckets first; insertion sort is fine at startup */
+	for (size_t i = 0; i < nb; i++) {
+		size_t j = i;
+		while (j > 0 && count[order[j - 1]] < count[i]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	for (size_t k = 0; k < nb && count[order[k]] > 0; k++) {
+		size_t b = order[k];
+		uint32_t d;
+
+		for (d = 0; d < ROUTER_MAX_DISPLACE; d++) {
+			size_t i;
+
+			for (i = 0; i < router->nroutes; i++) {
+				route_t *r = &router->routes[i];
+				uint64_t h = route_hash(r->name, r->len);
+				size_t slot;
+
+				if (route_bucket(h, nb) != b)
+					continue;
+				slot = route_slot(h, d, size - 1);
+				if (table[slot] != NULL)
+					break;
+				table[slot] = r;
+			}
+			if (i == router->nroutes)
+				break;
+
+			/* Collision: take back this bucket's names and retry */
+			for (size_t j = 0; j < size; j++) {
+				route_t *r = table[j];
+				if (r != NULL &&
+				    route_bucket(route_hash(r->name, r->len), nb) == b)
+					table[j] = NULL;
+			}
+		}
+
+		if (d == ROUTER_MAX_DISPLACE) {
+			free(table);
+			free(disp);
+			free(order);
+			free(count);
+			poolerrno = EAGAIN;
+			return -1;
+		}
+		disp[b] = d;
+	}
+
+	free(order);
+	free(count);
+
+	router->table = table;
+	router->mask = size - 1;
+	router->disp = disp;
+	router->nbuckets = nb;
+
+	return 0;
+}
+
+/**
+ * Skips a JSON string starting at its opening quote
+ * @param js The text
+ * @param len Length of `js`
+ * @param i Index of the opening quote
+ * @return Returns the index of the closing quote, or `len` if unterminated
+ */
+static size_t skip_string(const char *js, size_t len, size_t i)
+{
+	for (i++; i < len; i++) {
+		if (js[i] == '\\')
+			i++;
+		else if (js[i] == '"')
+			return i;
+	}
+
+	return len;
+}
+
+/**
+ * Finds the string value of a top-level field without tokenizing the
+ * message. Nested objects and arrays are skipped by tracking depth only.
+ * @param js The text
+ * @param len Length of `js`
+ * @param field The field name
+ * @param flen Length of `field`
+ * @param vlen Set to the length of the value
+ * @return Returns a pointer to the value, or NULL if not found
+ */
+static const char *find_field(const char *js, size_t len, const char *field,
+	size_t flen, size_t *vlen)
+{
+	int depth = 0;
+	int want_key = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		switch (js[i]) {
+		case '{':
+			if (++depth == 1)
+				want_key = 1;
+			break;
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (--depth == 0)
+				return NULL;
+			break;
+		case ',':
+			if (depth == 1)
+				want_key = 1;
+			break;
+		case '"': {
+			size_t end = skip_string(js, len, i);
+			size_t j;
+
+			if (depth != 1 || !want_key) {
+				i = end;
+				break;
+			}
+			want_key = 0;
+
+			if (end - i - 1 != flen || memcmp(js + i + 1, field, flen) != 0) {
+				i = end;
+				break;
+			}
+
+			/* Matched the key; expect `: "value"` */
+			for (j = end + 1; j < len && js[j] != ':'; j++)
+				;
+			for (j++; j < len && (js[j] == ' ' || js[j] == '\t' ||
+			     js[j] == '\r' || js[j] == '\n'); j++)
+				;
+			if (j >= len || js[j] != '"')
+				return NULL;
+			end = skip_string(js, len, j);
+			if (end >= len)
+				return NULL;
+			*vlen = end - j - 1;
+			return js + j + 1;
+		}
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Routes a message to the handler registered for its routing field. The
+ * field is located with a quick scan and looked up in the perfect hash,
+ * and only then is the message tokenized for the handler, so messages
+ * without a handler are rejected without a parse.
+ * @param router A compiled router
+ * @param js The JSON text
+ * @param len Length of `js`
+ * @param out Buffer for the handler's reply
+ * @param outlen Size of `out`
+ * @return Returns what the handler returned, normally the reply length.
+ *   On error, less than 0 is returned and `poolerrno` is set: ENOENT if
+ *   there is no routing field or no handler for it, EINVAL if the message
+ *   is not valid JSON.
+ */
+int router_dispatch(router_t *router, const char *js, size_t len, char *out,
+	size_t outlen)
+{
+	jsmn_parser parser;
+	jsmntok_t toks[ROUTER_MAX_TOKENS];
+	router_msg_t msg;
+	const char *type;
+	size_t type_len;
+	route_t *r;
+	uint64_t h;
+	int n;
+
+	if (router == NULL || router->table == NULL || js == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	type = find_field(js, len, router->field, router->field_len, &type_len);
+	if (type == NULL) {
+		poolerrno = ENOENT;
+		return -1;
+	}
+
+	h = route_hash(type, type_len);
+	r = router->table[route_slot(h,
+		router->disp[route_bucket(h, router->nbuckets)], router->mask)];
+	if (r == NULL || r->len != type_len || memcmp(r->name, type, type_len)) {
+		poolerrno = ENOENT;
+		return -1;
+	}
+
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, js, len, toks, ROUTER_MAX_TOKENS);
+	if (n < 1 || toks[0].type != JSMN_OBJECT) {
+		poolerrno = n == JSMN_ERROR_NOMEM ? E2BIG : EINVAL;
+		return -1;
+	}
+
+	msg.js = js;
+	msg.len = len;
+	msg.toks = toks;
+	msg.ntoks = n;
+	msg.type = type;
+	msg.type_len = type_len;
+
+	return r->fn(&msg, out, outlen, r->ctx);
+}
+
+/**
+ * Routes a binary frame to the handler registered for its route id. The
+ * id sits at a fixed offset and indexes the handler table directly, and
+ * the body is handed over in place, so there is nothing to scan, hash or
+ * tokenize.
+ * @param router A compiled router
+ * @param msg The frame, from `wire_parse()`
+ * @param out Buffer for the handler's reply body
+ * @param outlen Size of `out`
+ * @return Returns what the handler returned, normally the body length.
+ *   On error, less than 0 is returned and `poolerrno` is set: ENOENT if
+ *   there is no handler for the id.
+ */
+int router_dispatch_wire(router_t *router, const wire_msg_t *msg, void *out,
+	size_t outlen)
+{
+	wire_route_t *r;
+
+	if (router == NULL || router->table == NULL || msg == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (msg->type >= ROUTER_MAX_WIRE_ROUTES ||
+	    (r = &router->wire[msg->type])->fn == NULL) {
+		poolerrno = ENOENT;
+		return -1;
+	}
+
+	return r->fn(msg, out, outlen, r->ctx);
+}
@@ -0,0 +1,77 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include "jsmn.h"
+#include "wire.h"
+#include <stdlib.h> /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most tokens a routed message may contain */
+#define ROUTER_MAX_TOKENS 256
+
+/** Most handlers a single router can hold */
+#define ROUTER_MAX_ROUTES 1024
+
+/** Binary route ids run from 0 to ROUTER_MAX_WIRE_ROUTES - 1 */
+#define ROUTER_MAX_WIRE_ROUTES 1024
+
+/**
+ * A message handed to a route handler. The message has already been
+ * tokenized, so handlers can walk `toks` without parsing again.
+ */
+typedef struct {
+	const char *js; /** The raw JSON text */
+	size_t len; /** Length of `js` */
+	const jsmntok_t *toks; /** Tokens from jsmn_parse(), toks[0] is the object */
+	int ntoks; /** Number of tokens */
+	const char *type; /** The routing field's value, not NUL terminated */
+	size_t type_len; /** Length of `type` */
+} router_msg_t;
+
+/**
+ * A route handler. Writes its reply, if any, to `out`.
+ * @return Returns the number of bytes written to `out`, or less than 0 on
+ *   error
+ */
+typedef int (*router_handler_t)(const router_msg_t *msg, char *out,
+	size_t outlen, void *ctx);
+
+/**
+ * A binary route handler. Writes its reply body, if any, to `out`; the
+ * caller frames it.
+ * @return Returns the number of bytes written to `out`, or less than 0 on
+ *   error
+ */
+typedef int (*router_wire_handler_t)(const wire_msg_t *msg, void *out,
+	size_t outlen, void *ctx);
+
+/**
+ * Forward declaration of the router type. Handlers are registered with
+ * `router_add()` and then frozen into a perfect hash by `router_compile()`.
+ */
+typedef struct router router_t;
+
+/*------------------*
+ * ROUTER API CALLS *
+ *------------------*/
+
+router_t *router_new(const char *field);
+void router_free(router_t *router);
+int router_add(router_t *router, const char *name, router_handler_t fn,
+	void *ctx);
+int router_add_wire(router_t *router, uint16_t type,
+	router_wire_handler_t fn, void *ctx);
+int router_compile(router_t *router);
+int router_dispatch(router_t *router, const char *js, size_t len, char *out,
+	size_t outlen);
+int router_dispatch_wire(router_t *router, const wire_msg_t *msg, void *out,
+	size_t outlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ROUTER_H_ */
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np() */
+#include "shard.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> /* close() */
+#include <pthread.h>
+#include <sched.h> /* cpu_set_t */
+#include <signal.h>
+#include <sys/socket.h>
+#include <arpa/inet.h> /* htons() */
+
+/** Listen backlog of each shard's socket */
+#define SHARD_BACKLOG 128
+
+/**
+ * One shard: a listening socket and the pool its connections go to
+ */
+typedef struct {
+	shard_set_t *set; /** The set this shard belongs to */
+	pool_t *pool; /** Pool serving this shard's connections */
+	int sfd; /** Listening socket, bound with SO_REUSEPORT */
+	pthread_t thread; /** Thread running `shard_loop()` */
+	int running; /** Set once `thread` has been created */
+	size_t cpu_first; /** First CPU of this shard */
+	size_t cpu_count; /** Width of its CPU range, holes included */
+} shard_t;
+
+/**
+ * The shard set struct
+ */
+struct shard_set {
+	shard_t *shards; /** `nshards` shards */
+	size_t nshards; /** Number of shards */
+	shard_accept_t fn; /** Connection callback */
+	void *ctx; /** Passed to `fn` */
+	volatile int stop; /** Set by `shard_stop()` */
+};
+
+static size_t shard_cpu(const cpu_set_t *allowed, size_t n);
+static int shard_listen(shard_t *shard, int port);
+static void *shard_loop(void *arg);
+
+/**
+ * Starts `nshards` shards listening on the same port. Every shard binds
+ * its own socket with SO_REUSEPORT, so the kernel spreads incoming
+ * connections over the shards and no accept lock or queue is shared
+ * between them. The CPUs this process may run on, which in a container may
+ * be only some of the online ones, are split evenly between the shards,
+ * and each shard's acceptor and workers are pinned to its part.
+ *
+ * The shard threads block all signals, so signals keep going to the
+ * calling thread.
+ * @param nshards The number of shards, or 0 for one per usable CPU
+ * @param port The TCP port to listen on
+ * @param nthreads The number of worker threads of each shard's pool
+ * @param capacity The queue capacity of each shard's pool
+ * @param fn Called for every accepted connection
+ * @param ctx Passed to `fn`
+ * @return Returns a `shard_set_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+shard_set_t *shard_start(size_t nshards, int port, size_t nthreads,
+	size_t capacity, shard_accept_t fn, void *ctx)
+{
+	int rc = 0;
+	size_t ncpus;
+	size_t per;
+	shard_set_t *set;
+	cpu_set_t allowed;
+	sigset_t all;
+	sigset_t old;
+
+	if (port <= 0 || port > 65535 || fn == NULL) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 ||
+	    CPU_COUNT(&allowed) == 0) {
+		CPU_ZERO(&allowed);
+		CPU_SET(0, &allowed);
+	}
+	ncpus = (size_t)CPU_COUNT(&allowed);
+	if (nshards == 0)
+		nshards = ncpus;
+	per = ncpus / nshards > 0 ? ncpus / nshards : 1;
+
+	set = (shard_set_t *)calloc(1, sizeof(*set));
+	if (set == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	set->shards = (shard_t *)calloc(nshards, sizeof(*set->shards));
+	if (set->shards == NULL) {
+		free(set);
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	set->nshards = nshards;
+	set->fn = fn;
+	set->ctx = ctx;
+
+	for (size_t i = 0; i < nshards; i++) {
+		set->shards[i].set = set;
+		set->shards[i].sfd = -1;
+	}
+
+	/* Workers and acceptors inherit this mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (size_t i = 0; i < nshards; i++) {
+		shard_t *shard = &set->shards[i];
+		pthread_attr_t attr;
+		cpu_set_t cpus;
+
+		size_t first;
+		size_t count;
+
+		/* Shards get runs of the usable CPUs, which need not be
+		 * numbered contiguously. More shards than CPUs wrap around and
+		 * share */
+		first = (i * per) % ncpus;
+		count = first + per > ncpus ? ncpus - first : per;
+		shard->cpu_first = shard_cpu(&allowed, first);
+		shard->cpu_count = shard_cpu(&allowed, first + count - 1) -
+			shard->cpu_first + 1;
+
+		if ((shard->pool = pool_init(nthreads, capacity)) == NULL ||
+		    pool_set_affinity(shard->pool, shard->cpu_first,
+		                      shard->cpu_count) < 0 ||
+		    shard_listen(shard, port) < 0) {
+			rc = -1;
+			break;
+		}
+
+		if ((rc = pthread_attr_init(&attr)) != 0) {
+			poolerrno = rc;
+			rc = -1;
+			break;
+		}
+
+		CPU_ZERO(&cpus);
+		for (size_t c = 0; c < shard->cpu_count; c++)
+			if (CPU_ISSET(shard->cpu_first + c, &allowed))
+				CPU_SET(shard->cpu_first + c, &cpus);
+
+		rc = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		if (rc == 0)
+			rc = pthread_create(&shard->thread, &attr, shard_loop, shard);
+		pthread_attr_destroy(&attr);
+
+		if (rc != 0) {
+			poolerrno = rc;
+			rc = -1;
+			break;
+		}
+
+		shard->running = 1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rc < 0) {
+		int err = poolerrno;
+		shard_stop(set);
+		poolerrno = err;
+		return NULL;
+	}
+
+	return set;
+}
+
+/**
+ * @param set The shard set
+ * @return Returns the number of shards
+ */
+size_t shard_count(const shard_set_t *set)
+{
+	return set != NULL ? set->nshards : 0;
+}
+
+/**
+ * Gets a shard's pool, e.g. to configure or monitor it
+ * @param set The shard set
+ * @param i The shard index, less than `shard_count()`
+ * @return Returns the pool, or NULL with `poolerrno` set if `i` is out of
+ *   range
+ */
+pool_t *shard_pool(const shard_set_t *set, size_t i)
+{
+	if (set == NULL || i >= set->nshards) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	return set->shards[i].pool;
+}
+
+/**
+ * Stops accepting on every shard, waits for the acceptor threads, then
+ * frees the pools
+ * @param set The shard set to stop
+ */
+void shard_stop(shard_set_t *set)
+{
+	if (set == NULL)
+		return;
+
+	set->stop = 1;
+
+	/* Wakes the acceptors out of accept() */
+	for (size_t i = 0; i < set->nshards; i++)
+		if (set->shards[i].sfd >= 0)
+			shutdown(set->shards[i].sfd, SHUT_RDWR);
+
+	for (size_t i = 0; i < set->nshards; i++) {
+		shard_t *shard = &set->shards[i];
+
+		if (shard->running)
+			pthread_join(shard->thread, NULL);
+		if (shard->sfd >= 0)
+			close(shard->sfd);
+		if (shard->pool != NULL)
+			pool_free(shard->pool);
+	}
+
+	free(set->shards);
+	free(set);
+}
+
+/**
+ * @param allowed The CPUs the process may run on
+ * @param n Index into the allowed CPUs, less than their number
+ * @return Returns the number of the `n`th allowed CPU
+ */
+static size_t shard_cpu(const cpu_set_t *allowed, size_t n)
+{
+	size_t c;
+
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, allowed) && n-- == 0)
+			break;
+
+	return c;
+}
+
+/**
+ * Creates a shard's listening socket
+ * @param shard The shard
+ * @param port The TCP port to listen on
+ * @return Returns 0 on success, else -1 with `poolerrno` set
+ */
+static int shard_listen(shard_t *shard, int port)
+{
+	int on = 1;
+	struct sockaddr_in sa;
+
+	if ((shard->sfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = INADDR_ANY;
+
+	if (setsockopt(shard->sfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+	    bind(shard->sfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(shard->sfd, SHARD_BACKLOG) < 0) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * A shard's acceptor thread
+ * @param arg This must be the `shard_t` object
+ * @return Always returns NULL
+ */
+static void *shard_loop(void *arg)
+{
+	shard_t *shard = (shard_t *)arg;
+	shard_set_t *set = shard->set;
+	struct sockaddr_in ca;
+	socklen_t calen;
+	int cfd;
+
+	while (!set->stop) {
+		calen = sizeof(ca);
+
+		if ((cfd = accept(shard->sfd, (struct sockaddr *)&ca, &calen)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (!set->stop)
+				LOG(LOG_LEVEL_ERROR, "accept() failed: %s\n", strerror(errno));
+			break;
+		}
+
+		set->fn(shard->pool, cfd, &ca, set->ctx);
+	}
+
+	return NULL;
+}
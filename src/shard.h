@@ -0,0 +1,44 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include "pool.h"
+#include <netinet/in.h> /* sockaddr_in */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Forward declaration of a shard set. Each shard has its own listening
+ * socket, acceptor thread and pool, with its threads pinned to its own
+ * CPUs, so a connection is accepted and served without touching any
+ * other shard's state.
+ */
+typedef struct shard_set shard_set_t;
+
+/**
+ * Called on a shard's acceptor thread for every accepted connection. The
+ * callback owns `cfd` and normally enqueues it on `pool`.
+ * @param pool The pool of the shard that accepted the connection
+ * @param cfd The connected socket
+ * @param ca The peer address
+ * @param ctx The `ctx` passed to `shard_start()`
+ */
+typedef void (*shard_accept_t)(pool_t *pool, int cfd,
+	const struct sockaddr_in *ca, void *ctx);
+
+/*-----------------*
+ * SHARD API CALLS *
+ *-----------------*/
+
+shard_set_t *shard_start(size_t nshards, int port, size_t nthreads,
+	size_t capacity, shard_accept_t fn, void *ctx);
+size_t shard_count(const shard_set_t *set);
+pool_t *shard_pool(const shard_set_t *set, size_t i);
+void shard_stop(shard_set_t *set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHARD_H_ */
@@ -0,0 +1,542 @@
+#include "spill.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/** How long the refill thread waits before retrying a full pool, in ms */
+#define SPILL_RETRY_MS 1
+
+/** Records are padded to this alignment within a segment */
+#define SPILL_ALIGN 8
+
+/**
+ * A record in a segment file, followed by `len` argument bytes
+ */
+typedef struct {
+	uint32_t len; /** Argument length */
+	uint32_t handler; /** Handler id from `spill_register()` */
+} spill_record_t;
+
+/**
+ * A segment file. Only the tail segment is written to; once it is full it
+ * is sealed and unmapped, and mapped again when the reader gets to it.
+ */
+typedef struct spill_segment {
+	struct spill_segment *next; /** Next newer segment */
+	uint64_t seq; /** Sequence number, part of the file name */
+	unsigned char *map; /** The mapping, or NULL while not in use */
+	size_t wpos; /** End of the records written */
+	size_t rpos; /** Start of the next record to read */
+	size_t count; /** Records not read yet */
+	int sealed; /** Non-zero once nothing more will be written */
+} spill_segment_t;
+
+/**
+ * A task on its way from the spill queue through the pool. It carries the
+ * handler itself, so the pool may run it after the spill queue is gone.
+ */
+typedef struct {
+	spill_fn_t fn; /** The handler */
+	size_t len; /** Argument length */
+	unsigned char data[]; /** The argument */
+} spill_task_t;
+
+/**
+ * The spill queue struct
+ */
+struct spill {
+	pool_t *pool; /** The pool tasks run on */
+	char dir[PATH_MAX - 32]; /** Directory holding the segment files */
+	size_t segment_bytes; /** Size of each segment file */
+	uint64_t max_bytes; /** Most bytes of segment files at once */
+	spill_fn_t handlers[SPILL_MAX_HANDLERS]; /** Registered handlers */
+	int nhandlers; /** Number of registered handlers */
+	pthread_t thread; /** The refill thread */
+	pthread_mutex_t mtx; /** Protects everything below */
+	pthread_cond_t cnd; /** Wakes the refill thread */
+	int stopping; /** Set by `spill_free()` */
+	spill_segment_t *head; /** Oldest segment, read from */
+	spill_segment_t *tail; /** Newest segment, written to */
+	uint64_t next_seq; /** Sequence number of the next segment */
+	spill_stats_t stats; /** Counters; `pending`, `bytes`, `nsegments` live */
+};
+
+static int spill_push(spill_t *s, int handler, const void *arg, size_t len);
+static int spill_append(spill_t *s, int handler, const void *arg,
+	size_t len);
+static spill_segment_t *segment_open(spill_t *s);
+static int segment_map(spill_t *s, spill_segment_t *seg, int create);
+static void segment_release(spill_t *s, spill_segment_t *seg);
+static void segment_path(spill_t *s, uint64_t seq, char *buf, size_t size);
+static void *spill_loop(void *arg);
+static void spill_run(void *arg);
+
+/**
+ * Creates a spill queue for a pool. While the pool has room, tasks go
+ * straight to it. Once it is full, tasks are appended to memory-mapped
+ * segment files in `dir`, and a refill thread feeds them back to the pool
+ * as room frees up. While anything is on disk, new tasks queue behind it,
+ * so tasks run in the order they were enqueued. Both the writes and the
+ * reads are sequential.
+ * @param pool The pool tasks run on
+ * @param dir Directory for the segment files, which must exist
+ * @param segment_bytes Size of each segment file
+ * @param max_bytes Most bytes of segment files at once
+ * @return Returns a `spill_t` object on success. On error, NULL is
+ *   returned and `poolerrno` is set.
+ */
+spill_t *spill_new(pool_t *pool, const char *dir, size_t segment_bytes,
+	uint64_t max_bytes)
+{
+	int rc;
+	spill_t *s;
+
+	if (pool == NULL || dir == NULL || segment_bytes < 4096 ||
+	    segment_bytes > UINT32_MAX || max_bytes < segment_bytes) {
+		poolerrno = EINVAL;
+		return NULL;
+	}
+
+	s = (spill_t *)calloc(1, sizeof(*s));
+	if (s == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	if (snprintf(s->dir, sizeof(s->dir), "%s", dir) >= (int)sizeof(s->dir)) {
+		free(s);
+		poolerrno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	s->pool = pool;
+	s->segment_bytes = segment_bytes;
+	s->max_bytes = max_bytes;
+
+	pthread_mutex_init(&s->mtx, NULL);
+	pthread_cond_init(&s->cnd, NULL);
+
+	if ((rc = pthread_create(&s->thread, NULL, spill_loop, s)) != 0) {
+		pthread_cond_destroy(&s->cnd);
+		pthread_mutex_destroy(&s->mtx);
+		free(s);
+		poolerrno = rc;
+		return NULL;
+	}
+
+	return s;
+}
+
+/**
+ * Stops the refill thread and frees the spill queue. Tasks still on disk
+ * are discarded and their segment files removed; tasks already handed to
+ * the pool are the pool's.
+ * @param s The spill queue, or NULL
+ */
+void spill_free(spill_t *s)
+{
+	if (s == NULL)
+		return;
+
+	pthread_mutex_lock(&s->mtx);
+	s->stopping = 1;
+	pthread_cond_signal(&s->cnd);
+	pthread_mutex_unlock(&s->mtx);
+
+	pthread_join(s->thread, NULL);
+
+	while (s->head != NULL)
+		segment_release(s, s->head);
+
+	pthread_cond_destroy(&s->cnd);
+	pthread_mutex_destroy(&s->mtx);
+	free(s);
+}
+
+/**
+ * Registers a handler. Handler ids are written to disk, so every process
+ * that shares a spill directory's format must register the same handlers
+ * in the same order.
+ * @param s The spill queue
+ * @param fn The handler
+ * @return Returns the handler id on success. On error, less than 0 is
+ *   returned and `poolerrno` is set.
+ */
+int spill_register(spill_t *s, spill_fn_t fn)
+{
+	int id;
+
+	if (s == NULL || fn == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+	if (s->nhandlers >= SPILL_MAX_HANDLERS) {
+		pthread_mutex_unlock(&s->mtx);
+		poolerrno = ENOSPC;
+		return -1;
+	}
+	id = s->nhandlers;
+	s->handlers[s->nhandlers++] = fn;
+	pthread_mutex_unlock(&s->mtx);
+
+	return id;
+}
+
+/**
+ * Enqueues a task on the pool, or appends it to the log on disk if the
+ * pool is full or shedding load, or earlier tasks are still on disk
+ * @param s The spill queue
+ * @param handler The handler id
+ * @param arg The argument bytes, copied
+ * @param len Length of `arg`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set; `POOLERRNO_QUEUE_FULL` means the disk budget is
+ *   used up too.
+ */
+int spill_enqueue(spill_t *s, int handler, const void *arg, size_t len)
+{
+	int ret;
+
+	if (s == NULL || handler < 0 || handler >= s->nhandlers ||
+	    (arg == NULL && len > 0) ||
+	    len > s->segment_bytes - sizeof(spill_record_t)) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+
+	ret = -1;
+	if (s->stats.pending == 0)
+		ret = spill_push(s, handler, arg, len);
+
+	if (ret < 0 && (s->stats.pending > 0 ||
+	                poolerrno == POOLERRNO_QUEUE_FULL ||
+	                poolerrno == POOLERRNO_OVERLOADED)) {
+		ret = spill_append(s, handler, arg, len);
+		if (ret == 0 && s->stats.pending == 1)
+			pthread_cond_signal(&s->cnd);
+	}
+
+	pthread_mutex_unlock(&s->mtx);
+
+	return ret;
+}
+
+/**
+ * Copies a spill queue's counters
+ * @param s The spill queue
+ * @param stats This variable is filled with the counters
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int spill_get_stats(spill_t *s, spill_stats_t *stats)
+{
+	if (s == NULL || stats == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->mtx);
+
+	return 0;
+}
+
+/**
+ * Enqueues a copy of a task on the pool
+ * @param s The spill queue
+ * @param handler The handler id
+ * @param arg The argument bytes
+ * @param len Length of `arg`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int spill_push(spill_t *s, int handler, const void *arg, size_t len)
+{
+	spill_task_t *t;
+	pool_task_opts_t opts = { 0 };
+
+	t = (spill_task_t *)pool_task_alloc(sizeof(*t) + len);
+	if (t == NULL)
+		return -1;
+
+	t->fn = s->handlers[handler];
+	t->len = len;
+	if (len > 0)
+		memcpy(t->data, arg, len);
+
+	opts.cancel = pool_task_free;
+	if (pool_enqueue_opts(s->pool, spill_run, t, &opts) < 0) {
+		int err = poolerrno;
+		pool_task_free(t);
+		poolerrno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Appends a task to the tail segment, starting a new segment if it does
+ * not fit. Must be called with the spill mutex held.
+ * @param s The spill queue
+ * @param handler The handler id
+ * @param arg The argument bytes
+ * @param len Length of `arg`
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int spill_append(spill_t *s, int handler, const void *arg,
+	size_t len)
+{
+	size_t need = (sizeof(spill_record_t) + len + SPILL_ALIGN - 1) &
+		~(size_t)(SPILL_ALIGN - 1);
+	spill_segment_t *seg = s->tail;
+	spill_record_t rec;
+
+	if (seg == NULL || seg->wpos + need > s->segment_bytes) {
+		if ((uint64_t)(s->stats.nsegments + 1) * s->segment_bytes >
+		    s->max_bytes) {
+			s->stats.nrejected++;
+			poolerrno = POOLERRNO_QUEUE_FULL;
+			return -1;
+		}
+		if ((seg = segment_open(s)) == NULL)
+			return -1;
+	}
+
+	rec.len = (uint32_t)len;
+	rec.handler = (uint32_t)handler;
+	memcpy(seg->map + seg->wpos, &rec, sizeof(rec));
+	if (len > 0)
+		memcpy(seg->map + seg->wpos + sizeof(rec), arg, len);
+
+	seg->wpos += need;
+	seg->count++;
+	s->stats.pending++;
+	s->stats.bytes += need;
+	s->stats.nspilled++;
+
+	return 0;
+}
+
+/**
+ * Creates a new tail segment file and maps it, sealing the old tail.
+ * Must be called with the spill mutex held.
+ * @param s The spill queue
+ * @return Returns the new segment, or NULL with `poolerrno` set
+ */
+static spill_segment_t *segment_open(spill_t *s)
+{
+	spill_segment_t *seg;
+	spill_segment_t *old = s->tail;
+
+	seg = (spill_segment_t *)calloc(1, sizeof(*seg));
+	if (seg == NULL) {
+		poolerrno = ENOMEM;
+		return NULL;
+	}
+
+	seg->seq = s->next_seq;
+	if (segment_map(s, seg, 1) < 0) {
+		free(seg);
+		return NULL;
+	}
+	s->next_seq++;
+
+	/* Written pages go to disk in the background once unmapped; the
+	 * reader maps the file again when it gets there */
+	if (old != NULL) {
+		old->sealed = 1;
+		old->next = seg;
+		if (old != s->head) {
+			munmap(old->map, s->segment_bytes);
+			old->map = NULL;
+		}
+	} else {
+		s->head = seg;
+	}
+	s->tail = seg;
+	s->stats.nsegments++;
+
+	return seg;
+}
+
+/**
+ * Maps a segment file, creating it first if asked to
+ * @param s The spill queue
+ * @param seg The segment
+ * @param create Non-zero to create and size the file
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+static int segment_map(spill_t *s, spill_segment_t *seg, int create)
+{
+	char path[PATH_MAX];
+	void *map;
+	int fd;
+
+	segment_path(s, seg->seq, path, sizeof(path));
+
+	fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC :
+		O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	if (create && ftruncate(fd, s->segment_bytes) < 0) {
+		poolerrno = errno;
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	map = mmap(NULL, s->segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		poolerrno = errno;
+		if (create)
+			unlink(path);
+		return -1;
+	}
+
+	madvise(map, s->segment_bytes, MADV_SEQUENTIAL);
+	seg->map = (unsigned char *)map;
+
+	return 0;
+}
+
+/**
+ * Unmaps and removes the head segment. Must be called with the spill
+ * mutex held, or after the refill thread has stopped.
+ * @param s The spill queue
+ * @param seg The head segment
+ */
+static void segment_release(spill_t *s, spill_segment_t *seg)
+{
+	char path[PATH_MAX];
+
+	if (seg->map != NULL)
+		munmap(seg->map, s->segment_bytes);
+
+	segment_path(s, seg->seq, path, sizeof(path));
+	unlink(path);
+
+	s->stats.pending -= seg->count;
+	s->stats.bytes -= seg->wpos - seg->rpos;
+	s->stats.nsegments--;
+
+	s->head = seg->next;
+	if (s->tail == seg)
+		s->tail = NULL;
+	free(seg);
+}
+
+/**
+ * Builds a segment's file name
+ * @param s The spill queue
+ * @param seq The segment sequence number
+ * @param buf Buffer for the path
+ * @param size Size of `buf`
+ */
+static void segment_path(spill_t *s, uint64_t seq, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/spill-%d-%016llx.log", s->dir, (int)getpid(),
+		(unsigned long long)seq);
+}
+
+/**
+ * The refill thread. Takes records off the head segment in order and
+ * enqueues them on the pool, retrying while the pool is full.
+ * @param arg The spill queue
+ * @return Always returns NULL
+ */
+static void *spill_loop(void *arg)
+{
+	spill_t *s = (spill_t *)arg;
+	spill_segment_t *seg;
+	spill_record_t rec;
+	struct timespec ts;
+	size_t need;
+
+	pthread_mutex_lock(&s->mtx);
+
+	while (!s->stopping) {
+		if (s->stats.pending == 0) {
+			pthread_cond_wait(&s->cnd, &s->mtx);
+			continue;
+		}
+
+		seg = s->head;
+
+		/* Read this segment to the end, then move on to the next */
+		if (seg->rpos == seg->wpos) {
+			if (seg->sealed)
+				segment_release(s, seg);
+			continue;
+		}
+
+		if (seg->map == NULL && segment_map(s, seg, 0) < 0) {
+			/* The file is gone or unreadable: its tasks are lost */
+			seg->count = 0;
+			segment_release(s, seg);
+			continue;
+		}
+
+		memcpy(&rec, seg->map + seg->rpos, sizeof(rec));
+
+		if (spill_push(s, (int)rec.handler,
+		               seg->map + seg->rpos + sizeof(rec), rec.len) < 0) {
+			/* Pool full: give running tasks a moment to make room */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += SPILL_RETRY_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&s->cnd, &s->mtx, &ts);
+			continue;
+		}
+
+		need = (sizeof(rec) + rec.len + SPILL_ALIGN - 1) &
+			~(size_t)(SPILL_ALIGN - 1);
+		seg->rpos += need;
+		seg->count--;
+		s->stats.pending--;
+		s->stats.bytes -= need;
+		s->stats.nrefilled++;
+
+		/* The burst is over: give the disk space back */
+		if (s->stats.pending == 0)
+			while (s->head != NULL)
+				segment_release(s, s->head);
+	}
+
+	pthread_mutex_unlock(&s->mtx);
+
+	return NULL;
+}
+
+/**
+ * Pool task: runs a task's handler
+ * @param arg The `spill_task_t`
+ */
+static void spill_run(void *arg)
+{
+	spill_task_t *t = (spill_task_t *)arg;
+
+	(*t->fn)(t->data, t->len);
+	pool_task_free(t);
+}
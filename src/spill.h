@@ -0,0 +1,57 @@
+#ifndef SPILL_H_
+#define SPILL_H_
+
+#include "pool.h"
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most handlers a spill queue can register */
+#define SPILL_MAX_HANDLERS 64
+
+/**
+ * A serializable task: everything it needs is in the argument bytes, so
+ * it can be written to disk and run later
+ * @param arg The argument bytes, only valid during the call
+ * @param len Length of `arg`
+ */
+typedef void (*spill_fn_t)(const void *arg, size_t len);
+
+/**
+ * Forward declaration of a spill queue: an overflow tier in front of a
+ * pool that appends tasks the pool has no room for to a log on disk, and
+ * feeds them back in order as room frees up.
+ */
+typedef struct spill spill_t;
+
+/**
+ * A snapshot of a spill queue's counters, filled by `spill_get_stats()`
+ */
+typedef struct {
+	uint64_t nspilled; /** Tasks written to disk */
+	uint64_t nrefilled; /** Tasks read back and enqueued on the pool */
+	uint64_t nrejected; /** Tasks refused because the disk budget was used */
+	size_t pending; /** Tasks on disk now */
+	size_t bytes; /** Bytes on disk now */
+	size_t nsegments; /** Segment files on disk now */
+} spill_stats_t;
+
+/*-----------------*
+ * SPILL API CALLS *
+ *-----------------*/
+
+spill_t *spill_new(pool_t *pool, const char *dir, size_t segment_bytes,
+	uint64_t max_bytes);
+void spill_free(spill_t *s);
+int spill_register(spill_t *s, spill_fn_t fn);
+int spill_enqueue(spill_t *s, int handler, const void *arg, size_t len);
+int spill_get_stats(spill_t *s, spill_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPILL_H_ */
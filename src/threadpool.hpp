@@ -0,0 +1,330 @@
+#ifndef THREADPOOL_HPP_
+#define THREADPOOL_HPP_
+
+/*
+ * Header-only C++17 front end for the C thread pool in pool.h.
+ *
+ * Callables are dispatched through one function template per callable
+ * type, so the worker calls straight into the lambda with no type-erased
+ * heap closure in between. `submit()` keeps the lambda, move-only captures
+ * included, inside the returned future, so it does not allocate for
+ * callables up to `POOL_INLINE_ARG_SIZE` bytes. `post()` copies small
+ * trivially copyable lambdas into the queue slot itself. The pool moves
+ * slots with memcpy(), so a lambda that captures e.g. a `std::string` or
+ * a `std::shared_ptr` cannot live there; `post()` puts those in
+ * `pool_task_alloc()` memory, which is a worker-local free list when
+ * posting from a worker and malloc() anywhere else.
+ */
+
+#include "pool.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace threadpool {
+
+/**
+ * Thrown when a pool call fails. `code()` is the `poolerrno` value.
+ */
+class error : public std::runtime_error {
+public:
+	explicit error(int code)
+		: std::runtime_error(poolerrno_str(code)), code_(code) {}
+
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+/**
+ * Thrown by `future::get()` when the pool dropped the task without
+ * running it, e.g. because the pool was freed or shed the task.
+ */
+class cancelled : public std::runtime_error {
+public:
+	cancelled() : std::runtime_error("task was cancelled") {}
+};
+
+class pool;
+class schedule_awaitable;
+
+namespace detail {
+
+/**
+ * True if `Fn` fits the inline space of a queue slot, which is aligned
+ * like a pointer and moved around with memcpy().
+ */
+template <class Fn>
+inline constexpr bool fits_slot_v =
+	sizeof(Fn) <= POOL_INLINE_ARG_SIZE &&
+	alignof(Fn) <= alignof(void *) &&
+	std::is_trivially_copyable_v<Fn>;
+
+/** Result storage, with `void` mapped to an empty type */
+template <class T>
+struct result {
+	std::optional<T> value;
+
+	template <class Fn>
+	void run(Fn &fn) { value.emplace(std::invoke(fn)); }
+	T take() { return std::move(*value); }
+};
+
+template <>
+struct result<void> {
+	template <class Fn>
+	void run(Fn &fn) { std::invoke(fn); }
+	void take() {}
+};
+
+} /* namespace detail */
+
+/**
+ * The result of `pool::submit()`. The future owns the submitted callable
+ * and the slot its result is written to, so it cannot be copied or moved:
+ * keep it where `submit()` returned it (C++17 guarantees the returned
+ * object is constructed in place). Destroying a future waits for its task.
+ */
+template <class T>
+class future {
+	static_assert(!std::is_reference_v<T>,
+		"tasks submitted for a future must return by value");
+
+public:
+	future(const future &) = delete;
+	future &operator=(const future &) = delete;
+	future(future &&) = delete;
+	future &operator=(future &&) = delete;
+
+	~future()
+	{
+		wait();
+		if (destroy_ != nullptr)
+			destroy_(fn_, fn_ != static_cast<void *>(buf_));
+	}
+
+	/** @return Returns true once the task has finished or was dropped */
+	bool ready() const
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+		return done_;
+	}
+
+	/** Blocks until the task has finished or was dropped */
+	void wait() const
+	{
+		std::unique_lock<std::mutex> lock(mtx_);
+		cnd_.wait(lock, [this] { return done_; });
+	}
+
+	/**
+	 * Waits for the task and returns its result, or rethrows what it
+	 * threw. Throws `cancelled` if the pool dropped the task. Call once.
+	 */
+	T get()
+	{
+		wait();
+		if (error_)
+			std::rethrow_exception(error_);
+		return result_.take();
+	}
+
+private:
+	friend class pool;
+
+	/**
+	 * Stores the callable and enqueues this future. Only ever called as
+	 * `return future<T>(...)`, so `this` is already the caller's object.
+	 */
+	template <class F>
+	future(pool_t *p, F &&f)
+	{
+		using Fn = std::decay_t<F>;
+
+		if constexpr (sizeof(Fn) <= sizeof(buf_) &&
+		              alignof(Fn) <= alignof(std::max_align_t)) {
+			fn_ = ::new (static_cast<void *>(buf_)) Fn(std::forward<F>(f));
+		} else {
+			fn_ = new Fn(std::forward<F>(f));
+		}
+		invoke_ = &invoke<Fn>;
+		destroy_ = &destroy<Fn>;
+
+		future *self = this;
+		pool_task_opts_t opts{};
+		opts.cancel = &on_cancel;
+
+		if (pool_enqueue_inline_opts(p, &on_run, &self, sizeof(self),
+		                             &opts) < 0) {
+			int code = poolerrno;
+			destroy_(fn_, fn_ != static_cast<void *>(buf_));
+			throw error(code);
+		}
+	}
+
+	template <class Fn>
+	static void invoke(future *self)
+	{
+		try {
+			self->result_.run(*static_cast<Fn *>(self->fn_));
+		} catch (...) {
+			self->error_ = std::current_exception();
+		}
+	}
+
+	template <class Fn>
+	static void destroy(void *fn, bool heap)
+	{
+		if (heap)
+			delete static_cast<Fn *>(fn);
+		else
+			static_cast<Fn *>(fn)->~Fn();
+	}
+
+	/** Worker entry point; `arg` is the inline copy of the future pointer */
+	static void on_run(void *arg)
+	{
+		future *self;
+
+		std::memcpy(&self, arg, sizeof(self));
+		self->invoke_(self);
+		self->finish();
+	}
+
+	/** Called by the pool instead of `on_run()` if it drops the task */
+	static void on_cancel(void *arg)
+	{
+		future *self;
+
+		std::memcpy(&self, arg, sizeof(self));
+		self->error_ = std::make_exception_ptr(cancelled());
+		self->finish();
+	}
+
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(mtx_);
+		done_ = true;
+		cnd_.notify_all();
+	}
+
+	alignas(std::max_align_t) unsigned char buf_[POOL_INLINE_ARG_SIZE];
+	void *fn_ = nullptr;
+	void (*invoke_)(future *) = nullptr;
+	void (*destroy_)(void *, bool) = nullptr;
+	detail::result<T> result_;
+	std::exception_ptr error_;
+	mutable std::mutex mtx_;
+	mutable std::condition_variable cnd_;
+	bool done_ = false;
+};
+
+/**
+ * An owning wrapper around `pool_t`. Errors are reported by throwing
+ * `threadpool::error`.
+ */
+class pool {
+public:
+	explicit pool(size_t nthreads = MAX_WORKER_THREADS,
+	              size_t capacity = DEFAULT_QUEUE_CAPACITY)
+		: pool_(pool_init(nthreads, capacity))
+	{
+		if (pool_ == nullptr)
+			throw error(poolerrno);
+	}
+
+	~pool() { pool_free(pool_); }
+
+	pool(const pool &) = delete;
+	pool &operator=(const pool &) = delete;
+
+	/** @return Returns the underlying C pool for the rest of the C API */
+	pool_t *native() const noexcept { return pool_; }
+
+	/**
+	 * `co_await p.schedule()` continues the coroutine on a worker.
+	 * Defined in coro.hpp, which needs C++20.
+	 */
+	schedule_awaitable schedule() const noexcept;
+
+	/**
+	 * Runs `f()` on a worker and forgets about it. Small trivially
+	 * copyable callables are stored in the queue slot; anything else is
+	 * moved into memory from `pool_task_alloc()`, which only avoids
+	 * malloc() when called on a worker. `f` must not throw.
+	 */
+	template <class F>
+	void post(F &&f)
+	{
+		using Fn = std::decay_t<F>;
+
+		if constexpr (detail::fits_slot_v<Fn>) {
+			Fn fn(std::forward<F>(f));
+			if (pool_enqueue_inline(pool_, &run_inline<Fn>, &fn,
+			                        sizeof(fn)) < 0)
+				throw error(poolerrno);
+		} else {
+			static_assert(alignof(Fn) <= alignof(std::max_align_t),
+				"over-aligned callables are not supported");
+			void *mem = pool_task_alloc(sizeof(Fn));
+			if (mem == nullptr)
+				throw std::bad_alloc();
+			Fn *fn = ::new (mem) Fn(std::forward<F>(f));
+			pool_task_opts_t opts{};
+			opts.cancel = &drop_owned<Fn>;
+			if (pool_enqueue_opts(pool_, &run_owned<Fn>, fn, &opts) < 0) {
+				int code = poolerrno;
+				fn->~Fn();
+				pool_task_free(mem);
+				throw error(code);
+			}
+		}
+	}
+
+	/**
+	 * Runs `f()` on a worker and returns a future for its result.
+	 * Exceptions thrown by `f` are rethrown by `future::get()`.
+	 */
+	template <class F>
+	future<std::invoke_result_t<std::decay_t<F> &>> submit(F &&f)
+	{
+		return future<std::invoke_result_t<std::decay_t<F> &>>(
+			pool_, std::forward<F>(f));
+	}
+
+private:
+	template <class Fn>
+	static void run_inline(void *arg)
+	{
+		(*std::launder(static_cast<Fn *>(arg)))();
+	}
+
+	template <class Fn>
+	static void run_owned(void *arg)
+	{
+		(*static_cast<Fn *>(arg))();
+		drop_owned<Fn>(arg);
+	}
+
+	template <class Fn>
+	static void drop_owned(void *arg)
+	{
+		static_cast<Fn *>(arg)->~Fn();
+		pool_task_free(arg);
+	}
+
+	pool_t *pool_;
+};
+
+} /* namespace threadpool */
+
+#endif /* THREADPOOL_HPP_ */
@@ -0,0 +1,390 @@
+#include "trace.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> /* __rdtsc() */
+#endif
+
+/** Identifies a capture file written by `trace_write()` */
+#define TRACE_MAGIC      "PTRC"
+#define TRACE_VERSION    1
+
+/** Header at the start of every capture file */
+typedef struct {
+	char magic[4]; /** Always TRACE_MAGIC */
+	uint32_t version; /** Always TRACE_VERSION */
+	uint64_t nevents; /** Number of events following the header */
+	uint64_t base_tsc; /** Tick value used as time zero */
+	double ticks_per_us; /** Measured TSC rate */
+} trace_header_t;
+
+#ifdef POOL_TRACE
+
+/** Events kept per thread. The oldest events are overwritten first */
+#define TRACE_RING_SIZE  16384
+
+/**
+ * A thread's event ring. Only the owning thread writes to it; `head` is
+ * the total number of events ever written and is published with release
+ * ordering so `trace_write()` can take a consistent snapshot.
+ */
+typedef struct trace_buf {
+	struct trace_buf *next; /** Next ring in the global list */
+	atomic_uint_fast64_t head; /** Number of events written so far */
+	atomic_int in_use; /** Non-zero while a live thread owns the ring */
+	uint32_t tid; /** Small thread id stored in each event */
+	trace_event_t ev[TRACE_RING_SIZE]; /** The events */
+} trace_buf_t;
+
+atomic_int trace_enabled = 0;
+
+static pthread_mutex_t bufs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf_t *bufs = NULL;
+static uint32_t next_tid = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static __thread trace_buf_t *self = NULL;
+
+/* Reference points for converting ticks to wall time */
+static uint64_t base_tsc = 0;
+static uint64_t base_ns = 0;
+
+/**
+ * Reads the cheapest available high-resolution clock
+ * @return Returns TSC ticks on x86, monotonic nanoseconds elsewhere
+ */
+static inline uint64_t trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @return Returns CLOCK_MONOTONIC in nanoseconds
+ */
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Thread-exit destructor. The ring stays on the list so its events can
+ * still be written out, but may be taken over by a new thread.
+ * @param arg The exiting thread's ring
+ */
+static void buf_release(void *arg)
+{
+	atomic_store(&((trace_buf_t *)arg)->in_use, 0);
+}
+
+static void key_init(void)
+{
+	pthread_key_create(&key, buf_release);
+}
+
+/**
+ * Finds a ring for the calling thread, reusing one left by an exited
+ * thread if possible. Only runs once per thread.
+ * @return Returns the ring, or NULL if out of memory
+ */
+static trace_buf_t *buf_acquire(void)
+{
+	trace_buf_t *b;
+	int expected;
+
+	pthread_once(&key_once, key_init);
+	pthread_mutex_lock(&bufs_mtx);
+
+	for (b = bufs; b != NULL; b = b->next) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&b->in_use, &expected, 1))
+			break;
+	}
+
+	if (b == NULL && (b = (trace_buf_t *)calloc(1, sizeof(*b))) != NULL) {
+		atomic_init(&b->head, 0);
+		atomic_init(&b->in_use, 1);
+		b->tid = ++next_tid;
+		b->next = bufs;
+		bufs = b;
+	}
+
+	pthread_mutex_unlock(&bufs_mtx);
+
+	if (b != NULL)
+		pthread_setspecific(key, b);
+
+	return b;
+}
+
+/**
+ * Appends one event to the calling thread's ring. Called through the
+ * TRACE_EVENT() macro, which checks `trace_enabled` first.
+ * @param type The kind of event
+ * @param id The task id
+ */
+void trace_record(trace_type_t type, uint64_t id)
+{
+	trace_buf_t *b = self;
+	trace_event_t *ev;
+	uint_fast64_t head;
+
+	if (b == NULL && (b = self = buf_acquire()) == NULL)
+		return;
+
+	head = atomic_load_explicit(&b->head, memory_order_relaxed);
+	ev = &b->ev[head & (TRACE_RING_SIZE - 1)];
+	ev->tsc = trace_now();
+	ev->id = id;
+	ev->type = type;
+	ev->tid = b->tid;
+	atomic_store_explicit(&b->head, head + 1, memory_order_release);
+}
+
+/**
+ * Turns event recording on or off at runtime. Has no effect unless the
+ * program was built with POOL_TRACE.
+ * @param enabled Non-zero to record events
+ */
+void trace_set_enabled(int enabled)
+{
+	if (enabled && base_ns == 0) {
+		base_ns = mono_ns();
+		base_tsc = trace_now();
+	}
+
+	atomic_store(&trace_enabled, enabled ? 1 : 0);
+}
+
+/**
+ * @return Returns non-zero if events are currently being recorded
+ */
+int trace_is_enabled(void)
+{
+	return atomic_load(&trace_enabled);
+}
+
+/**
+ * Orders events by timestamp for qsort()
+ */
+static int event_cmp(const void *a, const void *b)
+{
+	uint64_t ta = ((const trace_event_t *)a)->tsc;
+	uint64_t tb = ((const trace_event_t *)b)->tsc;
+
+	return (ta > tb) - (ta < tb);
+}
+
+/**
+ * Writes a snapshot of every thread's ring to a binary capture file,
+ * sorted by time. Recording may continue while this runs; events that
+ * could have been overwritten during the copy are left out.
+ * @param path The file to create
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int trace_write(const char *path)
+{
+	trace_header_t hdr;
+	trace_event_t *evs = NULL;
+	trace_buf_t *b;
+	size_t n = 0;
+	size_t cap = 0;
+	uint64_t ns;
+	FILE *fp;
+
+	if (path == NULL || base_ns == 0) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&bufs_mtx);
+
+	for (b = bufs; b != NULL; b = b->next)
+		cap += TRACE_RING_SIZE;
+
+	if ((evs = (trace_event_t *)malloc(cap * sizeof(*evs) + 1)) == NULL) {
+		pthread_mutex_unlock(&bufs_mtx);
+		poolerrno = ENOMEM;
+		return -1;
+	}
+
+	for (b = bufs; b != NULL; b = b->next) {
+		uint64_t h1, h2, first;
+
+		h1 = atomic_load_explicit(&b->head, memory_order_acquire);
+		first = h1 > TRACE_RING_SIZE ? h1 - TRACE_RING_SIZE : 0;
+		for (uint64_t i = first; i < h1; i++)
+			evs[n + (i - first)] = b->ev[i & (TRACE_RING_SIZE - 1)];
+
+		/* Anything the writer lapped while we copied is suspect, and
+		 * so is the slot it may be filling before publishing `h2 + 1` */
+		h2 = atomic_load_explicit(&b->head, memory_order_acquire);
+		if (h2 - first >= TRACE_RING_SIZE) {
+			uint64_t skip = h2 + 1 - first - TRACE_RING_SIZE;
+			if (skip > h1 - first)
+				skip = h1 - first;
+			memmove(&evs[n], &evs[n + skip],
+				(h1 - first - skip) * sizeof(*evs));
+			n += h1 - first - skip;
+		} else {
+			n += h1 - first;
+		}
+	}
+
+	pthread_mutex_unlock(&bufs_mtx);
+
+	qsort(evs, n, sizeof(*evs), event_cmp);
+
+	ns = mono_ns();
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.nevents = n;
+	hdr.base_tsc = base_tsc;
+	hdr.ticks_per_us = ns > base_ns ?
+		(double)(trace_now() - base_tsc) * 1000.0 / (double)(ns - base_ns) :
+		1000.0;
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		poolerrno = errno;
+		free(evs);
+		return -1;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(evs, sizeof(*evs), n, fp) != n) {
+		poolerrno = errno;
+		fclose(fp);
+		free(evs);
+		return -1;
+	}
+
+	free(evs);
+
+	if (fclose(fp) != 0) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+#else /* !POOL_TRACE */
+
+void trace_set_enabled(int enabled)
+{
+	(void)enabled;
+}
+
+int trace_is_enabled(void)
+{
+	return 0;
+}
+
+int trace_write(const char *path)
+{
+	(void)path;
+	poolerrno = ENOTSUP;
+	return -1;
+}
+
+#endif /* POOL_TRACE */
+
+/**
+ * Converts a capture file written by `trace_write()` to the Chrome trace
+ * event JSON format, which chrome://tracing and Perfetto can load. Each
+ * task is drawn as a slice on the worker that ran it, with a flow arrow
+ * from the thread that enqueued it.
+ * @param path The capture file to read
+ * @param out Where to write the JSON
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int trace_export_chrome(const char *path, FILE *out)
+{
+	trace_header_t hdr;
+	trace_event_t ev;
+	FILE *fp;
+	const char *sep = "";
+
+	if (path == NULL || out == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		poolerrno = errno;
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != TRACE_VERSION || hdr.ticks_per_us <= 0) {
+		fclose(fp);
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	fprintf(out, "{\"traceEvents\":[");
+
+	for (uint64_t i = 0; i < hdr.nevents; i++) {
+		double ts;
+
+		if (fread(&ev, sizeof(ev), 1, fp) != 1)
+			break;
+
+		ts = (double)(int64_t)(ev.tsc - hdr.base_tsc) / hdr.ticks_per_us;
+
+		switch (ev.type) {
+		case TRACE_ENQUEUE:
+			fprintf(out, "%s\n{\"name\":\"enqueue\",\"ph\":\"i\",\"s\":\"t\","
+				"\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"id\":%llu}}",
+				sep, ts, ev.tid, (unsigned long long)ev.id);
+			fprintf(out, ",\n{\"name\":\"queue\",\"cat\":\"task\",\"ph\":\"s\","
+				"\"id\":%llu,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+				(unsigned long long)ev.id, ts, ev.tid);
+			break;
+		case TRACE_DEQUEUE:
+			fprintf(out, "%s\n{\"name\":\"dequeue\",\"ph\":\"i\",\"s\":\"t\","
+				"\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"id\":%llu}}",
+				sep, ts, ev.tid, (unsigned long long)ev.id);
+			break;
+		case TRACE_START:
+			fprintf(out, "%s\n{\"name\":\"queue\",\"cat\":\"task\",\"ph\":\"f\","
+				"\"bp\":\"e\",\"id\":%llu,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+				sep, (unsigned long long)ev.id, ts, ev.tid);
+			fprintf(out, ",\n{\"name\":\"task\",\"ph\":\"B\",\"ts\":%.3f,"
+				"\"pid\":1,\"tid\":%u,\"args\":{\"id\":%llu}}",
+				ts, ev.tid, (unsigned long long)ev.id);
+			break;
+		case TRACE_END:
+			fprintf(out, "%s\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+				sep, ts, ev.tid);
+			break;
+		default:
+			continue;
+		}
+
+		sep = ",";
+	}
+
+	fprintf(out, "\n]}\n");
+	fclose(fp);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h> /* FILE */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The kinds of event recorded for every task. The four events of one task
+ * share the same task id.
+ */
+typedef enum {
+	TRACE_ENQUEUE = 1, /** Task was put on the queue */
+	TRACE_DEQUEUE, /** A worker took the task off the queue */
+	TRACE_START, /** The task function is about to be called */
+	TRACE_END, /** The task function returned */
+} trace_type_t;
+
+/**
+ * A single trace event, as stored in the per-thread rings and in capture
+ * files. Timestamps are raw TSC ticks; capture files carry the tick rate.
+ */
+typedef struct {
+	uint64_t tsc; /** Timestamp in TSC ticks */
+	uint64_t id; /** Task id, assigned in queue order */
+	uint32_t type; /** One of `trace_type_t` */
+	uint32_t tid; /** Small id of the thread that recorded the event */
+} trace_event_t;
+
+/*-----------------*
+ * TRACE API CALLS *
+ *-----------------*/
+
+void trace_set_enabled(int enabled);
+int trace_is_enabled(void);
+int trace_write(const char *path);
+int trace_export_chrome(const char *path, FILE *out);
+
+/*
+ * Recording is compiled in only when POOL_TRACE is defined. Otherwise the
+ * hook below expands to nothing and tracing costs nothing at all.
+ */
+#ifdef POOL_TRACE
+#include <stdatomic.h>
+
+extern atomic_int trace_enabled;
+void trace_record(trace_type_t type, uint64_t id);
+
+#define TRACE_EVENT(type, id) \
+	do { \
+		if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) \
+			trace_record((type), (id)); \
+	} while (0)
+#else
+#define TRACE_EVENT(type, id) do { (void)(id); } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,125 @@
+#include "wire.h"
+#include "pool.h"
+#include <errno.h>
+
+/**
+ * Tells whether a message uses binary framing rather than JSON
+ * @param buf The first bytes of the message
+ * @param len Number of bytes in `buf`
+ * @return Returns 1 if `buf` starts a binary frame, else 0
+ */
+int wire_is_frame(const void *buf, size_t len)
+{
+	return buf != NULL && len > 0 &&
+		((const unsigned char *)buf)[WIRE_OFF_MAGIC] == WIRE_MAGIC;
+}
+
+/**
+ * Works out how many bytes a frame needs from the bytes read so far, so
+ * a reader knows when to stop
+ * @param buf The bytes read so far
+ * @param len Number of bytes in `buf`
+ * @return Returns the full frame length once the header is in, else the
+ *   header size
+ */
+size_t wire_frame_len(const void *buf, size_t len)
+{
+	if (len < WIRE_HDR_SIZE)
+		return WIRE_HDR_SIZE;
+
+	return WIRE_HDR_SIZE +
+		(size_t)wire_get_u32((const unsigned char *)buf + WIRE_OFF_LEN);
+}
+
+/**
+ * Checks a frame's header and points `msg` at its body. Only the header
+ * is looked at; the body is left for the handler to read in place.
+ * @param buf The frame
+ * @param len Number of bytes in `buf`
+ * @param msg Filled with the frame's type, status and body
+ * @return Returns 0 on success. On error, less than 0 is returned and
+ *   `poolerrno` is set: EPROTO if the header is not a supported frame,
+ *   EMSGSIZE if the body is not all there.
+ */
+int wire_parse(const void *buf, size_t len, wire_msg_t *msg)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t blen;
+
+	if (buf == NULL || msg == NULL) {
+		poolerrno = EINVAL;
+		return -1;
+	}
+
+	if (len < WIRE_HDR_SIZE || p[WIRE_OFF_MAGIC] != WIRE_MAGIC ||
+	    p[WIRE_OFF_VERSION] != WIRE_VERSION) {
+		poolerrno = EPROTO;
+		return -1;
+	}
+
+	blen = wire_get_u32(p + WIRE_OFF_LEN);
+	if (blen > len - WIRE_HDR_SIZE) {
+		poolerrno = EMSGSIZE;
+		return -1;
+	}
+
+	msg->type = wire_get_u16(p + WIRE_OFF_TYPE);
+	msg->status = wire_get_u16(p + WIRE_OFF_STATUS);
+	msg->body = p + WIRE_HDR_SIZE;
+	msg->len = blen;
+
+	return 0;
+}
+
+/**
+ * Writes a frame header in front of a body that is already in place at
+ * `out + WIRE_HDR_SIZE`
+ * @param out Buffer holding the frame
+ * @param outlen Size of `out`
+ * @param type Route id
+ * @param status Status, 0 or a `poolerrno` value
+ * @param len Length of the body
+ * @return Returns the frame length. On error, less than 0 is returned and
+ *   `poolerrno` is set.
+ */
+int wire_frame(void *out, size_t outlen, uint16_t type, uint16_t status,
+	size_t len)
+{
+	unsigned char *p = (unsigned char *)out;
+
+	if (out == NULL || outlen < WIRE_HDR_SIZE ||
+	    len > outlen - WIRE_HDR_SIZE || len > UINT32_MAX) {
+		poolerrno = ENOSPC;
+		return -1;
+	}
+
+	p[WIRE_OFF_MAGIC] = WIRE_MAGIC;
+	p[WIRE_OFF_VERSION] = WIRE_VERSION;
+	wire_put_u16(p + WIRE_OFF_TYPE, type);
+	wire_put_u16(p + WIRE_OFF_STATUS, status);
+	wire_put_u16(p + WIRE_OFF_RESERVED, 0);
+	wire_put_u32(p + WIRE_OFF_LEN, (uint32_t)len);
+
+	return (int)(WIRE_HDR_SIZE + len);
+}
+
+/**
+ * Writes an empty error reply to a request. The reply carries the
+ * request's type if its header was readable, else 0.
+ * @param req The request
+ * @param reqlen Number of bytes in `req`
+ * @param out Buffer for the reply
+ * @param outlen Size of `out`
+ * @param err The error, a `poolerrno` value
+ * @return Returns the reply length, or less than 0 if `out` is too small
+ */
+int wire_error(const void *req, size_t reqlen, void *out, size_t outlen,
+	int err)
+{
+	uint16_t type = 0;
+
+	if (req != NULL && reqlen >= WIRE_HDR_SIZE)
+		type = wire_get_u16((const unsigned char *)req + WIRE_OFF_TYPE);
+
+	return wire_frame(out, outlen, type, (uint16_t)err, 0);
+}
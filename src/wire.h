@@ -0,0 +1,136 @@
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <stdlib.h> /* size_t */
+#include <stdint.h>
+#include <string.h> /* memcpy() */
+#include <endian.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * First byte of every binary frame. It can never start a JSON text, so
+ * the first byte of a connection tells the two framings apart.
+ */
+#define WIRE_MAGIC   0xB1
+#define WIRE_VERSION 1
+
+/** Size of the fixed header in front of every frame */
+#define WIRE_HDR_SIZE 12
+
+/*
+ * Frame layout. All integers are little-endian, and every field sits at a
+ * fixed offset, so a frame is read in place with no parse pass:
+ *
+ *   0  u8   magic, WIRE_MAGIC
+ *   1  u8   version, WIRE_VERSION
+ *   2  u16  type, the route id; a reply carries the request's
+ *   4  u16  status, 0 in requests; in replies 0 or a poolerrno value
+ *   6  u16  reserved, 0
+ *   8  u32  body length
+ *  12       body
+ *
+ * Bodies follow the same rule: fixed-size fields first at known offsets,
+ * then any variable-length data, read with the accessors below.
+ */
+#define WIRE_OFF_MAGIC    0
+#define WIRE_OFF_VERSION  1
+#define WIRE_OFF_TYPE     2
+#define WIRE_OFF_STATUS   4
+#define WIRE_OFF_RESERVED 6
+#define WIRE_OFF_LEN      8
+
+/**
+ * A frame handed to a binary route handler. `body` points into the
+ * received buffer and is only valid during the call.
+ */
+typedef struct {
+	uint16_t type; /** Route id */
+	uint16_t status; /** 0 in requests, else 0 or a `poolerrno` value */
+	const unsigned char *body; /** The body, in place */
+	size_t len; /** Length of `body` */
+} wire_msg_t;
+
+/*-----------*
+ * ACCESSORS *
+ *-----------*/
+
+/**
+ * @return Returns the little-endian u16 at `p`, which need not be aligned
+ */
+static inline uint16_t wire_get_u16(const void *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+/**
+ * @return Returns the little-endian u32 at `p`, which need not be aligned
+ */
+static inline uint32_t wire_get_u32(const void *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+/**
+ * @return Returns the little-endian u64 at `p`, which need not be aligned
+ */
+static inline uint64_t wire_get_u64(const void *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+/**
+ * Stores `v` at `p` as a little-endian u16
+ */
+static inline void wire_put_u16(void *p, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * Stores `v` at `p` as a little-endian u32
+ */
+static inline void wire_put_u32(void *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * Stores `v` at `p` as a little-endian u64
+ */
+static inline void wire_put_u64(void *p, uint64_t v)
+{
+	v = htole64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/*----------------*
+ * WIRE API CALLS *
+ *----------------*/
+
+int wire_is_frame(const void *buf, size_t len);
+size_t wire_frame_len(const void *buf, size_t len);
+int wire_parse(const void *buf, size_t len, wire_msg_t *msg);
+int wire_frame(void *out, size_t outlen, uint16_t type, uint16_t status,
+	size_t len);
+int wire_error(const void *req, size_t reqlen, void *out, size_t outlen,
+	int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WIRE_H_ */